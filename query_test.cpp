@@ -0,0 +1,155 @@
+// Uncanny query test file.
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace std;
+#include <initializer_list>
+#include <iostream>
+#include <string>
+#include "uncanny_query.h"
+using namespace Uncanny;
+using namespace UncannyQuery;
+
+// Assembles ops, with a final OP_RETURN.
+static string program(initializer_list<unsigned char> ops) {
+	string s(ops.begin(), ops.end());
+	return s + (char)OP_RETURN;
+}
+
+static int unpack(Tree* tree, const string& base_case, const string& compute, const string& compare) {
+	string desc = describe_augmentation(base_case, compute, compare);
+	return unpack_augmentation(tree, desc.size(), desc.data());
+}
+
+int main(int argc, char** argv) {
+	string desc = describe_tree(program({OP_A, OP_B, OP_CMP_I}), MEM_NONE, MEM_NONE);
+	Tree* tree = unpack_tree(desc.size(), desc.data());
+	assert(tree != NULL);
+
+	string sum = program({OP_A, OP_B, OP_ADD_I});
+	string equal = program({OP_A, OP_B, OP_EQ});
+	int sum_id = unpack(tree, program({OP_VALUE}), sum, equal);
+	int max_id = unpack(tree, program({OP_KEY}), program({OP_B, OP_A, OP_MAX_I}), equal);
+	string one;
+	emit_constant(one, 1LL);
+	one += (char)OP_RETURN;
+	int count_id = unpack(tree, one, sum, equal);
+	// Sums of squares, and a sum written so it isn't recognized, are interpreted.
+	int squares_id = unpack(tree, program({OP_VALUE, OP_DUP, OP_MUL_I}), sum, equal);
+	string slow_sum = program({OP_A, OP_B, OP_ADD_I, OP_B_LENGTH, OP_B_LENGTH, OP_SUB_I, OP_ADD_I});
+	int slow_id = unpack(tree, program({OP_VALUE}), slow_sum, program({OP_A, OP_B, OP_SUB_I, OP_NOT}));
+	assert(sum_id > 0 and max_id > 0 and count_id > 0 and squares_id > 0 and slow_id > 0);
+	// Whole augmentations the tree has builtins for become builtins. Otherwise
+	// recognized programs still run natively, and the rest are interpreted.
+	assert(tree->aug_ctx.augs[sum_id].builtin == BUILTIN_SUM_I64 and tree->aug_ctx.augs[count_id].builtin == BUILTIN_COUNT);
+	assert(tree->aug_ctx.augs[max_id].builtin == BUILTIN_NONE and tree->aug_ctx.augs[squares_id].builtin == BUILTIN_NONE);
+	assert(tree->aug_ctx.augs[squares_id].base_case != tree->aug_ctx.augs[slow_id].base_case);
+
+	for (long long i=0; i<200; i++)
+		tree->insert((void*)((i * 37) % 200), (void*)(i - 50));
+	for (long long low=0; low<200; low += 13) {
+		for (long long high=low+1; high<=200; high += 17) {
+			long long total = 0, maximum = 0, count = 0, square_total = 0;
+			for (long long k=low; k<high; k++) {
+				long long value = (long long)tree->get_default((void*)k, NULL);
+				total += value;
+				square_total += value * value;
+				maximum = k;
+				count++;
+			}
+			AugmentationResult output;
+			assert(tree->augment_range(sum_id, (void*)low, true, (void*)high, false, &output) == (size_t)count);
+			assert(output.data.l == total);
+			tree->augment_range(max_id, (void*)low, true, (void*)high, false, &output);
+			assert(output.data.l == maximum);
+			tree->augment_range(count_id, (void*)low, true, (void*)high, false, &output);
+			assert(output.data.l == count);
+			tree->augment_range(squares_id, (void*)low, true, (void*)high, false, &output);
+			assert(output.data.l == square_total);
+			tree->augment_range(slow_id, (void*)low, true, (void*)high, false, &output);
+			assert(output.data.l == total);
+		}
+	}
+	// Integer sums and products wrap, whether builtin, native or interpreted.
+	const unsigned long long big = 0x7fffffffffffffffULL;
+	tree->insert((void*)200, (void*)big);
+	tree->insert((void*)201, (void*)1);
+	AugmentationResult wrapped;
+	tree->augment_range(sum_id, (void*)200, true, (void*)202, false, &wrapped);
+	assert(wrapped.data.ul == big + 1);
+	tree->augment_range(slow_id, (void*)200, true, (void*)202, false, &wrapped);
+	assert(wrapped.data.ul == big + 1);
+	tree->augment_range(squares_id, (void*)200, true, (void*)202, false, &wrapped);
+	assert(wrapped.data.ul == big * big + 1);
+	delete tree;
+	cout << "Native and interpreted augmentations OK" << endl;
+
+	// An interpreted comparator, ordering doubles from largest to smallest.
+	desc = describe_tree(program({OP_B, OP_A, OP_CMP_D}), MEM_NONE, MEM_FREE);
+	tree = unpack_tree(desc.size(), desc.data());
+	assert(tree != NULL and tree->value_deallocator == free);
+	int min_id = unpack(tree, program({OP_KEY}), program({OP_A, OP_B, OP_MIN_D}), equal);
+	void* keys[100];
+	for (int i=0; i<100; i++) {
+		double key = i * 0.5;
+		memcpy(&keys[i], &key, sizeof(double));
+		tree->insert(keys[i], malloc(1));
+	}
+	int expected = 99;
+	for (Tree::iterator iter = tree->begin(); iter != tree->end(); iter++)
+		assert(iter.node != 0 and tree->nodes[iter.node].key == keys[expected--]);
+	assert(expected == -1);
+	AugmentationResult output;
+	assert(tree->augment_range(min_id, keys[80], true, keys[10], false, &output) == 70);
+	assert(output.data.d == 5.5);
+	for (int i=0; i<100; i++)
+		tree->remove(keys[i]);
+	delete tree;
+	cout << "Interpreted comparator OK" << endl;
+
+	// Malformed descriptions are refused.
+	desc = describe_augmentation(program({OP_A}), sum, equal);
+	tree = new Tree();
+	assert(unpack_augmentation(tree, desc.size(), desc.data()) == -1);
+	desc = describe_augmentation(program({OP_VALUE, OP_ADD_I}), sum, equal);
+	assert(unpack_augmentation(tree, desc.size(), desc.data()) == -1);
+	desc = describe_augmentation(program({OP_VALUE, OP_CONSTANT}), sum, equal);
+	assert(unpack_augmentation(tree, desc.size(), desc.data()) == -1);
+	desc = describe_augmentation(string(1, (char)OP_VALUE), sum, equal);
+	assert(unpack_augmentation(tree, desc.size(), desc.data()) == -1);
+	desc = describe_augmentation(program({OP_VALUE, OP_VALUE}), sum, equal);
+	assert(unpack_augmentation(tree, desc.size(), desc.data()) == -1);
+	desc = describe_augmentation(program({OP_VALUE}), sum, equal);
+	assert(unpack_augmentation(tree, desc.size() - 1, desc.data()) == -1);
+	desc[12] = AUGMENTATION_DISTINGUISHER + 1;
+	assert(unpack_augmentation(tree, desc.size(), desc.data()) == -1);
+	assert(tree->aug_ctx.augs.empty());
+	delete tree;
+	cout << "Malformed descriptions OK" << endl;
+
+	// Malformed descriptions claim no slots, and identical programs share one.
+	tree = new Tree();
+	string squares = program({OP_VALUE, OP_DUP, OP_MUL_I});
+	for (int i=0; i<2*MAX_INTERPRETED; i++) {
+		assert(unpack(tree, squares, program({OP_A, OP_ADD_I}), equal) == -1);
+		assert(unpack(tree, squares, sum, equal) >= 0);
+	}
+	// Distinct programs run out of slots, but those already unpacked still work.
+	int distinct = 0;
+	for (;; distinct++) {
+		string shifted(1, (char)OP_VALUE);
+		emit_constant(shifted, (long long)distinct);
+		shifted += program({OP_ADD_I});
+		if (unpack(tree, shifted, sum, equal) == -1)
+			break;
+	}
+	assert(distinct > 0 and distinct < MAX_INTERPRETED);
+	assert(unpack(tree, squares, sum, equal) >= 0);
+	delete tree;
+	cout << "Interpreted program slots OK" << endl;
+
+	return 0;
+}
+
@@ -0,0 +1,449 @@
+// Uncanny trees benchmarks.
+// Compares a tree against std::map, and against a linear scan of an unsorted vector,
+// printing one CSV line per measurement:
+//   benchmark,structure,distribution,size,operations,ns_per_op
+// Every run draws the same keys from the same seeds, so runs are comparable across changes.
+//
+// Usage: ucan_bench [max_size [filter]]
+// Sizes run from 10^3 up to max_size, default 10^6, at most 10^8. If filter is
+// given, only benchmarks whose names contain it are run.
+
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace std;
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "uncanny.h"
+#include "uncanny_keys.h"
+#include "uncanny_sharded.h"
+#include "uncanny_wal.h"
+using namespace Uncanny;
+
+typedef BasicTree<long long, long long> BenchTree;
+
+// Keeps the compiler from optimizing away results nobody looks at.
+static volatile long long sink;
+
+// The number of operations timed per measurement.
+static const size_t OPERATIONS = 200000;
+// Linear scans, and rebuilding cold caches, are O(n) per operation, so get this much work in total.
+static const double SLOW_WORK = 2e7;
+
+enum Distribution {
+	UNIFORM,
+	SEQUENTIAL,
+	ZIPFIAN,
+};
+
+static const char* distribution_names[] = {"uniform", "sequential", "zipfian"};
+
+// Zipfian ranks in [0, n), as in YCSB's generator (Gray et al., "Quickly Generating
+// Billion-Record Synthetic Databases"), with theta 0.99.
+struct Zipfian {
+	long long n;
+	double theta, alpha, zetan, eta;
+
+	Zipfian(long long _n) : n(_n), theta(0.99) {
+		zetan = 0;
+		for (long long i=1; i<=n; i++)
+			zetan += 1 / pow((double)i, theta);
+		double zeta2 = 1 + 1 / pow(2.0, theta);
+		alpha = 1 / (1 - theta);
+		eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zetan);
+	}
+
+	long long operator()(mt19937_64& rng) {
+		double u = uniform_real_distribution<double>(0, 1)(rng);
+		double uz = u * zetan;
+		if (uz < 1) return 0;
+		if (uz < 1 + pow(0.5, theta)) return 1;
+		return min(n - 1, (long long)(n * pow(eta * u - eta + 1, alpha)));
+	}
+};
+
+// Keys are 0 to n-1. Returns count of them, drawn from distribution.
+// Zipfian ranks are scattered over the keys, so the hot keys aren't all together.
+static vector<long long> draw(Distribution distribution, long long n, size_t count, unsigned seed) {
+	mt19937_64 rng(seed);
+	vector<long long> keys(count);
+	if (distribution == UNIFORM) {
+		uniform_int_distribution<long long> uniform(0, n - 1);
+		for (size_t i=0; i<count; i++)
+			keys[i] = uniform(rng);
+	} else if (distribution == SEQUENTIAL) {
+		for (size_t i=0; i<count; i++)
+			keys[i] = i % n;
+	} else {
+		Zipfian zipfian(n);
+		for (size_t i=0; i<count; i++)
+			keys[i] = (long long)((unsigned long long)zipfian(rng) * 2654435761ull % n);
+	}
+	return keys;
+}
+
+// Every key once, in order or shuffled.
+static vector<long long> permutation(Distribution distribution, long long n, unsigned seed) {
+	vector<long long> keys(n);
+	for (long long i=0; i<n; i++)
+		keys[i] = i;
+	if (distribution == UNIFORM) {
+		mt19937_64 rng(seed);
+		shuffle(keys.begin(), keys.end(), rng);
+	}
+	return keys;
+}
+
+static long long value_of(long long key) {
+	return (key * 7919) % 1000;
+}
+
+struct Timer {
+	chrono::steady_clock::time_point start;
+	Timer() : start(chrono::steady_clock::now()) {}
+	double seconds() {
+		return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	}
+};
+
+static const char* filter = NULL;
+
+static bool wanted(const char* benchmark) {
+	return filter == NULL or strstr(benchmark, filter) != NULL;
+}
+
+static void report(const char* benchmark, const char* structure, const char* distribution, long long n, size_t operations, double seconds) {
+	printf("%s,%s,%s,%lld,%zu,%.1f\n", benchmark, structure, distribution, n, operations, seconds * 1e9 / operations);
+	fflush(stdout);
+}
+
+// How many O(n) operations to time at size n.
+static size_t slow_operations(long long n) {
+	return max((size_t)10, min(OPERATIONS, (size_t)(SLOW_WORK / n)));
+}
+
+// The structures under test, all holding keys 0 to n-1.
+struct Fixture {
+	long long n;
+	BenchTree tree;
+	int sum_id;
+	map<long long, long long> std_map;
+	vector<pair<long long, long long> > unsorted;
+
+	Fixture(long long _n, bool with_scan) : n(_n) {
+		BenchTree::Augmentation sum(BUILTIN_SUM_I64);
+		sum_id = tree.aug_ctx.new_augmentation(&sum);
+		vector<long long> keys = permutation(UNIFORM, n, 1);
+		for (long long i=0; i<n; i++) {
+			tree.insert(keys[i], value_of(keys[i]));
+			std_map[keys[i]] = value_of(keys[i]);
+			if (with_scan)
+				unsorted.push_back(make_pair(keys[i], value_of(keys[i])));
+		}
+	}
+
+	// Throws away every cached augmentation, by registering the sum afresh.
+	void chill() {
+		tree.aug_ctx.delete_augmentation(sum_id);
+		BenchTree::Augmentation sum(BUILTIN_SUM_I64);
+		sum_id = tree.aug_ctx.new_augmentation(&sum);
+	}
+
+	void warm() {
+		AugmentationResult output;
+		tree.augment_range(sum_id, 0, true, n, false, &output);
+	}
+
+	long long tree_range(long long low, long long high) {
+		AugmentationResult output;
+		return tree.augment_range(sum_id, low, true, high, false, &output) == 0 ? 0 : output.data.l;
+	}
+
+	long long map_range(long long low, long long high) {
+		long long total = 0;
+		for (map<long long, long long>::iterator iter = std_map.lower_bound(low); iter != std_map.end() and iter->first < high; iter++)
+			total += iter->second;
+		return total;
+	}
+
+	long long scan_range(long long low, long long high) {
+		long long total = 0;
+		for (size_t i=0; i<unsorted.size(); i++)
+			if (unsorted[i].first >= low and unsorted[i].first < high)
+				total += unsorted[i].second;
+		return total;
+	}
+};
+
+static void bench_insert(long long n) {
+	if (not wanted("insert")) return;
+	for (int d=UNIFORM; d<=SEQUENTIAL; d++) {
+		vector<long long> keys = permutation((Distribution)d, n, 2);
+		{
+			BenchTree tree;
+			Timer timer;
+			for (long long i=0; i<n; i++)
+				tree.insert(keys[i], i);
+			report("insert", "uncanny", distribution_names[d], n, n, timer.seconds());
+		}
+		{
+			map<long long, long long> std_map;
+			Timer timer;
+			for (long long i=0; i<n; i++)
+				std_map[keys[i]] = i;
+			report("insert", "std::map", distribution_names[d], n, n, timer.seconds());
+		}
+		{
+			// Logged and group committed, including the final sync and any checkpoints.
+			char directory[] = "/tmp/ucan_bench_wal_XXXXXX";
+			if (mkdtemp(directory) == NULL)
+				continue;
+			{
+				BasicDurableTree<long long, long long> durable;
+				// Skip the measurement if the log can't be opened or written.
+				if (durable.open(directory)) {
+					Timer timer;
+					for (long long i=0; i<n; i++)
+						durable.insert(keys[i], i);
+					if (durable.close())
+						report("insert", "uncanny_wal", distribution_names[d], n, n, timer.seconds());
+				}
+				vector<pair<uint64_t, string> > segments = durable.list_segments();
+				for (size_t i=0; i<segments.size(); i++)
+					unlink(segments[i].second.c_str());
+			}
+			unlink((string(directory) + "/checkpoint").c_str());
+			rmdir(directory);
+		}
+	}
+}
+
+static void bench_remove(long long n) {
+	if (not wanted("remove")) return;
+	for (int d=UNIFORM; d<=SEQUENTIAL; d++) {
+		vector<long long> keys = permutation((Distribution)d, n, 3);
+		Fixture fixture(n, false);
+		Timer timer;
+		for (long long i=0; i<n; i++)
+			fixture.tree.remove(keys[i]);
+		report("remove", "uncanny", distribution_names[d], n, n, timer.seconds());
+		timer = Timer();
+		for (long long i=0; i<n; i++)
+			fixture.std_map.erase(keys[i]);
+		report("remove", "std::map", distribution_names[d], n, n, timer.seconds());
+	}
+}
+
+static void bench_get(Fixture& fixture) {
+	if (not wanted("get")) return;
+	long long n = fixture.n;
+	for (int d=UNIFORM; d<=ZIPFIAN; d++) {
+		vector<long long> keys = draw((Distribution)d, n, OPERATIONS, 4);
+		long long total = 0;
+		Timer timer;
+		for (size_t i=0; i<keys.size(); i++)
+			total += *fixture.tree.get(keys[i]);
+		report("get", "uncanny", distribution_names[d], n, keys.size(), timer.seconds());
+		timer = Timer();
+		for (size_t i=0; i<keys.size(); i++)
+			total += fixture.std_map.find(keys[i])->second;
+		report("get", "std::map", distribution_names[d], n, keys.size(), timer.seconds());
+		if (not fixture.unsorted.empty()) {
+			size_t operations = slow_operations(n);
+			timer = Timer();
+			for (size_t i=0; i<operations; i++)
+				for (size_t j=0; j<fixture.unsorted.size(); j++)
+					if (fixture.unsorted[j].first == keys[i]) {
+						total += fixture.unsorted[j].second;
+						break;
+					}
+			report("get", "scan", distribution_names[d], n, operations, timer.seconds());
+		}
+		sink = total;
+	}
+}
+
+// Cuts are ranges from the smallest key, so are the same query as augment_lt.
+static void bench_queries(Fixture& fixture, const char* benchmark, bool cut, bool cold) {
+	if (not wanted(benchmark)) return;
+	long long n = fixture.n;
+	long long width = max(1LL, n / 100);
+	for (int d=UNIFORM; d<=ZIPFIAN; d++) {
+		vector<long long> keys = draw((Distribution)d, n, OPERATIONS, 5);
+		size_t operations = cold ? slow_operations(n) : keys.size();
+		long long total = 0;
+		fixture.warm();
+		Timer timer;
+		for (size_t i=0; i<operations; i++) {
+			if (cold)
+				fixture.chill();
+			if (cut) {
+				AugmentationResult output;
+				if (fixture.tree.augment_lt(fixture.sum_id, keys[i], &output) != 0)
+					total += output.data.l;
+			} else
+				total += fixture.tree_range(keys[i], keys[i] + width);
+		}
+		report(benchmark, "uncanny", distribution_names[d], n, operations, timer.seconds());
+		// The baselines have no cache, so are the same warm or cold.
+		operations = cut ? slow_operations(n) : min(keys.size(), slow_operations(width));
+		timer = Timer();
+		for (size_t i=0; i<operations; i++)
+			total += cut ? fixture.map_range(0, keys[i]) : fixture.map_range(keys[i], keys[i] + width);
+		report(benchmark, "std::map", distribution_names[d], n, operations, timer.seconds());
+		if (not fixture.unsorted.empty()) {
+			operations = slow_operations(n);
+			timer = Timer();
+			for (size_t i=0; i<operations; i++)
+				total += cut ? fixture.scan_range(0, keys[i]) : fixture.scan_range(keys[i], keys[i] + width);
+			report(benchmark, "scan", distribution_names[d], n, operations, timer.seconds());
+		}
+		sink = total;
+	}
+}
+
+// Range queries mixed with updates, which invalidate the cache along their paths.
+static void bench_mix(Fixture& fixture, int read_percent) {
+	char benchmark[32];
+	snprintf(benchmark, sizeof(benchmark), "mix_read%d", read_percent);
+	if (not wanted(benchmark)) return;
+	long long n = fixture.n;
+	long long width = max(1LL, n / 100);
+	for (int d=UNIFORM; d<=ZIPFIAN; d++) {
+		vector<long long> keys = draw((Distribution)d, n, OPERATIONS, 6);
+		vector<long long> coins = draw(UNIFORM, 100, OPERATIONS, 7);
+		long long total = 0;
+		fixture.warm();
+		Timer timer;
+		for (size_t i=0; i<keys.size(); i++) {
+			if (coins[i] < read_percent)
+				total += fixture.tree_range(keys[i], keys[i] + width);
+			else
+				fixture.tree.insert(keys[i], i);
+		}
+		report(benchmark, "uncanny", distribution_names[d], n, keys.size(), timer.seconds());
+		size_t operations = min(keys.size(), slow_operations(width));
+		timer = Timer();
+		for (size_t i=0; i<operations; i++) {
+			if (coins[i] < read_percent)
+				total += fixture.map_range(keys[i], keys[i] + width);
+			else
+				fixture.std_map[keys[i]] = i;
+		}
+		report(benchmark, "std::map", distribution_names[d], n, operations, timer.seconds());
+		sink = total;
+	}
+}
+
+// Inserts spread over several writer threads, into a tree sharded four ways per
+// thread, against one thread inserting into a plain tree.
+static void bench_sharded(long long n) {
+	if (not wanted("sharded_insert")) return;
+	vector<long long> keys = permutation(UNIFORM, n, 10);
+	{
+		BenchTree tree;
+		Timer timer;
+		for (long long i=0; i<n; i++)
+			tree.insert(keys[i], i);
+		report("sharded_insert", "uncanny", "uniform", n, n, timer.seconds());
+	}
+	unsigned max_threads = max(1u, thread::hardware_concurrency());
+	for (unsigned threads=1; threads<=max_threads; threads *= 2) {
+		vector<long long> bounds;
+		for (unsigned i=1; i<4 * threads; i++)
+			bounds.push_back(n * i / (4 * threads));
+		BasicShardedTree<long long, long long> sharded(bounds);
+		vector<thread> writers;
+		Timer timer;
+		for (unsigned t=0; t<threads; t++)
+			writers.push_back(thread([&, t]() {
+				for (long long i=t; i<n; i += threads)
+					sharded.insert(keys[i], i);
+			}));
+		for (unsigned t=0; t<threads; t++)
+			writers[t].join();
+		char structure[32];
+		snprintf(structure, sizeof(structure), "sharded_%ut", threads);
+		report("sharded_insert", structure, "uniform", n, n, timer.seconds());
+	}
+}
+
+// Lookups by string keys sharing a long prefix, as in a typical path-like index.
+// "uncanny" keeps 32 bytes of each key inline, enough to tell these keys apart,
+// and "uncanny_string" stores std::strings.
+static void bench_strings(long long n) {
+	if (not wanted("string_get")) return;
+	vector<long long> order = permutation(UNIFORM, n, 8);
+	vector<string> names(n);
+	for (long long i=0; i<n; i++) {
+		char name[64];
+		snprintf(name, sizeof(name), "tenant/0001/user/%012lld", order[i]);
+		names[i] = name;
+	}
+	BasicTree<PrefixedKey<32>, long long> tree;
+	BasicTree<string, long long> string_tree;
+	map<string, long long> std_map;
+	for (long long i=0; i<n; i++) {
+		tree.insert(PrefixedKey<32>(names[i]), i);
+		string_tree.insert(names[i], i);
+		std_map[names[i]] = i;
+	}
+	for (int d=UNIFORM; d<=ZIPFIAN; d++) {
+		vector<long long> draws = draw((Distribution)d, n, OPERATIONS, 9);
+		vector<PrefixedKey<32> > keys(draws.size());
+		for (size_t i=0; i<draws.size(); i++)
+			keys[i] = PrefixedKey<32>(names[draws[i]]);
+		long long total = 0;
+		Timer timer;
+		for (size_t i=0; i<keys.size(); i++)
+			total += *tree.get(keys[i]);
+		report("string_get", "uncanny", distribution_names[d], n, keys.size(), timer.seconds());
+		timer = Timer();
+		for (size_t i=0; i<draws.size(); i++)
+			total += *string_tree.get(names[draws[i]]);
+		report("string_get", "uncanny_string", distribution_names[d], n, draws.size(), timer.seconds());
+		timer = Timer();
+		for (size_t i=0; i<draws.size(); i++)
+			total += std_map.find(names[draws[i]])->second;
+		report("string_get", "std::map", distribution_names[d], n, draws.size(), timer.seconds());
+		sink = total;
+	}
+}
+
+int main(int argc, char** argv) {
+	long long max_size = argc > 1 ? atoll(argv[1]) : 1000000;
+	if (argc > 2)
+		filter = argv[2];
+	if (max_size < 1000 or max_size > 100000000) {
+		fprintf(stderr, "Usage: %s [max_size [filter]], with max_size from 1000 to 100000000\n", argv[0]);
+		return 1;
+	}
+	printf("benchmark,structure,distribution,size,operations,ns_per_op\n");
+	for (long long n=1000; n<=max_size; n *= 10) {
+		bench_insert(n);
+		bench_remove(n);
+		bench_strings(n);
+		bench_sharded(n);
+		// Linear scans are hopeless much past here.
+		Fixture fixture(n, n <= 100000);
+		bench_get(fixture);
+		bench_queries(fixture, "cut_warm", true, false);
+		bench_queries(fixture, "cut_cold", true, true);
+		bench_queries(fixture, "range_warm", false, false);
+		bench_queries(fixture, "range_cold", false, true);
+		bench_mix(fixture, 50);
+		bench_mix(fixture, 90);
+		bench_mix(fixture, 99);
+	}
+	return 0;
+}
+
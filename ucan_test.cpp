@@ -1,8 +1,29 @@
 // Uncanny trees test file.
 
+#include <assert.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
 using namespace std;
+#include <algorithm>
+#include <atomic>
 #include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
 #include "uncanny.h"
+#include "uncanny_btree.h"
+#include "uncanny_keys.h"
+#include "uncanny_persistent.h"
+#include "uncanny_sharded.h"
+#include "uncanny_snapshot.h"
+#include "uncanny_wal.h"
 using namespace Uncanny;
 
 int integer_compare(void* _a, void* _b) {
@@ -28,6 +49,77 @@ bool sum_compare(const AugmentationResult* a, const AugmentationResult* b) {
 	return a->data.l == b->data.l;
 }
 
+void quiet_sum_base_case(void* key, void* value, AugmentationResult* output) {
+	output->data.l = (long long)value;
+	output->data_length = 1;
+}
+
+void quiet_sum_compute(const AugmentationResult* a, const AugmentationResult* b, AugmentationResult* output) {
+	output->data.l = a->data.l + b->data.l;
+	output->data_length = a->data_length + b->data_length;
+}
+
+void typed_sum_base_case(long long key, long long value, AugmentationResult* output) {
+	output->data.l = value;
+	output->data_length = 1;
+}
+
+// The largest TOP_K values, in descending order, as a large result.
+static const int TOP_K = 8;
+
+void top_base_case(void* key, void* value, AugmentationResult* output) {
+	((long long*)output->data.vp)[0] = (long long)value;
+	output->data_length = 1;
+}
+
+void typed_top_base_case(long long key, long long value, AugmentationResult* output) {
+	((long long*)output->data.vp)[0] = value;
+	output->data_length = 1;
+}
+
+void top_compute(const AugmentationResult* a, const AugmentationResult* b, AugmentationResult* output) {
+	const long long* x = (const long long*)a->data.vp;
+	const long long* y = (const long long*)b->data.vp;
+	size_t nx = min(a->data_length, (size_t)TOP_K), ny = min(b->data_length, (size_t)TOP_K), i = 0, j = 0;
+	long long* out = (long long*)output->data.vp;
+	for (int k=0; k<TOP_K and (i < nx or j < ny); k++)
+		out[k] = (j == ny or (i < nx and x[i] >= y[j])) ? x[i++] : y[j++];
+	output->data_length = a->data_length + b->data_length;
+}
+
+bool top_compare(const AugmentationResult* a, const AugmentationResult* b) {
+	size_t n = min(a->data_length, (size_t)TOP_K);
+	return a->data_length == b->data_length and memcmp(a->data.vp, b->data.vp, n * sizeof(long long)) == 0;
+}
+
+// Checks a top result against the values of keys in [low, high).
+void check_top(Tree& tree, long long low, long long high, const AugmentationResult* result, size_t length) {
+	vector<long long> values;
+	for (long long k=low; k<high; k++)
+		if (tree.get((void*)k) != NULL)
+			values.push_back((long long)*tree.get((void*)k));
+	sort(values.rbegin(), values.rend());
+	assert(length == values.size());
+	for (size_t i=0; i<values.size() and i<(size_t)TOP_K; i++)
+		assert(((long long*)result->data.vp)[i] == values[i]);
+}
+
+// The first and last values in key order, which only combine one way round.
+void ends_base_case(void* key, void* value, AugmentationResult* output) {
+	output->data.l = output->extra.l = (long long)value;
+	output->data_length = 1;
+}
+
+void ends_compute(const AugmentationResult* a, const AugmentationResult* b, AugmentationResult* output) {
+	output->data.l = a->data.l;
+	output->extra.l = b->extra.l;
+	output->data_length = a->data_length + b->data_length;
+}
+
+bool ends_compare(const AugmentationResult* a, const AugmentationResult* b) {
+	return a->data.l == b->data.l and a->extra.l == b->extra.l;
+}
+
 int main(int argc, char** argv) {
 	// Make a tree, and do some basic tests.
 	Tree t;
@@ -63,6 +155,906 @@ int main(int argc, char** argv) {
 		cout << "Range result: " << (long long)output.data.l << endl;
 	}
 
+	// The typed tree stores keys by value, and inlines the comparison.
+	BasicTree<long long, long long> typed;
+	for (long long i=0; i<1000; i++)
+		typed.insert((i * 7919) % 1000, i);
+	for (long long i=0; i<1000; i+=2)
+		typed.remove(i);
+	for (long long i=0; i<1000; i++)
+		assert((typed.get(i) != NULL) == (i % 2 == 1));
+	assert(typed.get_default(7919 % 1000, -1) == 1);
+	cout << "Typed tree OK" << endl;
+
+	// Static augmentations are all maintained and queried together.
+	BasicTree<long long, long long, DefaultCompare<long long>, Augmentations<Count, Sum<long long>, Max<long long> > > bundled;
+	for (long long i=0; i<1000; i++)
+		bundled.insert((i * 7919) % 1000, i);
+	for (long long i=0; i<1000; i+=3)
+		bundled.remove(i);
+	for (long long low=0; low<1000; low+=37) {
+		for (long long high=low; high<1000; high+=53) {
+			size_t count = 0;
+			long long sum = 0, max = -1;
+			for (long long k=low+1; k<=high; k++) {
+				long long* v = bundled.get(k);
+				if (v == NULL) continue;
+				count++;
+				sum += *v;
+				if (*v > max) max = *v;
+			}
+			auto summary = bundled.summarize_range(low, false, high, true);
+			assert(get<0>(summary) == count);
+			assert(get<1>(summary) == sum);
+			assert(count == 0 or get<2>(summary) == max);
+		}
+	}
+	assert(get<0>(bundled.summarize_lt(500)) + get<0>(bundled.summarize_gte(500)) == get<0>(bundled.summarize_all()));
+	cout << "Static augmentations OK" << endl;
+
+	// Interleave writes and cached queries, checking against a brute force sum.
+	Tree churn;
+	churn.cmp_f = integer_compare;
+	Augmentation quiet_sum(quiet_sum_base_case, quiet_sum_compute, sum_compare);
+	int quiet_id = churn.aug_ctx.new_augmentation(&quiet_sum);
+	long long shadow[512] = {0};
+	srand(1);
+	for (int step=0; step<20000; step++) {
+		long long k = rand() % 512;
+		if (rand() % 2) {
+			shadow[k] = 1 + rand() % 100;
+			churn.insert((void*)k, (void*)shadow[k]);
+		} else {
+			shadow[k] = 0;
+			churn.remove((void*)k);
+		}
+		if (step % 7 == 0) {
+			long long low = rand() % 512, high = rand() % 512, expected = 0;
+			for (long long j=low; j<=high; j++)
+				expected += shadow[j];
+			output.data.l = 0;
+			churn.augment_range(quiet_id, (void*)low, true, (void*)high, true, &output);
+			assert(output.data.l == expected);
+		}
+	}
+	// 512 keys must fit in an AVL tree of height 1.44 * log2(512).
+	assert(churn.nodes[churn.root].height <= 13);
+	cout << "Churn OK" << endl;
+
+	// Bulk loading builds a balanced tree directly, optionally with warm caches.
+	vector<void*> sorted_keys, sorted_values;
+	for (long long i=0; i<10000; i++) {
+		sorted_keys.push_back((void*)(3 * i));
+		sorted_values.push_back((void*)(i % 17));
+	}
+	churn.build_from_sorted(&sorted_keys[0], &sorted_values[0], sorted_keys.size(), 4);
+	assert(churn.nodes[churn.root].height == 14);
+	assert(churn.get_default((void*)2998, (void*)-1) == (void*)-1);
+	assert(churn.get_default((void*)(2999 * 3), (void*)-1) == (void*)(2999 % 17));
+	churn.augment_range(quiet_id, (void*)3, true, (void*)30000, true, &output);
+	long long expected = 0;
+	for (long long i=1; i<10000; i++)
+		expected += i % 17;
+	assert(output.data.l == expected);
+	cout << "Bulk load OK" << endl;
+
+	// Batches share their descents, and are joined back together once.
+	vector<Tree::BatchOp> batch;
+	for (long long i=0; i<3000; i+=2) {
+		Tree::BatchOp op;
+		op.key = (void*)(3 * i + (i % 4 == 0));
+		op.value = (void*)1;
+		op.remove = i % 4 == 2;
+		batch.push_back(op);
+	}
+	churn.apply_batch(&batch[0], batch.size());
+	for (long long i=0; i<3000; i++) {
+		long long v = (long long)churn.get_default((void*)(3 * i), (void*)-1);
+		assert(v == (i % 4 == 2 ? -1 : i % 17));
+		v = (long long)churn.get_default((void*)(3 * i + 1), (void*)-1);
+		assert(v == (i % 4 == 0 ? 1 : -1));
+	}
+	assert(churn.nodes[churn.root].height <= 14);
+	cout << "Batch OK" << endl;
+
+	// Many ranges answered in one walk agree with answering them one at a time.
+	vector<Tree::RangeQuery> windows;
+	for (long long i=0; i<200; i++) {
+		Tree::RangeQuery window;
+		window.low_key = (void*)(i * 40);
+		window.low_inclusive = i % 2;
+		window.high_key = (void*)(i * 40 + 1 + 15 * (i % 9));
+		window.high_inclusive = i % 3;
+		windows.push_back(window);
+	}
+	vector<AugmentationResult> window_outputs(windows.size());
+	vector<size_t> window_lengths(windows.size());
+	churn.augment_ranges(quiet_id, &windows[0], windows.size(), &window_outputs[0], &window_lengths[0]);
+	for (unsigned int i=0; i<windows.size(); i++) {
+		size_t length = churn.augment_range(quiet_id, windows[i].low_key, windows[i].low_inclusive, windows[i].high_key, windows[i].high_inclusive, &output);
+		assert(length == window_lengths[i]);
+		assert(length == 0 or output.data.l == window_outputs[i].data.l);
+	}
+	cout << "Multi-range OK" << endl;
+
+	// A frozen snapshot answers like the tree it came from, and ignores later changes.
+	FrozenTree frozen = churn.freeze();
+	for (long long low=0; low<520; low += 7) {
+		for (long long high=low+1; high<520; high += 23) {
+			size_t length = frozen.augment_range(quiet_id, (void*)low, low % 2, (void*)high, high % 3, &output);
+			AugmentationResult expected;
+			assert(length == churn.augment_range(quiet_id, (void*)low, low % 2, (void*)high, high % 3, &expected));
+			assert(length == 0 or output.data.l == expected.data.l);
+		}
+		for (int comparison_type=-2; comparison_type<=2; comparison_type++) {
+			if (comparison_type == 0) continue;
+			size_t length = frozen.augment_cut(quiet_id, (void*)low, comparison_type, &output);
+			AugmentationResult expected;
+			assert(length == churn.augment_cut(quiet_id, (void*)low, comparison_type, &expected));
+			assert(length == 0 or output.data.l == expected.data.l);
+		}
+		assert(frozen.get_default((void*)low, (void*)-1) == churn.get_default((void*)low, (void*)-1));
+	}
+	churn.insert((void*)1000000, (void*)5);
+	assert(frozen.get((void*)1000000) == NULL);
+	cout << "Freeze OK" << endl;
+
+	// Readers may share a tree, and its cache, so long as nobody writes.
+	Tree shared;
+	shared.cmp_f = integer_compare;
+	int shared_id = shared.aug_ctx.new_augmentation(&quiet_sum);
+	for (long long i=0; i<4000; i++)
+		shared.insert((void*)i, (void*)(i % 10));
+	std::atomic<int> shared_failures(0);
+	std::vector<std::thread> shared_readers;
+	for (int r=0; r<4; r++) {
+		shared_readers.push_back(std::thread([&, r]() {
+			AugmentationResult result;
+			for (long long low=r; low<4000; low += 37) {
+				long long high = low + 500, expected = 0;
+				for (long long k=low; k<high and k<4000; k++)
+					expected += k % 10;
+				shared.augment_range(shared_id, (void*)low, true, (void*)high, false, &result);
+				if (result.data.l != expected)
+					shared_failures++;
+			}
+		}));
+	}
+	for (unsigned int r=0; r<shared_readers.size(); r++)
+		shared_readers[r].join();
+	assert(shared_failures == 0);
+	cout << "Shared reads OK" << endl;
+
+	// An augmentation built in the background matches one built lazily,
+	// and the tree's caches stay coherent for both afterwards.
+	Augmentation background_sum(quiet_sum_base_case, quiet_sum_compute, sum_compare);
+	int background_id = shared.new_augmentation_async(&background_sum, 4);
+	assert(shared.aug_ctx.augs.count(background_id) == 0);
+	shared.augment_lt(shared_id, (void*)2000, &output);
+	shared.finish_augmentations();
+	assert(shared.poll_augmentations());
+	for (long long i=0; i<4000; i += 3)
+		shared.remove((void*)i);
+	for (long long low=0; low<4000; low += 111) {
+		AugmentationResult expected;
+		size_t length = shared.augment_gte(background_id, (void*)low, &output);
+		assert(length == shared.augment_gte(shared_id, (void*)low, &expected));
+		assert(output.data.l == expected.data.l);
+	}
+	// Writes may go on during a build, growing the pool past the column it started with.
+	Tree busy;
+	busy.cmp_f = integer_compare;
+	int busy_id = busy.aug_ctx.new_augmentation(&quiet_sum);
+	for (long long i=0; i<20000; i++)
+		busy.insert((void*)i, (void*)(i % 10));
+	int written_id = busy.new_augmentation_async(&background_sum, 2);
+	for (long long i=20000; i<60000; i++) {
+		busy.insert((void*)i, (void*)(i % 10));
+		if (i % 1000 == 0)
+			busy.poll_augmentations();
+	}
+	for (long long i=0; i<20000; i += 3)
+		busy.remove((void*)i);
+	while (not busy.poll_augmentations())
+		this_thread::yield();
+	for (long long low=0; low<60000; low += 1111) {
+		AugmentationResult expected;
+		size_t length = busy.augment_gte(written_id, (void*)low, &output);
+		assert(length == busy.augment_gte(busy_id, (void*)low, &expected));
+		assert(output.data.l == expected.data.l);
+	}
+	// Destroying a tree mid build stops the build.
+	Tree* abandoned = new Tree();
+	abandoned->cmp_f = integer_compare;
+	for (long long i=0; i<20000; i++)
+		abandoned->insert((void*)i, (void*)i);
+	abandoned->new_augmentation_async(&background_sum, 2);
+	delete abandoned;
+	cout << "Background augmentation OK" << endl;
+
+	// Iterators, bounds and scans visit entries in key order.
+	long long previous = -1, entries = 0;
+	for (Tree::iterator it = shared.begin(); it != shared.end(); ++it) {
+		assert((long long)it->key > previous);
+		previous = (long long)it->key;
+		entries++;
+	}
+	assert(entries == (long long)shared.nodes.size());
+	assert((long long)(--shared.end())->key == previous);
+	assert((long long)shared.lower_bound((void*)3)->key == 4);
+	assert((long long)shared.lower_bound((void*)4)->key == 4);
+	assert((long long)shared.upper_bound((void*)4)->key == 5);
+	assert(shared.upper_bound((void*)previous) == shared.end());
+	assert((long long)(--shared.lower_bound((void*)4))->key == 2);
+	long long scanned_sum = 0;
+	size_t scanned = shared.scan((void*)3, true, (void*)30, false, [&](void* key, void* value) {
+		scanned_sum += (long long)key;
+		return true;
+	});
+	// 4, 5, 7, 8, ..., 28, 29.
+	assert(scanned == 18 and scanned_sum == 4 + 5 + 7 + 8 + 10 + 11 + 13 + 14 + 16 + 17 + 19 + 20 + 22 + 23 + 25 + 26 + 28 + 29);
+	assert(shared.scan((void*)0, true, (void*)4000, true, [](void* key, void* value) { return (long long)key < 100; }) == 67);
+	// Removing one entry leaves iterators to every other valid, even when the
+	// removed node had two children, and its predecessor moves up to replace it.
+	Tree held;
+	held.cmp_f = integer_compare;
+	int held_id = held.aug_ctx.new_augmentation(&quiet_sum);
+	map<long long, Tree::iterator> held_iterators;
+	for (long long i=0; i<1000; i++) {
+		held.insert((void*)i, (void*)i);
+		held_iterators.insert(make_pair(i, held.lower_bound((void*)i)));
+	}
+	long long held_total = 999 * 1000 / 2;
+	for (long long i=0; i<500; i++) {
+		long long victim = i * 617 % 1000;
+		held.remove((void*)victim);
+		held_iterators.erase(victim);
+		held_total -= victim;
+		if (i % 50 == 0) {
+			for (auto& entry : held_iterators)
+				assert((long long)entry.second->key == entry.first and (long long)entry.second->value == entry.first);
+			held.augment_lt(held_id, (void*)1000, &output);
+			assert(output.data.l == held_total);
+			Tree::iterator middle = held.select(held_iterators.size() / 2);
+			assert(middle == held_iterators.find((long long)middle->key)->second);
+		}
+	}
+	for (auto& entry : held_iterators)
+		assert((long long)entry.second->key == entry.first);
+	cout << "Iteration OK" << endl;
+
+	// Order statistics agree with walking the entries in order.
+	size_t position = 0;
+	for (Tree::iterator it = shared.begin(); it != shared.end(); ++it, position++) {
+		assert(shared.select(position) == it);
+		assert(shared.rank(it->key) == position);
+	}
+	assert(position == shared.size() and shared.select(position) == shared.end());
+	assert(shared.rank((void*)3) == 2 and shared.rank((void*)100000) == shared.size());
+	assert(shared.percentile(0) == shared.begin() and shared.percentile(1) == --shared.end());
+	assert(shared.percentile(0.5) == shared.select((shared.size() + 1) / 2 - 1));
+	cout << "Order statistics OK" << endl;
+
+	// Splitting and joining keep every entry, and the augmentations of both halves.
+	size_t shared_size = shared.size();
+	shared.augment_lt(shared_id, (void*)4000, &output);
+	long long shared_total = output.data.l;
+	Tree upper;
+	shared.split((void*)1000, upper);
+	assert(shared.size() + upper.size() == shared_size);
+	assert((long long)(--shared.end())->key < 1000 and (long long)upper.begin()->key >= 1000);
+	AugmentationResult upper_output;
+	shared.augment_lt(shared_id, (void*)4000, &output);
+	upper.augment_lt(shared_id, (void*)4000, &upper_output);
+	assert(output.data.l + upper_output.data.l == shared_total);
+	upper.join(shared);
+	assert(shared.size() == 0 and upper.size() == shared_size);
+	upper.augment_lt(shared_id, (void*)4000, &output);
+	assert(output.data.l == shared_total);
+	// Splitting into a tree that had augmentations of its own, at the same schema_version.
+	Tree whole, reused;
+	whole.cmp_f = reused.cmp_f = integer_compare;
+	for (long long i=0; i<1000; i++) {
+		whole.insert((void*)i, (void*)i);
+		reused.insert((void*)i, (void*)1);
+	}
+	whole.aug_ctx.new_augmentation(&quiet_sum);
+	whole.aug_ctx.new_augmentation(&quiet_sum);
+	int whole_id = whole.aug_ctx.new_augmentation(&quiet_sum);
+	int reused_id = reused.aug_ctx.new_augmentation(&quiet_sum);
+	reused.aug_ctx.delete_augmentation(reused.aug_ctx.new_augmentation(&quiet_sum));
+	assert(reused.aug_ctx.schema_version == whole.aug_ctx.schema_version);
+	reused.augment_lt(reused_id, (void*)1000, &output);
+	assert(output.data.l == 1000);
+	reused.clear();
+	whole.split((void*)900, reused);
+	reused.augment_range(whole_id, (void*)900, true, (void*)1000, false, &output);
+	assert(output.data.l == 900 * 100 + 4950);
+	cout << "Split and join OK" << endl;
+
+	// The B+tree engine answers the same queries, checked against a brute force sum.
+	typedef BasicBTree<long long, long long, DefaultCompare<long long>, 8> BTree;
+	BTree bt;
+	BasicAugmentation<long long, long long> typed_sum(typed_sum_base_case, quiet_sum_compute, sum_compare);
+	int bt_id = bt.aug_ctx.new_augmentation(&typed_sum);
+	vector<long long> bt_shadow(3000, 0);
+	for (long long i=0; i<3000; i++) {
+		bt.insert((i * 7919) % 3000, (i * 7919) % 17 + 1);
+		bt_shadow[(i * 7919) % 3000] = (i * 7919) % 17 + 1;
+	}
+	for (long long i=0; i<3000; i += 3) {
+		bt.remove(i);
+		bt_shadow[i] = 0;
+	}
+	assert(bt.length == 2000);
+	assert(bt.get(3) == NULL and *bt.get(4) == bt_shadow[4]);
+	AugmentationResult bt_output;
+	for (long long low=0; low<3000; low += 97) {
+		for (long long high=low+1; high<3000; high += 131) {
+			long long sum = 0;
+			for (long long k=low; k<high; k++)
+				sum += bt_shadow[k];
+			size_t length = bt.augment_range(bt_id, low, true, high, false, &bt_output);
+			assert(length == 0 ? sum == 0 : bt_output.data.l == sum);
+		}
+		long long sum = 0;
+		for (long long k=low+1; k<3000; k++)
+			sum += bt_shadow[k];
+		assert(bt.augment_gt(bt_id, low, &bt_output) > 0 and bt_output.data.l == sum);
+		bt.insert(low, 1000);
+		bt_shadow[low] = 1000;
+	}
+	// Every instruction set the CPU has counts like the scalar loop, at every length and alignment.
+	long long node_keys[67];
+	for (int i=0; i<67; i++)
+		node_keys[i] = i < 2 ? numeric_limits<long long>::min() + i : i > 64 ? numeric_limits<long long>::max() : (i - 33) * 3;
+	for (int level=SIMD_NONE; level<=simd_level(); level++)
+		for (int offset=0; offset<3; offset++)
+			for (int count=0; count+offset<=67; count++)
+				for (long long key : {numeric_limits<long long>::min(), -100LL, -3LL, -2LL, 0LL, 95LL, numeric_limits<long long>::max()})
+					assert(simd_count_greater(node_keys + offset, count, key, (SimdLevel)level) == scalar_count_greater(node_keys + offset, count, key));
+	cout << "B+tree OK" << endl;
+
+	// Snapshots of a persistent tree stay consistent while a writer carries on.
+	typedef BasicPersistentTree<long long, long long> PTree;
+	PTree pt;
+	int pt_id = pt.aug_ctx.new_augmentation(&typed_sum);
+	for (long long i=0; i<100; i++)
+		pt.insert(i, i);
+	PTree::Snapshot before = pt.snapshot();
+	pt.remove(50);
+	pt.insert(200, 7);
+	assert(before.length() == 100 and *before.get(50) == 50 and before.get(200) == NULL);
+	assert(pt.length() == 100 and pt.get(50) == NULL and *pt.get(200) == 7);
+	assert(before.augment_lt(pt_id, 1000, &output) == 100 and output.data.l == 4950);
+	std::atomic<bool> writing(true);
+	std::atomic<int> reader_failures(0);
+	std::vector<std::thread> readers;
+	for (int r=0; r<2; r++) {
+		readers.push_back(std::thread([&]() {
+			while (writing) {
+				// Every version holds keys [0, n) apart from 50, plus 200, with value equal to key.
+				PTree::Snapshot snap = pt.snapshot();
+				AugmentationResult result;
+				size_t n = snap.augment_range(pt_id, 0, true, 199, true, &result);
+				if (n > 0 and result.data.l != (long long)(n * (n + 1) / 2 - 50))
+					reader_failures++;
+			}
+		}));
+	}
+	for (long long i=100; i<5000; i++) {
+		pt.insert(i, i);
+		if (i % 7 == 0)
+			pt.remove(5000 + i);
+	}
+	writing = false;
+	for (unsigned int r=0; r<readers.size(); r++)
+		readers[r].join();
+	assert(reader_failures == 0);
+	cout << "Persistent OK" << endl;
+
+	// A saved snapshot maps back in to answer like the frozen tree it was saved from,
+	// once the loader knows the same augmentations and ordering.
+	const char* snapshot_path = "/tmp/ucan_test.snapshot";
+	assert(save_snapshot(frozen, snapshot_path));
+	FrozenTree mapped;
+	mapped.cmp_f = integer_compare;
+	assert(not load_snapshot(mapped, snapshot_path));
+	mapped.aug_ctx = frozen.aug_ctx;
+	assert(load_snapshot(mapped, snapshot_path));
+	assert(mapped.length == frozen.length);
+	// A length that would wrap the layout's offsets around is refused.
+	const char* corrupt_path = "/tmp/ucan_test_corrupt.snapshot";
+	FILE* snapshot_file = fopen(snapshot_path, "rb");
+	string snapshot_bytes;
+	char snapshot_buffer[4096];
+	for (size_t got; (got = fread(snapshot_buffer, 1, sizeof(snapshot_buffer), snapshot_file)) != 0; )
+		snapshot_bytes.append(snapshot_buffer, got);
+	fclose(snapshot_file);
+	SnapshotHeader* corrupt_header = (SnapshotHeader*)&snapshot_bytes[0];
+	snapshot_layout<void*, void*>(corrupt_header, ~(uint64_t)0, corrupt_header->aug_count, corrupt_header->results_size);
+	snapshot_file = fopen(corrupt_path, "wb");
+	assert(fwrite(snapshot_bytes.data(), 1, snapshot_bytes.size(), snapshot_file) == snapshot_bytes.size() and fclose(snapshot_file) == 0);
+	FrozenTree corrupt;
+	corrupt.cmp_f = integer_compare;
+	corrupt.aug_ctx = frozen.aug_ctx;
+	assert(not load_snapshot(corrupt, corrupt_path));
+	unlink(corrupt_path);
+	for (long long low=0; low<520; low += 11) {
+		for (long long high=low+1; high<520; high += 29) {
+			AugmentationResult expected;
+			size_t length = mapped.augment_range(quiet_id, (void*)low, low % 2, (void*)high, high % 3, &output);
+			assert(length == frozen.augment_range(quiet_id, (void*)low, low % 2, (void*)high, high % 3, &expected));
+			assert(length == 0 or output.data.l == expected.data.l);
+		}
+		assert(mapped.get_default((void*)low, (void*)-1) == frozen.get_default((void*)low, (void*)-1));
+	}
+	// Copies share the mapping, which outlives the file.
+	FrozenTree copy = mapped;
+	mapped = FrozenTree();
+	unlink(snapshot_path);
+	assert(copy.get_default((void*)1, (void*)-1) == frozen.get_default((void*)1, (void*)-1));
+	cout << "Snapshot OK" << endl;
+
+	// Builtin augmentations are evaluated inline, and agree with a scan.
+	BasicTree<long long, double> measured;
+	int builtin_ids[BUILTIN_ARGMAX_F64 + 1];
+	for (int kind=BUILTIN_COUNT; kind<=BUILTIN_ARGMAX_F64; kind++) {
+		BasicTree<long long, double>::Augmentation builtin((Builtin)kind);
+		builtin_ids[kind] = measured.aug_ctx.new_augmentation(&builtin);
+	}
+	BasicTree<long long, long long, DefaultCompare<long long>, Augmentations<SumSquares<long long>, ArgMin<long long, long long>, ArgMax<long long, long long> > > extremes;
+	for (long long i=0; i<500; i++) {
+		long long value = (i * 7919) % 101 - 50;
+		measured.insert(i, value);
+		extremes.insert(i, value);
+	}
+	for (long long low=0; low<500; low += 19) {
+		for (long long high=low+1; high<500; high += 31) {
+			long long sum = 0, squares = 0, min = 1000, max = -1000, argmin = -1, argmax = -1;
+			for (long long k=low; k<high; k++) {
+				long long value = *measured.get(k);
+				sum += value;
+				squares += value * value;
+				if (value < min) { min = value; argmin = k; }
+				if (value > max) { max = value; argmax = k; }
+			}
+			long long count = high - low;
+			AugmentationResult r[BUILTIN_ARGMAX_F64 + 1];
+			for (int kind=BUILTIN_COUNT; kind<=BUILTIN_ARGMAX_F64; kind++)
+				assert(measured.augment_range(builtin_ids[kind], low, true, high, false, &r[kind]) == (size_t)count);
+			assert(r[BUILTIN_COUNT].data.l == count);
+			assert(r[BUILTIN_SUM_I64].data.l == sum and r[BUILTIN_SUM_F64].data.d == sum);
+			assert(r[BUILTIN_MIN_I64].data.l == min and r[BUILTIN_MIN_F64].data.d == min);
+			assert(r[BUILTIN_MAX_I64].data.l == max and r[BUILTIN_MAX_F64].data.d == max);
+			assert(moments_mean(&r[BUILTIN_MOMENTS_F64]) == (double)sum / count);
+			assert(fabs(moments_variance(&r[BUILTIN_MOMENTS_I64]) - ((double)squares / count - (double)sum * sum / count / count)) < 1e-6);
+			assert(r[BUILTIN_ARGMIN_I64].data.l == min and r[BUILTIN_ARGMIN_I64].extra.l == argmin);
+			assert(r[BUILTIN_ARGMIN_F64].extra.l == argmin);
+			assert(r[BUILTIN_ARGMAX_I64].data.l == max and r[BUILTIN_ARGMAX_F64].extra.l == argmax);
+			auto summary = extremes.summarize_range(low, true, high, false);
+			assert(std::get<0>(summary) == squares);
+			assert(std::get<1>(summary).first == min and std::get<1>(summary).second == argmin);
+			assert(std::get<2>(summary).first == max and std::get<2>(summary).second == argmax);
+		}
+	}
+	cout << "Builtin augmentations OK" << endl;
+
+	// Multi queries give the same results as asking for each augmentation alone.
+	int multi_count = BUILTIN_ARGMAX_F64;
+	for (long long low=0; low<510; low += 17) {
+		for (long long high=low; high<510; high += 43) {
+			AugmentationResult outputs[BUILTIN_ARGMAX_F64], expected;
+			bool inclusive = low == high or high % 2;
+			size_t length = measured.augment_range_multi(builtin_ids + 1, multi_count, low, inclusive, high, inclusive, outputs);
+			for (int i=0; i<multi_count; i++) {
+				assert(length == measured.augment_range(builtin_ids[i + 1], low, inclusive, high, inclusive, &expected));
+				assert(length == 0 or (outputs[i].data.ul == expected.data.ul and outputs[i].extra.ul == expected.extra.ul));
+			}
+		}
+		for (int comparison_type=-2; comparison_type<=2; comparison_type++) {
+			if (comparison_type == 0) continue;
+			AugmentationResult outputs[BUILTIN_ARGMAX_F64], expected;
+			size_t length = measured.augment_cut_multi(builtin_ids + 1, multi_count, low, comparison_type, outputs);
+			for (int i=0; i<multi_count; i++) {
+				assert(length == measured.augment_cut(builtin_ids[i + 1], low, comparison_type, &expected));
+				assert(length == 0 or (outputs[i].data.ul == expected.data.ul and outputs[i].extra.ul == expected.extra.ul));
+			}
+		}
+	}
+	AugmentationResult pair[2];
+	int pair_ids[2] = {builtin_ids[BUILTIN_COUNT], builtin_ids[BUILTIN_MAX_I64]};
+	assert(measured.augment_lt_multi(pair_ids, 2, 10, pair) == 10 and pair[0].data.l == 10);
+	cout << "Multi-augmentation queries OK" << endl;
+
+	// Trees count what they do if built with UNCANNY_STATS, and otherwise count nothing.
+	BasicTree<long long, long long> counted;
+	BasicTree<long long, long long>::Augmentation counted_sum(BUILTIN_SUM_I64);
+	int counted_id = counted.aug_ctx.new_augmentation(&counted_sum);
+	for (long long i=0; i<1000; i++)
+		counted.insert(i, i);
+	size_t rotations = counted.stats.rotations;
+	counted.stats.clear();
+	TreeStats cold, warm;
+	{
+		QueryTrace trace;
+		counted.augment_range(counted_id, 100, true, 900, false, &output);
+		cold = trace.stats;
+	}
+	{
+		QueryTrace trace;
+		counted.augment_range(counted_id, 100, true, 900, false, &output);
+		warm = trace.stats;
+	}
+#ifdef UNCANNY_STATS
+	assert(rotations > 0);
+	assert(cold.schema_migrations == 1 and cold.column_allocations > 0 and cold.cache_hits == 0);
+	assert(cold.cache_misses > 0 and cold.base_cases > 0 and cold.computes > 0 and cold.comparisons > 0);
+	assert(warm.schema_migrations == 0 and warm.column_allocations == 0 and warm.cache_misses == 0);
+	assert(warm.cache_hits > 0 and warm.nodes_visited < cold.nodes_visited and warm.comparisons == cold.comparisons);
+	assert(counted.stats.cache_misses == cold.cache_misses and counted.stats.cache_hits == warm.cache_hits);
+#else
+	assert(rotations == 0 and cold.comparisons == 0 and warm.cache_hits == 0 and counted.stats.nodes_visited == 0);
+#endif
+	cout << "Stats OK" << endl;
+
+	// Large results live in the tree's arena, and queries fill in buffers their callers provide.
+	Tree ranked;
+	ranked.cmp_f = integer_compare;
+	Augmentation top(top_base_case, top_compute, top_compare);
+	top.result_size = TOP_K * sizeof(long long);
+	int top_id = ranked.aug_ctx.new_augmentation(&top);
+	int ranked_sum_id = ranked.aug_ctx.new_augmentation(&quiet_sum);
+	for (long long i=0; i<1000; i++)
+		ranked.insert((void*)i, (void*)((i * 7919) % 1000));
+	long long top_buffer[TOP_K], top_buffers[2][TOP_K];
+	AugmentationResult top_output;
+	top_output.data.vp = top_buffer;
+	for (int round=0; round<2; round++) {
+		for (long long low=0; low<1000; low += 37) {
+			for (long long high=low+1; high<=1000; high += 91) {
+				check_top(ranked, low, high, &top_output, ranked.augment_range(top_id, (void*)low, true, (void*)high, false, &top_output));
+				assert(top_output.data.vp == top_buffer);
+				AugmentationResult pair[2];
+				pair[0].data.vp = top_buffers[0];
+				int pair_ids[2] = {top_id, ranked_sum_id};
+				size_t length = ranked.augment_range_multi(pair_ids, 2, (void*)low, true, (void*)high, false, pair);
+				check_top(ranked, low, high, &pair[0], length);
+			}
+			check_top(ranked, 0, low, &top_output, ranked.augment_lt(top_id, (void*)low, &top_output));
+			check_top(ranked, low, 1000, &top_output, ranked.augment_gte(top_id, (void*)low, &top_output));
+		}
+		// Changes reuse the invalidated nodes' records rather than allocating new ones.
+		for (long long i=0; i<1000; i += 3)
+			ranked.insert((void*)i, (void*)(2000 - i));
+		for (long long i=1; i<1000; i += 7)
+			ranked.remove((void*)i);
+	}
+	vector<Tree::RangeQuery> top_windows;
+	for (long long i=0; i<40; i++) {
+		Tree::RangeQuery window;
+		window.low_key = (void*)(i * 25);
+		window.low_inclusive = true;
+		window.high_key = (void*)(i * 25 + 1 + 13 * (i % 5));
+		window.high_inclusive = false;
+		top_windows.push_back(window);
+	}
+	vector<AugmentationResult> top_outputs(top_windows.size());
+	vector<vector<long long> > top_storage(top_windows.size(), vector<long long>(TOP_K));
+	for (unsigned int i=0; i<top_windows.size(); i++)
+		top_outputs[i].data.vp = &top_storage[i][0];
+	vector<size_t> top_lengths(top_windows.size());
+	ranked.augment_ranges(top_id, &top_windows[0], top_windows.size(), &top_outputs[0], &top_lengths[0]);
+	for (unsigned int i=0; i<top_windows.size(); i++)
+		check_top(ranked, (long long)top_windows[i].low_key, (long long)top_windows[i].high_key, &top_outputs[i], top_lengths[i]);
+	int background_top_id = ranked.new_augmentation_async(&top, 4);
+	ranked.finish_augmentations();
+	assert(ranked.poll_augmentations());
+	check_top(ranked, 100, 900, &top_output, ranked.augment_range(background_top_id, (void*)100, true, (void*)900, false, &top_output));
+	// The other engines keep large results in records of their own.
+	FrozenTree frozen_ranked = ranked.freeze();
+	FrozenTree frozen_copy;
+	frozen_copy = frozen_ranked;
+	const char* ranked_path = "/tmp/ucan_test_ranked.snapshot";
+	assert(save_snapshot(frozen_ranked, ranked_path));
+	FrozenTree mapped_ranked;
+	mapped_ranked.cmp_f = integer_compare;
+	mapped_ranked.aug_ctx = frozen_ranked.aug_ctx;
+	assert(load_snapshot(mapped_ranked, ranked_path));
+	unlink(ranked_path);
+	BasicAugmentation<long long, long long> typed_top(typed_top_base_case, top_compute, top_compare);
+	typed_top.result_size = TOP_K * sizeof(long long);
+	BTree ranked_bt;
+	PTree ranked_pt;
+	int bt_top_id = ranked_bt.aug_ctx.new_augmentation(&typed_top);
+	int pt_top_id = ranked_pt.aug_ctx.new_augmentation(&typed_top);
+	for (long long k=0; k<1000; k++) {
+		if (ranked.get((void*)k) == NULL)
+			continue;
+		ranked_bt.insert(k, (long long)*ranked.get((void*)k));
+		ranked_pt.insert(k, (long long)*ranked.get((void*)k));
+	}
+	// Registering another rebuilds the persistent tree's nodes in the new layout.
+	int pt_later_id = ranked_pt.aug_ctx.new_augmentation(&typed_top);
+	ranked_pt.insert(5000, 0);
+	for (int round=0; round<2; round++) {
+		PTree::Snapshot ranked_snap = ranked_pt.snapshot();
+		for (long long low=0; low<1000; low += 41) {
+			for (long long high=low+1; high<=1000; high += 97) {
+				if (round == 0) {
+					check_top(ranked, low, high, &top_output, frozen_ranked.augment_range(top_id, (void*)low, true, (void*)high, false, &top_output));
+					check_top(ranked, low, high, &top_output, frozen_copy.augment_range(background_top_id, (void*)low, true, (void*)high, false, &top_output));
+					check_top(ranked, low, high, &top_output, mapped_ranked.augment_range(top_id, (void*)low, true, (void*)high, false, &top_output));
+				}
+				check_top(ranked, low, high, &top_output, ranked_bt.augment_range(bt_top_id, low, true, high, false, &top_output));
+				check_top(ranked, low, high, &top_output, ranked_snap.augment_range(pt_top_id, low, true, high, false, &top_output));
+				check_top(ranked, low, high, &top_output, ranked_snap.augment_range(pt_later_id, low, true, high, false, &top_output));
+			}
+			check_top(ranked, 0, low, &top_output, ranked_bt.augment_lt(bt_top_id, low, &top_output));
+			check_top(ranked, 0, low, &top_output, ranked_snap.augment_lt(pt_top_id, low, &top_output));
+			if (round == 0)
+				check_top(ranked, low, 1000, &top_output, mapped_ranked.augment_gte(top_id, (void*)low, &top_output));
+			assert(top_output.data.vp == top_buffer);
+		}
+		// Changes recompute the B+tree's cached records in place.
+		for (long long i=0; i<1000; i += 11) {
+			ranked.insert((void*)i, (void*)(3000 + i));
+			ranked_bt.insert(i, 3000 + i);
+			ranked_pt.insert(i, 3000 + i);
+		}
+	}
+	cout << "Large results OK" << endl;
+
+	// String keys compare on their inline prefixes, and agree with std::string's order.
+	vector<string> names;
+	for (int i=0; i<3000; i++) {
+		string name = i % 3 == 0 ? "" : string(i % 5 == 0 ? 40 : 12, 'x');
+		name += to_string(i * 7 % 1000);
+		if (i % 7 == 0)
+			name += string(i % 4, '\0');
+		names.push_back(name);
+	}
+	BasicTree<StringKey, long long> named;
+	BasicTree<StringKey, long long>::Augmentation named_count(BUILTIN_COUNT);
+	int named_count_id = named.aug_ctx.new_augmentation(&named_count);
+	map<string, long long> named_expected;
+	for (int i=0; i<(int)names.size(); i++) {
+		named.insert(StringKey(names[i]), i);
+		named_expected[names[i]] = i;
+	}
+	assert(named.size() == named_expected.size());
+	map<string, long long>::iterator expected_entry = named_expected.begin();
+	for (BasicTree<StringKey, long long>::iterator iter = named.begin(); iter != named.end(); iter++, expected_entry++)
+		assert(iter->key.str() == expected_entry->first and iter->value == expected_entry->second);
+	for (int i=0; i<(int)names.size(); i += 11) {
+		assert(*named.get(StringKey(names[i])) == named_expected[names[i]]);
+		size_t below = distance(named_expected.begin(), named_expected.lower_bound(names[i]));
+		assert(named.augment_lt(named_count_id, StringKey(names[i]), &output) == below);
+		assert(named.rank(StringKey(names[i])) == below);
+	}
+	string absent = names[1] + "y";
+	assert(named.get(StringKey(absent)) == NULL);
+	assert(named.lower_bound(StringKey(absent))->key.str() == named_expected.lower_bound(absent)->first);
+
+	// Composite keys encode to bytes that order like the tuples they came from.
+	typedef std::tuple<long long, string, double> Fields;
+	vector<Fields> tuples;
+	vector<string> encoded;
+	for (int i=0; i<500; i++) {
+		string field = string(i % 3, 'a') + string(i % 2, '\0') + string(i % 5 == 0 ? 1 : 0, 'b');
+		tuples.push_back(Fields((i % 13) - 6, field, (i % 9) * 0.5 - 2));
+		string key;
+		encode_i64(key, std::get<0>(tuples[i]));
+		encode_string(key, field.data(), field.size());
+		encode_f64(key, std::get<2>(tuples[i]));
+		encoded.push_back(key);
+	}
+	for (int i=0; i<(int)tuples.size(); i++)
+		for (int j=0; j<(int)tuples.size(); j += 7) {
+			int comparison = compare_prefixed(StringKey(encoded[i]), StringKey(encoded[j]));
+			assert((comparison < 0) == (tuples[i] < tuples[j]) and (comparison > 0) == (tuples[j] < tuples[i]));
+		}
+	cout << "String keys OK" << endl;
+
+	// A crashed writer's tree comes back from its checkpoint and log, with at least
+	// every write it had synced, and exactly as it was after some prefix of its writes.
+	auto logged_op = [](long long k, long long* key, bool* remove) {
+		*remove = k % 4 == 3;
+		*key = *remove ? k * 7 % 1000 : k * 13 % 1500;
+	};
+	char log_directory[] = "/tmp/ucan_test_wal_XXXXXX";
+	assert(mkdtemp(log_directory) != NULL);
+	pid_t writer = fork();
+	if (writer == 0) {
+		DurableTree durable;
+		durable.tree.cmp_f = integer_compare;
+		durable.checkpoint_bytes = 20000;
+		if (not durable.open(log_directory))
+			_exit(1);
+		for (long long k=0; k<5000; k++) {
+			long long key;
+			bool remove;
+			logged_op(k, &key, &remove);
+			if (remove)
+				durable.remove((void*)key);
+			else
+				durable.insert((void*)key, (void*)k);
+			if (k == 3999 and not durable.sync())
+				_exit(1);
+		}
+		// Crash, without syncing the rest.
+		_exit(0);
+	}
+	int writer_status;
+	assert(waitpid(writer, &writer_status, 0) == writer and WIFEXITED(writer_status) and WEXITSTATUS(writer_status) == 0);
+	map<long long, long long> recovered;
+	{
+		DurableTree durable;
+		durable.tree.cmp_f = integer_compare;
+		assert(durable.open(log_directory));
+		for (Tree::iterator iter = durable.tree.begin(); iter != durable.tree.end(); iter++)
+			recovered[(long long)iter->key] = (long long)iter->value;
+		// Keep count of keys where the replayed writes and the recovered tree disagree.
+		map<long long, long long> replayed;
+		size_t mismatches = recovered.size();
+		bool found = false;
+		for (long long k=0; k<5000 and not found; k++) {
+			long long key;
+			bool remove;
+			logged_op(k, &key, &remove);
+			mismatches -= recovered.count(key) != replayed.count(key) or (recovered.count(key) and recovered[key] != replayed[key]);
+			if (remove)
+				replayed.erase(key);
+			else
+				replayed[key] = k;
+			mismatches += recovered.count(key) != replayed.count(key) or (recovered.count(key) and recovered[key] != replayed[key]);
+			found = k >= 3999 and mismatches == 0;
+		}
+		assert(found);
+		durable.insert((void*)100000, (void*)1);
+		assert(durable.close());
+	}
+	// A torn record at the end of the log is cut off.
+	{
+		DurableTree durable;
+		durable.directory = log_directory;
+		string last_segment = durable.list_segments().back().second;
+		FILE* segment = fopen(last_segment.c_str(), "ab");
+		assert(segment != NULL and fwrite("\x20\0\0\0torn", 1, 8, segment) == 8 and fclose(segment) == 0);
+		durable.tree.cmp_f = integer_compare;
+		assert(durable.open(log_directory));
+		assert(durable.tree.size() == recovered.size() + 1 and durable.tree.get((void*)100000) != NULL);
+		for (map<long long, long long>::iterator iter = recovered.begin(); iter != recovered.end(); iter++)
+			assert(*durable.tree.get((void*)iter->first) == (void*)iter->second);
+		assert(durable.checkpoint() and durable.finish_checkpoint());
+		assert(durable.list_segments().size() == 1);
+	}
+	// Once a write fails, nothing more is logged or applied.
+	{
+		DurableTree durable;
+		durable.tree.cmp_f = integer_compare;
+		assert(durable.open(log_directory));
+		size_t size = durable.tree.size();
+		int full = open("/dev/full", O_WRONLY);
+		assert(full >= 0 and dup2(full, durable.log_fd) == durable.log_fd and close(full) == 0);
+		durable.insert((void*)100001, (void*)1);
+		assert(not durable.sync());
+		assert(durable.insert((void*)100002, (void*)1) == 0 and durable.remove((void*)100000) == 0);
+		assert(durable.tree.size() == size + 1 and durable.tree.get((void*)100002) == NULL);
+		assert(not durable.checkpoint() and not durable.close());
+	}
+
+	// Other key and value types plug in their own codecs.
+	typedef BasicDurableTree<string, string, DefaultCompare<string>, Augmentations<>, StringCodec, StringCodec> DurableStrings;
+	string string_directory = string(log_directory) + "/strings";
+	{
+		DurableStrings durable;
+		assert(durable.open(string_directory.c_str()));
+		for (int i=0; i<500; i++) {
+			durable.insert(names[i], string(i % 7, 'v'));
+			if (i == 250)
+				assert(durable.checkpoint());
+		}
+		uint64_t lsn = durable.remove(names[3]);
+		assert(durable.wait_durable(lsn));
+	}
+	{
+		DurableStrings durable;
+		DurableStrings::Tree::Augmentation strings_count(BUILTIN_COUNT);
+		int strings_count_id = durable.tree.aug_ctx.new_augmentation(&strings_count);
+		assert(durable.open(string_directory.c_str()));
+		map<string, string> expected;
+		for (int i=0; i<500; i++)
+			expected[names[i]] = string(i % 7, 'v');
+		expected.erase(names[3]);
+		assert(durable.tree.size() == expected.size());
+		for (map<string, string>::iterator iter = expected.begin(); iter != expected.end(); iter++)
+			assert(*durable.tree.get(iter->first) == iter->second);
+		AugmentationResult strings_output;
+		assert(durable.tree.augment_lt(strings_count_id, names[10], &strings_output) == (size_t)distance(expected.begin(), expected.lower_bound(names[10])));
+	}
+	for (const string& directory : {string_directory, string(log_directory)}) {
+		DurableStrings durable;
+		durable.directory = directory;
+		auto segments = durable.list_segments();
+		for (unsigned int i=0; i<segments.size(); i++)
+			unlink(segments[i].second.c_str());
+		unlink((directory + "/checkpoint").c_str());
+	}
+	assert(rmdir(string_directory.c_str()) == 0 and rmdir(log_directory) == 0);
+	cout << "Write-ahead log OK" << endl;
+
+	// Sharded trees take writes on many threads at once, and rebalance as they go,
+	// while queries combine the shards' results in key order.
+	vector<void*> shard_bounds;
+	for (long long bound=1000; bound<=3000; bound += 1000)
+		shard_bounds.push_back((void*)bound);
+	ShardedTree sharded(shard_bounds, integer_compare);
+	int sharded_sum_id = sharded.new_augmentation(&quiet_sum);
+	Augmentation ends(ends_base_case, ends_compute, ends_compare);
+	int ends_id = sharded.new_augmentation(&ends);
+	// Even keys go in first, valued as themselves, so every query has a known sum
+	// even while odd keys, valued zero, pile into the last shard and get rebalanced.
+	long long even_total = 0;
+	for (long long key=0; key<16000; key += 2) {
+		sharded.insert((void*)key, (void*)key);
+		even_total += key;
+	}
+	std::atomic<int> writers_left(4), sharded_failures(0);
+	std::vector<std::thread> sharded_threads;
+	for (int t=0; t<4; t++)
+		sharded_threads.push_back(std::thread([&, t]() {
+			for (long long key=2*t+1; key<16000; key += 8)
+				sharded.insert((void*)key, (void*)0);
+			writers_left--;
+		}));
+	sharded_threads.push_back(std::thread([&]() {
+		while (writers_left > 0)
+			sharded.rebalance_all(0.1);
+	}));
+	sharded_threads.push_back(std::thread([&]() {
+		AugmentationResult result;
+		while (writers_left > 0) {
+			size_t length = sharded.augment_range(sharded_sum_id, (void*)0, true, (void*)16000, false, &result);
+			if (result.data.l != even_total or length < 8000 or length > 16000)
+				sharded_failures++;
+			// Key 2 is always first, and the last is 15999 once it's in, or else 15998.
+			sharded.augment_gte(ends_id, (void*)2, &result);
+			if (result.data.l != 2 or (result.extra.l != 0 and result.extra.l != 15998))
+				sharded_failures++;
+		}
+	}));
+	for (unsigned int t=0; t<sharded_threads.size(); t++)
+		sharded_threads[t].join();
+	assert(sharded_failures == 0);
+	sharded.rebalance_all(0.1);
+	assert(sharded.size() == 16000);
+	for (unsigned int i=0; i<sharded.shards.size(); i++)
+		assert(sharded.shards[i]->tree->size() > 3000 and sharded.shards[i]->tree->size() < 5000);
+	for (long long low=0; low<16000; low += 997) {
+		for (long long high=low; high<16000; high += 1501) {
+			long long expected_sum = 0;
+			for (long long key=low + (low % 2); key<=high; key += 2)
+				expected_sum += key;
+			assert(sharded.augment_range(sharded_sum_id, (void*)low, true, (void*)high, true, &output) == (size_t)(high - low + 1));
+			assert(output.data.l == expected_sum);
+			sharded.augment_range(ends_id, (void*)low, true, (void*)high, true, &output);
+			assert(output.data.l == (low % 2 ? 0 : low) and output.extra.l == (high % 2 ? 0 : high));
+		}
+		assert(sharded.augment_gte(ends_id, (void*)low, &output) == (size_t)(16000 - low));
+		assert(output.data.l == (low % 2 ? 0 : low) and output.extra.l == 0);
+		assert(sharded.get_default((void*)low, (void*)-1) == (void*)(low % 2 ? 0 : low));
+	}
+	// Large results merge across shards too.
+	int sharded_top_id = sharded.new_augmentation(&top);
+	vector<long long> sharded_top(TOP_K);
+	AugmentationResult top_merged;
+	top_merged.data.vp = &sharded_top[0];
+	assert(sharded.augment_range(sharded_top_id, (void*)500, true, (void*)9000, false, &top_merged) == 8500);
+	for (int i=0; i<TOP_K; i++)
+		assert(sharded_top[i] == 8998 - 2 * i);
+	cout << "Sharded trees OK" << endl;
+
 	return 0;
 }
 
@@ -3,121 +3,495 @@
 #ifndef _UNCANNY_TREE_HEADER
 #define _UNCANNY_TREE_HEADER
 
+#include <atomic>
+#include <deque>
+#include <iterator>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <vector>
+#include <ostream>
 
-namespace Uncanny {
+#include "uncanny_bundle.h"
+#include "uncanny_pool.h"
 
-struct Tree;
+namespace Uncanny {
 
 struct AugmentationResult;
 
-struct Augmentation {
+// Three-way comparison for any key type with an operator<.
+// Returns a positive value if a > b, zero if equal, and negative if a < b.
+// Any function pointer or functor with the same contract may be used instead.
+template <typename Key>
+struct DefaultCompare {
+	int operator()(const Key& a, const Key& b) const {
+		return (b < a) - (a < b);
+	}
+};
+
+// Built-in runtime augmentations. Trees evaluate these inline, without calling
+// through the function pointers. Values are read as int64s or doubles; pointers
+// like Tree's void* values are read as their bit patterns.
+enum Builtin {
+	BUILTIN_NONE,
+	BUILTIN_COUNT,
+	BUILTIN_SUM_I64,
+	BUILTIN_SUM_F64,
+	BUILTIN_MIN_I64,
+	BUILTIN_MIN_F64,
+	BUILTIN_MAX_I64,
+	BUILTIN_MAX_F64,
+	// The sum in data.d and the sum of squares in extra.d, both as doubles.
+	// See moments_mean and moments_variance.
+	BUILTIN_MOMENTS_I64,
+	BUILTIN_MOMENTS_F64,
+	// The extreme value in data, and the first key holding it in extra.
+	// Keys must be trivially copyable, and fit in eight bytes.
+	BUILTIN_ARGMIN_I64,
+	BUILTIN_ARGMIN_F64,
+	BUILTIN_ARGMAX_I64,
+	BUILTIN_ARGMAX_F64,
+};
+
+template <typename Key, typename Value>
+struct BasicAugmentation {
 	int aug_id;
 	int schema_index;
+	Builtin builtin;
+	// Zero for results that fit in an AugmentationResult's data and extra words.
+	// Otherwise results are result_size bytes, at most MAX_RESULT_SIZE, in a buffer
+	// pointed to by data.vp: functions fill in the buffer their output points to,
+	// and callers of BasicTree's queries must provide one in each output.
+	// The tree keeps cached results in its own arena, so nothing is allocated per node.
+	size_t result_size;
+	// Where the result goes in a record of the schema's large results, as the frozen,
+	// B+tree and persistent engines store them.
+	size_t result_offset;
 	// Should read in a key value pair, and write into output.
-	void (*base_case)(void* key, void* value, AugmentationResult* output);
+	void (*base_case)(Key key, Value value, AugmentationResult* output);
 	// Should read in a and b, and write into output.
 	void (*compute)(const AugmentationResult* a, const AugmentationResult* b, AugmentationResult* output);
 	// Should return if a and b are the same.
 	bool (*compare)(const AugmentationResult* a, const AugmentationResult* b);
 
-	Augmentation();
-	Augmentation(void (*_base_case)(void* key, void* value, AugmentationResult* output),
+	BasicAugmentation();
+	BasicAugmentation(void (*_base_case)(Key key, Value value, AugmentationResult* output),
 		void (*_compute)(const AugmentationResult* a, const AugmentationResult* b, AugmentationResult* output),
 		bool (*_compare)(const AugmentationResult* a, const AugmentationResult* b));
+	explicit BasicAugmentation(Builtin kind);
+
+	// These call the functions above, or evaluate a builtin inline.
+	void run_base_case(const Key& key, const Value& value, AugmentationResult* output) const;
+	void run_compute(const AugmentationResult* a, const AugmentationResult* b, AugmentationResult* output) const;
+	bool run_compare(const AugmentationResult* a, const AugmentationResult* b) const;
 };
 
 // Augmentations all have an id, and a schema index.
 // The id is completely unique, and used to refer to the augmentation.
-// The schema index is the index into the AugmentationResult vector
+// The schema index is the index into the tree's columns
 // for where the data should be stored for the given augmentation.
 // Every time we add or remove an augmentation we update the schema,
 // repacking the remaining augmentations into the new schema.
-// This operation increments the schema_version, which is used
-// to compare against AugmentationData entries.
-struct AugmentationCtx {
+// This operation increments the schema_version, which trees
+// compare against to know when to rearrange their columns.
+template <typename Key, typename Value>
+struct BasicAugmentationCtx {
 	int next_aug_id;
 	int schema_version;
-	std::map<int, Augmentation> augs;
+	// The size of a record holding every large result in the schema.
+	size_t results_size;
+	std::map<int, BasicAugmentation<Key, Value> > augs;
 
-	AugmentationCtx();
-	int new_augmentation(Augmentation* aug);
+	BasicAugmentationCtx();
+	int new_augmentation(BasicAugmentation<Key, Value>* aug);
 	bool delete_augmentation(int aug_id);
 	void recompute_schema();
 };
 
+union AugmentationWord {
+	int i;
+	unsigned int ui;
+	long long l;
+	unsigned long long ul;
+	float f;
+	double d;
+	void* vp;
+};
+
+// Counts of what a tree has done. These are only kept when compiled with
+// UNCANNY_STATS defined (in every file, uncanny.cpp included), and are otherwise
+// always zero, and cost nothing.
+struct TreeStats {
+	// cmp_f calls.
+	size_t comparisons;
+	// Nodes that lookups and augmentation queries descended through.
+	size_t nodes_visited;
+	// Runtime augmentation results found in, or missing from, the cache.
+	size_t cache_hits;
+	size_t cache_misses;
+	// Calls to augmentations' base_case and compute.
+	size_t base_cases;
+	size_t computes;
+	size_t rotations;
+	// Chunks of cache slots allocated.
+	size_t column_allocations;
+	// Times the columns were rearranged to follow a changed schema.
+	size_t schema_migrations;
+
+	TreeStats() { clear(); }
+	void clear() {
+		comparisons = nodes_visited = cache_hits = cache_misses = base_cases = computes = 0;
+		rotations = column_allocations = schema_migrations = 0;
+	}
+};
+
+std::ostream& operator<<(std::ostream& os, const TreeStats& stats);
+
+// While a trace is alive, everything counted by any tree on the same thread
+// is also counted in its stats, to see what individual queries cost:
+//   QueryTrace trace;
+//   tree.augment_range(...);
+//   cout << trace.stats << endl;
+// Traces nest, and only the innermost one counts.
+struct QueryTrace {
+	TreeStats stats;
+	QueryTrace* outer;
+
+	QueryTrace();
+	~QueryTrace();
+	QueryTrace(const QueryTrace&) = delete;
+	QueryTrace& operator=(const QueryTrace&) = delete;
+	static QueryTrace*& current();
+};
+
 // Stores the results of the augmentation
 // at a single node in the tree.
 struct AugmentationResult {
 	bool clean;
 	int aug_id;
 	size_t data_length;
-	union {
-		int i;
-		unsigned int ui;
-		long long l;
-		unsigned long long ul;
-		float f;
-		double d;
-		void* vp;
-	} data;
+	AugmentationWord data;
+	// A second word, for results that don't fit in one, like argmins.
+	AugmentationWord extra;
 };
 
-// Stores a vector of results at one node in the tree.
-struct AugmentationData {
-	int schema_version;
-	std::vector<AugmentationResult> results;
+inline double moments_mean(const AugmentationResult* result);
+inline double moments_variance(const AugmentationResult* result);
 
-	void fill_with_dirty_to_size(size_t length);
-	void update_schema(AugmentationCtx* aug_ctx);
+// One cached result of a runtime augmentation, for one node.
+// It is only valid while epoch matches the node's aug_epoch.
+// A reader filling the slot first swaps epoch to SLOT_BUSY, and only publishes
+// the node's epoch once result is written, so concurrent readers never see half
+// a result, and never write the same slot twice.
+struct AugmentationSlot {
+	uint32_t epoch;
+	AugmentationResult result;
 };
 
-struct Node {
-	Tree* ctx;
-	Node* parent;
-	Node* left;
-	Node* right;
-	void* key;
-	void* value;
-	int height;
-	AugmentationData* aug_data;
-
-	Node(Tree* _ctx, Node* _parent, void* _key, void* _value);
-	~Node();
-	bool recompute();
-	int balance_factor();
-	void change_child(Node* from, Node* to);
-	void rotate_left();
-	void rotate_right();
-	void pprint(int depth);
+// Large results are copied through stack buffers during queries, so must stay modest.
+static const size_t MAX_RESULT_SIZE = 4096;
+
+// Never a valid aug_epoch, short of four billion invalidations of one node.
+static const uint32_t SLOT_BUSY = 0xffffffffu;
+
+// The cached results of one runtime augmentation, indexed like the tree's nodes.
+// Chunks are only allocated once some node in them is queried.
+// Results of augmentations with a result_size are kept in the arena, at the same
+// index, and each slot's data.vp points at its record.
+struct AugmentationColumn : ChunkedArray<AugmentationSlot, true> {
+	RecordArena arena;
+
+	AugmentationColumn(size_t result_size) : arena(result_size) {}
+
+	void materialize(uint32_t size) {
+		ChunkedArray<AugmentationSlot, true>::materialize(size);
+		if (arena.record_size != 0)
+			for (uint32_t i=0; i<capacity; i += FIRST_CHUNK << chunk_of(i))
+				arena[i];
+	}
+
+	void clear() {
+		ChunkedArray<AugmentationSlot, true>::clear();
+		arena.clear();
+	}
+};
+
+// Nodes live in their tree's Pool, and refer to each other by index.
+// Index 0 is a sentinel, with height 0 and an identity summary.
+template <typename Key, typename Value, typename Bundle>
+struct BasicNode {
+	NodeIndex parent;
+	NodeIndex left;
+	NodeIndex right;
+	// Cached runtime augmentations are valid while their epoch matches this.
+	// It only ever increases, even across reuse of the index.
+	uint32_t aug_epoch;
+	unsigned char height;
+	// Set when the cache is invalidated, cleared when anything is cached again.
+	bool aug_dirty;
+	// The number of nodes in this subtree, always up to date.
+	uint32_t size;
+	// Static augmentations of this whole subtree, always up to date.
+	typename Bundle::type summary;
+	Key key;
+	Value value;
+};
+
+// An immutable snapshot of a tree, made by BasicTree::freeze.
+// Entries are stored in Eytzinger (breadth first) order in flat arrays: position 1
+// is the root, and position i has children 2i and 2i+1, so descents need no
+// pointers and the next few levels can be prefetched ahead of time.
+// The augmentations registered when the snapshot was taken are precomputed
+// for every position's subtree, so queries never compute or cache anything but
+// base cases at the boundary, and any number of threads may query at once.
+template <typename Key, typename Value, typename Compare>
+struct BasicFrozenTree {
+	typedef BasicAugmentation<Key, Value> Augmentation;
+	typedef BasicAugmentationCtx<Key, Value> AugmentationCtx;
+
+	AugmentationCtx aug_ctx;
+	Compare cmp_f;
+	size_t length;
+	// Index 0 of each of these is unused.
+	std::vector<Key> keys;
+	std::vector<Value> values;
+	// The augmentation with schema index s of position i's subtree is at
+	// summaries[i * aug_ctx.augs.size() + s], and its element count in data_length.
+	std::vector<AugmentationResult> summaries;
+	// A large result is instead in results, at i * aug_ctx.results_size + result_offset,
+	// and its summary's data.vp is left NULL.
+	std::vector<char> results;
+	// Queries read through these, which point either into the vectors above,
+	// or into a mapped snapshot file (see uncanny_snapshot.h) kept alive by mapping.
+	const Key* key_data;
+	const Value* value_data;
+	const AugmentationResult* summary_data;
+	const char* result_data;
+	std::shared_ptr<const void> mapping;
+
+	BasicFrozenTree();
+	BasicFrozenTree(const BasicFrozenTree& other);
+	BasicFrozenTree& operator=(const BasicFrozenTree& other);
+	void attach_vectors();
+	void build(const Key* sorted_keys, const Value* sorted_values, size_t n);
+	size_t fill(const Key* sorted_keys, const Value* sorted_values, size_t position, size_t next);
+	const Augmentation* find_augmentation(int aug_id) const;
+	size_t find_position(const Key& key) const;
+	const Value* get(const Key& key) const;
+	Value get_default(const Key& key, Value otherwise) const;
+	size_t subtree_augmentation(const Augmentation* aug, size_t position, AugmentationResult* output) const;
+	// Everything in position's subtree below key (or equal, if inclusive), or above it.
+	size_t collect_below(const Augmentation* aug, size_t position, const Key& key, bool inclusive, AugmentationResult* output) const;
+	size_t collect_above(const Augmentation* aug, size_t position, const Key& key, bool inclusive, AugmentationResult* output) const;
+	size_t augment_range(int aug_id, const Key& low_key, bool low_inclusive, const Key& high_key, bool high_inclusive, AugmentationResult* output) const;
+	size_t augment_cut(int aug_id, const Key& key, int comparison_type, AugmentationResult* output) const;
+
+#define _UNCANNY_TREE_AUG_CONV(name) \
+	size_t name(int aug_id, const Key& key, AugmentationResult* output) const;
+
+_UNCANNY_TREE_AUG_CONV(augment_lt)
+_UNCANNY_TREE_AUG_CONV(augment_lte)
+_UNCANNY_TREE_AUG_CONV(augment_gte)
+_UNCANNY_TREE_AUG_CONV(augment_gt)
+
+#undef _UNCANNY_TREE_AUG_CONV
+
 };
 
-struct Tree {
+// An AVL tree over keys and values of arbitrary type, stored by value in the nodes.
+// Compare may be a functor or a function pointer taking two keys, and is stored
+// in cmp_f; with a functor the comparison is inlined into every descent.
+// Bundle is a set of static augmentations (see uncanny_bundle.h), queried with
+// the summarize_* functions; runtime augmentations are registered in aug_ctx.
+// Any number of threads may query a tree at once, so long as nothing modifies
+// it or its aug_ctx meanwhile; queries share the runtime augmentation cache.
+template <typename Key, typename Value, typename Compare = DefaultCompare<Key>, typename Bundle = Augmentations<> >
+struct BasicTree {
+	typedef BasicNode<Key, Value, Bundle> Node;
+	typedef BasicAugmentation<Key, Value> Augmentation;
+	typedef BasicAugmentationCtx<Key, Value> AugmentationCtx;
+	typedef typename Bundle::type Summary;
+	typedef BasicFrozenTree<Key, Value, Compare> Frozen;
+
+	// One entry of a batch for apply_batch: an upsert, or a removal if remove is set.
+	struct BatchOp {
+		Key key;
+		Value value;
+		bool remove;
+	};
+
+	// One range for augment_ranges, with the same meaning as augment_range's arguments.
+	struct RangeQuery {
+		Key low_key;
+		bool low_inclusive;
+		Key high_key;
+		bool high_inclusive;
+	};
+
+	// A runtime augmentation being computed in the background by new_augmentation_async.
+	// It is only registered in aug_ctx, and so queryable, once done.
+	// Writes pause the builder, setting paused and joining it, and poll_augmentations
+	// starts it again.
+	struct PendingAugmentation {
+		Augmentation aug;
+		AugmentationColumn* column;
+		int threads;
+		std::thread builder;
+		std::atomic<bool> done;
+		std::atomic<bool> paused;
+	};
+
+	// Subtrees waiting to be computed by one background worker, which others may steal.
+	struct BuildQueue {
+		std::mutex lock;
+		std::deque<NodeIndex> subtrees;
+	};
+
+	// Where one range stands relative to the subtree being visited by augment_ranges.
+	struct RangeCursor {
+		uint32_t range;
+		bool good_low, good_high;
+		bool go_left, here, go_right;
+	};
+
+	// Walks the nodes in key order using their parent links, so it stays valid
+	// through inserts, removes and batches until its own entry is removed, as
+	// entries never move between nodes. split, join and clear invalidate it.
+	// The end iterator is the sentinel, index 0, and decrementing it gives the last node.
+	struct iterator {
+		typedef std::bidirectional_iterator_tag iterator_category;
+		typedef Node value_type;
+		typedef ptrdiff_t difference_type;
+		typedef Node* pointer;
+		typedef Node& reference;
+
+		BasicTree* tree;
+		NodeIndex node;
+
+		iterator(BasicTree* _tree, NodeIndex _node) : tree(_tree), node(_node) {}
+		Node& operator*() const { return tree->nodes[node]; }
+		Node* operator->() const { return &tree->nodes[node]; }
+		iterator& operator++() { node = tree->successor(node); return *this; }
+		iterator& operator--() { node = node == 0 ? tree->rightmost(tree->root) : tree->predecessor(node); return *this; }
+		iterator operator++(int) { iterator old = *this; ++*this; return old; }
+		iterator operator--(int) { iterator old = *this; --*this; return old; }
+		bool operator==(const iterator& other) const { return node == other.node; }
+		bool operator!=(const iterator& other) const { return node != other.node; }
+	};
+
 	AugmentationCtx aug_ctx;
-	int (*cmp_f)(void* a, void* b);
-	Node* root;
-	void (*key_deallocator)(void* key);
-	void (*value_deallocator)(void* value);
-
-	Tree();
-	~Tree();
-	void free_subtree(Node* node);
+	Compare cmp_f;
+	Pool<Node> nodes;
+	NodeIndex root;
+	void (*key_deallocator)(Key key);
+	void (*value_deallocator)(Value value);
+	// One column per runtime augmentation, in schema order, and the aug_id each belongs to.
+	std::vector<AugmentationColumn*> columns;
+	std::vector<int> column_aug_ids;
+	int columns_version;
+	// Held while concurrent readers bring the columns up to date with the schema.
+	std::mutex columns_lock;
+	std::vector<PendingAugmentation*> pending;
+	// See TreeStats.
+	TreeStats stats;
+
+	BasicTree();
+	~BasicTree();
+	BasicTree(const BasicTree&) = delete;
+	BasicTree& operator=(const BasicTree&) = delete;
+	void clear();
 	void pprint();
-	Node* get_node(void* key);
-	void** get(void* key);
-	void* get_default(void* key, void* otherwise);
-	void insert(void* key, void* value);
-	bool rebalance_node(Node* node);
-	void remove(void* key);
-	size_t compute_augmentation(Augmentation* aug, Node* node, AugmentationResult* output);
-	size_t compute_augmentation_cut(Augmentation* aug, Node* node, void* key, int comparison_type, bool good_to_go, AugmentationResult* output);
-	size_t compute_augmentation_range(Augmentation* aug, Node* node, void* low_key, bool low_inclusive, void* high_key, bool high_inclusive, bool good_low, bool good_high, AugmentationResult* output);
-	size_t augment_range(int aug_id, void* low_key, bool low_inclusive, void* high_key, bool high_inclusive, AugmentationResult* output);
-	size_t augment_cut(int aug_id, void* key, int comparison_type, AugmentationResult* output);
+	void pprint(NodeIndex node, int depth);
+	int compare_keys(const Key& a, const Key& b);
+	Node* get_node(const Key& key);
+	NodeIndex leftmost(NodeIndex node);
+	NodeIndex rightmost(NodeIndex node);
+	NodeIndex successor(NodeIndex node);
+	NodeIndex predecessor(NodeIndex node);
+	iterator begin();
+	iterator end();
+	iterator lower_bound(const Key& key);
+	iterator upper_bound(const Key& key);
+	// Order statistics, all O(log n) using the subtree sizes.
+	size_t size();
+	iterator select(size_t k);
+	size_t rank(const Key& key);
+	iterator percentile(double fraction);
+	template <typename Callback>
+	size_t scan(const Key& low_key, bool low_inclusive, const Key& high_key, bool high_inclusive, Callback callback);
+	Value* get(const Key& key);
+	Value get_default(const Key& key, Value otherwise);
+	NodeIndex new_node(NodeIndex parent, const Key& key, const Value& value);
+	void free_node(NodeIndex node);
+	// Returns if the height changed.
+	bool recompute_height(NodeIndex node);
+	// Returns if the size changed.
+	bool recompute_size(NodeIndex node);
+	// Returns if a clean cache was invalidated.
+	bool recompute_augmentations(NodeIndex node);
+	bool recompute(NodeIndex node);
+	int balance_factor(NodeIndex node);
+	void change_child(NodeIndex parent, NodeIndex from, NodeIndex to);
+	void rotate_left(NodeIndex node);
+	void rotate_right(NodeIndex node);
+	void insert(const Key& key, const Value& value);
+	void build_from_sorted(const Key* keys, const Value* values, size_t n, int warm_threads = 0);
+	NodeIndex build_subtree(const Key* keys, const Value* values, size_t low, size_t high, NodeIndex parent);
+	void warm_augmentations(int threads);
+	void warm_subtree(NodeIndex node, int fork_depth);
+	int new_augmentation_async(Augmentation* aug, int threads);
+	void build_pending(PendingAugmentation* job, int threads);
+	void build_worker(PendingAugmentation* job, std::vector<BuildQueue>* queues, int worker);
+	size_t build_column(const Augmentation* aug, AugmentationColumn* column, NodeIndex node, AugmentationResult* output);
+	bool poll_augmentations();
+	void finish_augmentations();
+	void pause_augmentations();
+	bool rebalance_node(NodeIndex node);
+	void rebalance_path(NodeIndex node);
+	void invalidate_path(NodeIndex node);
+	void remove(const Key& key);
+	// Joining takes detached subtrees, and returns a detached subtree.
+	NodeIndex link(NodeIndex node, NodeIndex left, NodeIndex right);
+	NodeIndex detached_rotate_left(NodeIndex node);
+	NodeIndex detached_rotate_right(NodeIndex node);
+	NodeIndex join(NodeIndex left, NodeIndex middle, NodeIndex right);
+	NodeIndex join_right(NodeIndex left, NodeIndex middle, NodeIndex right);
+	NodeIndex join_left(NodeIndex left, NodeIndex middle, NodeIndex right);
+	NodeIndex join_pair(NodeIndex left, NodeIndex right);
+	NodeIndex split_last(NodeIndex node, NodeIndex* last);
+	Frozen freeze();
+	void collect_sorted(NodeIndex node, std::vector<Key>& keys, std::vector<Value>& values);
+	NodeIndex split_subtree(NodeIndex node, const Key& key, NodeIndex* right);
+	void swap_storage(BasicTree& other);
+	void forget_foreign_columns(BasicTree& previous_owner);
+	bool same_augmentation(BasicTree& other, int aug_id);
+	NodeIndex transplant(BasicTree& other, NodeIndex node, const std::vector<int>& source_columns);
+	NodeIndex transplant(BasicTree& other, NodeIndex node);
+	void split(const Key& key, BasicTree& right);
+	void join(BasicTree& other);
+	void apply_batch(const BatchOp* ops, size_t n);
+	NodeIndex apply_batch_subtree(NodeIndex node, const BatchOp* ops, size_t low, size_t high);
+	void sync_columns();
+	size_t compute_augmentation(Augmentation* aug, NodeIndex node, AugmentationResult* output);
+	size_t compute_augmentation_cut(Augmentation* aug, NodeIndex node, const Key& key, int comparison_type, bool good_to_go, AugmentationResult* output);
+	size_t compute_augmentation_range(Augmentation* aug, NodeIndex node, const Key& low_key, bool low_inclusive, const Key& high_key, bool high_inclusive, bool good_low, bool good_high, AugmentationResult* output);
+	size_t augment_range(int aug_id, const Key& low_key, bool low_inclusive, const Key& high_key, bool high_inclusive, AugmentationResult* output);
+	size_t augment_cut(int aug_id, const Key& key, int comparison_type, AugmentationResult* output);
+	void augment_ranges(int aug_id, const RangeQuery* ranges, size_t n, AugmentationResult* outputs, size_t* lengths);
+	void compute_augmentation_ranges(Augmentation* aug, NodeIndex node, const RangeQuery* ranges, std::vector<std::vector<RangeCursor> >& levels, size_t level, AugmentationResult* outputs, size_t* lengths);
+	// Several augmentations of one range or cut, writing outputs[i] for aug_ids[i],
+	// in a single iterative walk down each edge of the range.
+	size_t augment_range_multi(const int* aug_ids, size_t n, const Key& low_key, bool low_inclusive, const Key& high_key, bool high_inclusive, AugmentationResult* outputs);
+	size_t augment_cut_multi(const int* aug_ids, size_t n, const Key& key, int comparison_type, AugmentationResult* outputs);
+	void lookup_augmentations(const int* aug_ids, size_t n, Augmentation** augs);
+	void multi_add(Augmentation** augs, size_t n, NodeIndex node, bool whole_subtree, bool before, size_t* elements, AugmentationResult* outputs);
+	void multi_walk_low(Augmentation** augs, size_t n, NodeIndex node, const Key& low_key, bool low_inclusive, size_t* elements, AugmentationResult* outputs);
+	void multi_walk_high(Augmentation** augs, size_t n, NodeIndex node, const Key& high_key, bool high_inclusive, size_t* elements, AugmentationResult* outputs);
 
 #define _UNCANNY_TREE_AUG_CONV(name) \
-	size_t name(int aug_id, void* key, AugmentationResult* output);
+	size_t name(int aug_id, const Key& key, AugmentationResult* output); \
+	size_t name##_multi(const int* aug_ids, size_t n, const Key& key, AugmentationResult* outputs);
 
 _UNCANNY_TREE_AUG_CONV(augment_lt)
 _UNCANNY_TREE_AUG_CONV(augment_lte)
@@ -126,8 +500,44 @@ _UNCANNY_TREE_AUG_CONV(augment_gt)
 
 #undef _UNCANNY_TREE_AUG_CONV
 
+	// Static augmentation queries. These never touch aug_ctx, and compute
+	// every augmentation in the Bundle in the same pass.
+	Summary summarize_node(NodeIndex node, const Key* low_key, bool low_inclusive, const Key* high_key, bool high_inclusive);
+	Summary summarize_all();
+	Summary summarize_range(const Key& low_key, bool low_inclusive, const Key& high_key, bool high_inclusive);
+	Summary summarize_cut(const Key& key, int comparison_type);
+
+#define _UNCANNY_TREE_SUMMARIZE_CONV(name) \
+	Summary name(const Key& key);
+
+_UNCANNY_TREE_SUMMARIZE_CONV(summarize_lt)
+_UNCANNY_TREE_SUMMARIZE_CONV(summarize_lte)
+_UNCANNY_TREE_SUMMARIZE_CONV(summarize_gte)
+_UNCANNY_TREE_SUMMARIZE_CONV(summarize_gt)
+
+#undef _UNCANNY_TREE_SUMMARIZE_CONV
+
 };
 
+// The original untyped interface: keys and values are opaque pointers,
+// ordered by a user-supplied comparison function.
+typedef BasicAugmentation<void*, void*> Augmentation;
+typedef BasicAugmentationCtx<void*, void*> AugmentationCtx;
+typedef BasicTree<void*, void*, int (*)(void* a, void* b)> Tree;
+typedef Tree::Node Node;
+typedef Tree::Frozen FrozenTree;
+
+}
+
+#include "uncanny_impl.h"
+
+namespace Uncanny {
+
+// The untyped tree is instantiated once, in uncanny.cpp.
+extern template struct BasicAugmentationCtx<void*, void*>;
+extern template struct BasicFrozenTree<void*, void*, int (*)(void*, void*)>;
+extern template struct BasicTree<void*, void*, int (*)(void*, void*), Augmentations<> >;
+
 }
 
 #endif
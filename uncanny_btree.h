@@ -0,0 +1,619 @@
+// Uncanny B+trees.
+// An alternative engine to the AVL based BasicTree, with the same runtime
+// augmentation interface. Entries live in wide leaves, and every internal node
+// caches the augmentations of each of its children, so a tree of 100M keys is
+// only four or five levels deep, and range aggregation mostly scans leaves.
+
+#ifndef _UNCANNY_BTREE_HEADER
+#define _UNCANNY_BTREE_HEADER
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "uncanny.h"
+
+namespace Uncanny {
+
+// Searches within one node's sorted keys. The general version bisects with the
+// tree's comparator; 64-bit integer keys under DefaultCompare instead count
+// matches over the whole node with SIMD compares, which has no unpredictable
+// branches and is faster at the node sizes B+trees use.
+template <typename Key, typename Compare>
+struct NodeSearch {
+	// The number of keys that are less than key.
+	static int count_less(const Compare& cmp_f, const Key* keys, int count, const Key& key) {
+		int low = 0, high = count;
+		while (low < high) {
+			int mid = (low + high) / 2;
+			if (cmp_f(keys[mid], key) < 0) low = mid + 1;
+			else high = mid;
+		}
+		return low;
+	}
+
+	// The number of keys that are less than or equal to key.
+	static int count_less_equal(const Compare& cmp_f, const Key* keys, int count, const Key& key) {
+		int low = 0, high = count;
+		while (low < high) {
+			int mid = (low + high) / 2;
+			if (cmp_f(keys[mid], key) <= 0) low = mid + 1;
+			else high = mid;
+		}
+		return low;
+	}
+};
+
+// The instruction sets simd_count_greater can use.
+enum SimdLevel { SIMD_NONE, SIMD_SSE42, SIMD_AVX2 };
+
+// The widest the CPU supports. Builds for AVX2 know it already; the rest check once.
+inline SimdLevel simd_level() {
+#if defined(__AVX2__)
+	return SIMD_AVX2;
+#elif defined(__x86_64__) || defined(__i386__)
+	static const SimdLevel level = (__builtin_cpu_init(), __builtin_cpu_supports("avx2")) ? SIMD_AVX2 :
+		__builtin_cpu_supports("sse4.2") ? SIMD_SSE42 : SIMD_NONE;
+	return level;
+#else
+	return SIMD_NONE;
+#endif
+}
+
+template <typename Int>
+inline int scalar_count_greater(const Int* keys, int count, Int key) {
+	int total = 0;
+	for (int i=0; i<count; i++)
+		total += keys[i] > key;
+	return total;
+}
+
+// These are compiled for their instruction sets whatever the build flags,
+// so must only be called once simd_level() says the CPU has them.
+#if defined(__x86_64__) || defined(__i386__)
+template <typename Int>
+__attribute__((target("avx2"))) inline int avx2_count_greater(const Int* keys, int count, Int key) {
+	int i = 0, total = 0;
+	__m256i needle = _mm256_set1_epi64x(key);
+	for (; i + 4 <= count; i += 4) {
+		__m256i block = _mm256_loadu_si256((const __m256i*)(keys + i));
+		__m256i greater = _mm256_cmpgt_epi64(block, needle);
+		total += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(greater)));
+	}
+	return total + scalar_count_greater(keys + i, count - i, key);
+}
+
+template <typename Int>
+__attribute__((target("sse4.2"))) inline int sse42_count_greater(const Int* keys, int count, Int key) {
+	int i = 0, total = 0;
+	__m128i needle = _mm_set1_epi64x(key);
+	for (; i + 2 <= count; i += 2) {
+		__m128i block = _mm_loadu_si128((const __m128i*)(keys + i));
+		__m128i greater = _mm_cmpgt_epi64(block, needle);
+		total += __builtin_popcount(_mm_movemask_pd(_mm_castsi128_pd(greater)));
+	}
+	return total + scalar_count_greater(keys + i, count - i, key);
+}
+#endif
+
+// Counts the keys greater than key, with the widest instructions the CPU has,
+// or those of level. Requires 64-bit signed keys.
+template <typename Int>
+inline int simd_count_greater(const Int* keys, int count, Int key, SimdLevel level = simd_level()) {
+	static_assert(sizeof(Int) == 8, "SIMD node search is for 64-bit keys");
+#if defined(__x86_64__) || defined(__i386__)
+	if (level == SIMD_AVX2)
+		return avx2_count_greater(keys, count, key);
+	if (level == SIMD_SSE42)
+		return sse42_count_greater(keys, count, key);
+#endif
+	return scalar_count_greater(keys, count, key);
+}
+
+// Counts the keys less than key, as the number not greater than or equal to it.
+template <typename Int>
+inline int simd_count_less(const Int* keys, int count, Int key) {
+	// Nothing is greater than the maximum, so that must be counted directly.
+	if (key == std::numeric_limits<Int>::min())
+		return 0;
+	return count - simd_count_greater(keys, count, (Int)(key - 1));
+}
+
+#define _UNCANNY_SIMD_SEARCH(Int) \
+template <> \
+struct NodeSearch<Int, DefaultCompare<Int> > { \
+	static int count_less(const DefaultCompare<Int>& cmp_f, const Int* keys, int count, Int key) { \
+		return simd_count_less(keys, count, key); \
+	} \
+	static int count_less_equal(const DefaultCompare<Int>& cmp_f, const Int* keys, int count, Int key) { \
+		return count - simd_count_greater(keys, count, key); \
+	} \
+};
+
+_UNCANNY_SIMD_SEARCH(long)
+_UNCANNY_SIMD_SEARCH(long long)
+
+#undef _UNCANNY_SIMD_SEARCH
+
+template <typename Key, typename Value, typename Compare = DefaultCompare<Key>, int ORDER = 32>
+struct BasicBTree {
+	static_assert(ORDER >= 4 and ORDER <= 64, "ORDER must be between 4 and 64, for the clean bitmasks");
+	typedef BasicAugmentation<Key, Value> Augmentation;
+	typedef BasicAugmentationCtx<Key, Value> AugmentationCtx;
+	typedef NodeSearch<Key, Compare> Search;
+	// Every node but the root has at least this many entries or children.
+	enum { MIN_FILL = ORDER / 2 };
+
+	struct Node {
+		// The number of entries in a leaf, or children of an internal node.
+		int count;
+		bool leaf;
+	};
+
+	struct Leaf : Node {
+		Key keys[ORDER];
+		Value values[ORDER];
+	};
+
+	struct Internal : Node {
+		// keys[i] separates children[i] from children[i+1]: it is no greater than
+		// anything under children[i+1], and greater than everything under children[i].
+		Key keys[ORDER - 1];
+		Node* children[ORDER];
+		// The cached augmentation of children[i] for the augmentation with schema index s
+		// is summaries[s * ORDER + i], and is clean while bit i of clean[s] is set.
+		// A large result is in results, ORDER of them from ORDER * result_offset.
+		int schema_version;
+		std::vector<uint64_t> clean;
+		std::vector<AugmentationResult> summaries;
+		std::vector<char> results;
+	};
+
+	AugmentationCtx aug_ctx;
+	Compare cmp_f;
+	Node* root;
+	size_t length;
+	void (*key_deallocator)(Key key);
+	void (*value_deallocator)(Value value);
+
+	BasicBTree() : cmp_f() {
+		root = NULL;
+		length = 0;
+		key_deallocator = NULL;
+		value_deallocator = NULL;
+	}
+
+	~BasicBTree() {
+		if (root != NULL)
+			free_subtree(root);
+	}
+
+	BasicBTree(const BasicBTree&) = delete;
+	BasicBTree& operator=(const BasicBTree&) = delete;
+
+	void free_subtree(Node* node) {
+		if (node->leaf) {
+			delete (Leaf*)node;
+			return;
+		}
+		Internal* in = (Internal*)node;
+		for (int i=0; i<in->count; i++)
+			free_subtree(in->children[i]);
+		delete in;
+	}
+
+	// Which child of an internal node would hold key.
+	int route(Internal* in, const Key& key) {
+		return Search::count_less_equal(cmp_f, in->keys, in->count - 1, key);
+	}
+
+	Value* get(const Key& key) {
+		if (root == NULL) return NULL;
+		Node* node = root;
+		while (not node->leaf)
+			node = ((Internal*)node)->children[route((Internal*)node, key)];
+		Leaf* leaf = (Leaf*)node;
+		int i = Search::count_less(cmp_f, leaf->keys, leaf->count, key);
+		// Key not found. :(
+		if (i == leaf->count or cmp_f(leaf->keys[i], key) != 0) return NULL;
+		return &leaf->values[i];
+	}
+
+	Value get_default(const Key& key, Value otherwise) {
+		Value* ptr = get(key);
+		if (ptr == NULL) return otherwise;
+		return *ptr;
+	}
+
+	// Throws away every cached child augmentation of an internal node,
+	// for when its children have been rearranged.
+	void invalidate_all(Internal* in) {
+		for (unsigned int s=0; s<in->clean.size(); s++)
+			in->clean[s] = 0;
+	}
+
+	void invalidate_child(Internal* in, int i) {
+		uint64_t mask = ~(1ull << i);
+		for (unsigned int s=0; s<in->clean.size(); s++)
+			in->clean[s] &= mask;
+	}
+
+	Internal* new_internal() {
+		Internal* in = new Internal();
+		in->leaf = false;
+		in->count = 0;
+		in->schema_version = -1;
+		return in;
+	}
+
+	Leaf* new_leaf() {
+		Leaf* leaf = new Leaf();
+		leaf->leaf = true;
+		leaf->count = 0;
+		return leaf;
+	}
+
+	void insert(const Key& key, const Value& value) {
+		if (root == NULL)
+			root = new_leaf();
+		Key split_key;
+		Node* split = insert_subtree(root, key, value, &split_key);
+		if (split != NULL) {
+			// The root split, so grow a new one above it.
+			Internal* new_root = new_internal();
+			new_root->count = 2;
+			new_root->children[0] = root;
+			new_root->children[1] = split;
+			new_root->keys[0] = split_key;
+			root = new_root;
+		}
+	}
+
+	// Inserts below node. If node had to split, returns the new right half,
+	// and writes the key separating it from node into split_key.
+	Node* insert_subtree(Node* node, const Key& key, const Value& value, Key* split_key) {
+		if (node->leaf) {
+			Leaf* leaf = (Leaf*)node;
+			int i = Search::count_less(cmp_f, leaf->keys, leaf->count, key);
+			// Easy case, simply update a value.
+			if (i < leaf->count and cmp_f(leaf->keys[i], key) == 0) {
+				leaf->values[i] = value;
+				return NULL;
+			}
+			Leaf* right = NULL;
+			if (leaf->count == ORDER) {
+				// Full, so move the upper half out to a new leaf first.
+				right = new_leaf();
+				right->count = ORDER - MIN_FILL;
+				for (int j=0; j<right->count; j++) {
+					right->keys[j] = leaf->keys[MIN_FILL + j];
+					right->values[j] = leaf->values[MIN_FILL + j];
+				}
+				leaf->count = MIN_FILL;
+				*split_key = right->keys[0];
+				if (i > leaf->count) {
+					leaf = right;
+					i -= MIN_FILL;
+				}
+			}
+			for (int j=leaf->count; j>i; j--) {
+				leaf->keys[j] = leaf->keys[j-1];
+				leaf->values[j] = leaf->values[j-1];
+			}
+			leaf->keys[i] = key;
+			leaf->values[i] = value;
+			leaf->count++;
+			length++;
+			return right;
+		}
+		Internal* in = (Internal*)node;
+		int i = route(in, key);
+		Key child_split_key;
+		Node* child_split = insert_subtree(in->children[i], key, value, &child_split_key);
+		invalidate_child(in, i);
+		if (child_split == NULL)
+			return NULL;
+		// Our child split, so we have a new child to place right after it.
+		Internal* right = NULL;
+		int position = i + 1;
+		if (in->count == ORDER) {
+			// Full, so move the upper half out first, promoting the key between the halves.
+			right = new_internal();
+			right->count = ORDER - MIN_FILL;
+			for (int j=0; j<right->count; j++)
+				right->children[j] = in->children[MIN_FILL + j];
+			for (int j=0; j<right->count-1; j++)
+				right->keys[j] = in->keys[MIN_FILL + j];
+			*split_key = in->keys[MIN_FILL - 1];
+			in->count = MIN_FILL;
+			if (position > in->count) {
+				in = right;
+				position -= MIN_FILL;
+			}
+		}
+		for (int j=in->count; j>position; j--)
+			in->children[j] = in->children[j-1];
+		for (int j=in->count-1; j>position-1; j--)
+			in->keys[j] = in->keys[j-1];
+		in->children[position] = child_split;
+		in->keys[position - 1] = child_split_key;
+		in->count++;
+		// Children moved around, so the cached augmentations no longer line up.
+		invalidate_all(in);
+		if (right != NULL)
+			invalidate_all((Internal*)node);
+		return right;
+	}
+
+	void remove(const Key& key) {
+		if (root == NULL) return;
+		remove_subtree(root, key);
+		// Shrink the tree when the root runs out of entries, or down to one child.
+		if (root->leaf and root->count == 0) {
+			delete (Leaf*)root;
+			root = NULL;
+		} else if (not root->leaf and root->count == 1) {
+			Internal* old_root = (Internal*)root;
+			root = old_root->children[0];
+			delete old_root;
+		}
+	}
+
+	// Returns if anything was removed. Children that fall below MIN_FILL are
+	// topped up from a sibling, or merged into one.
+	bool remove_subtree(Node* node, const Key& key) {
+		if (node->leaf) {
+			Leaf* leaf = (Leaf*)node;
+			int i = Search::count_less(cmp_f, leaf->keys, leaf->count, key);
+			// If there does not exist such an item, we're done!
+			if (i == leaf->count or cmp_f(leaf->keys[i], key) != 0)
+				return false;
+			// Deallocate memory, if required.
+			if (key_deallocator != NULL)
+				key_deallocator(leaf->keys[i]);
+			if (value_deallocator != NULL)
+				value_deallocator(leaf->values[i]);
+			for (int j=i; j<leaf->count-1; j++) {
+				leaf->keys[j] = leaf->keys[j+1];
+				leaf->values[j] = leaf->values[j+1];
+			}
+			leaf->count--;
+			length--;
+			return true;
+		}
+		Internal* in = (Internal*)node;
+		int i = route(in, key);
+		if (not remove_subtree(in->children[i], key))
+			return false;
+		invalidate_child(in, i);
+		if (in->children[i]->count < MIN_FILL)
+			refill_child(in, i);
+		return true;
+	}
+
+	void refill_child(Internal* in, int i) {
+		if (i > 0 and in->children[i-1]->count > MIN_FILL)
+			borrow_from_left(in, i);
+		else if (i + 1 < in->count and in->children[i+1]->count > MIN_FILL)
+			borrow_from_right(in, i);
+		else if (i > 0)
+			merge_children(in, i - 1);
+		else
+			merge_children(in, i);
+	}
+
+	// Moves the last entry or child of children[i-1] to the front of children[i].
+	void borrow_from_left(Internal* in, int i) {
+		Node* node = in->children[i];
+		Node* sibling = in->children[i-1];
+		if (node->leaf) {
+			Leaf* leaf = (Leaf*)node;
+			Leaf* from = (Leaf*)sibling;
+			for (int j=leaf->count; j>0; j--) {
+				leaf->keys[j] = leaf->keys[j-1];
+				leaf->values[j] = leaf->values[j-1];
+			}
+			leaf->keys[0] = from->keys[from->count-1];
+			leaf->values[0] = from->values[from->count-1];
+			in->keys[i-1] = leaf->keys[0];
+		} else {
+			Internal* child = (Internal*)node;
+			Internal* from = (Internal*)sibling;
+			for (int j=child->count; j>0; j--)
+				child->children[j] = child->children[j-1];
+			for (int j=child->count-1; j>0; j--)
+				child->keys[j] = child->keys[j-1];
+			child->children[0] = from->children[from->count-1];
+			child->keys[0] = in->keys[i-1];
+			in->keys[i-1] = from->keys[from->count-2];
+			invalidate_all(child);
+		}
+		node->count++;
+		sibling->count--;
+		invalidate_child(in, i-1);
+		invalidate_child(in, i);
+	}
+
+	// Moves the first entry or child of children[i+1] to the end of children[i].
+	void borrow_from_right(Internal* in, int i) {
+		Node* node = in->children[i];
+		Node* sibling = in->children[i+1];
+		if (node->leaf) {
+			Leaf* leaf = (Leaf*)node;
+			Leaf* from = (Leaf*)sibling;
+			leaf->keys[leaf->count] = from->keys[0];
+			leaf->values[leaf->count] = from->values[0];
+			for (int j=0; j<from->count-1; j++) {
+				from->keys[j] = from->keys[j+1];
+				from->values[j] = from->values[j+1];
+			}
+			in->keys[i] = from->keys[0];
+		} else {
+			Internal* child = (Internal*)node;
+			Internal* from = (Internal*)sibling;
+			child->children[child->count] = from->children[0];
+			child->keys[child->count-1] = in->keys[i];
+			// The bit for the new position may be left over from an earlier, longer child.
+			invalidate_child(child, child->count);
+			in->keys[i] = from->keys[0];
+			for (int j=0; j<from->count-1; j++)
+				from->children[j] = from->children[j+1];
+			for (int j=0; j<from->count-2; j++)
+				from->keys[j] = from->keys[j+1];
+			invalidate_all(from);
+		}
+		node->count++;
+		sibling->count--;
+		invalidate_child(in, i);
+		invalidate_child(in, i+1);
+	}
+
+	// Merges children[i+1] into children[i], which must fit.
+	void merge_children(Internal* in, int i) {
+		Node* node = in->children[i];
+		Node* sibling = in->children[i+1];
+		assert(node->count + sibling->count <= ORDER);
+		if (node->leaf) {
+			Leaf* leaf = (Leaf*)node;
+			Leaf* from = (Leaf*)sibling;
+			for (int j=0; j<from->count; j++) {
+				leaf->keys[leaf->count + j] = from->keys[j];
+				leaf->values[leaf->count + j] = from->values[j];
+			}
+			leaf->count += from->count;
+			delete from;
+		} else {
+			Internal* child = (Internal*)node;
+			Internal* from = (Internal*)sibling;
+			child->keys[child->count-1] = in->keys[i];
+			for (int j=0; j<from->count; j++)
+				child->children[child->count + j] = from->children[j];
+			for (int j=0; j<from->count-1; j++)
+				child->keys[child->count + j] = from->keys[j];
+			child->count += from->count;
+			invalidate_all(child);
+			delete from;
+		}
+		for (int j=i+1; j<in->count-1; j++)
+			in->children[j] = in->children[j+1];
+		for (int j=i; j<in->count-2; j++)
+			in->keys[j] = in->keys[j+1];
+		in->count--;
+		invalidate_all(in);
+	}
+
+	// Gets the cached augmentation of in->children[i], computing it if needed.
+	size_t child_augmentation(Augmentation* aug, Internal* in, int i, AugmentationResult* output) {
+		if (in->schema_version != aug_ctx.schema_version) {
+			// The schema changed, so start over with an empty cache in the new layout.
+			in->clean.assign(aug_ctx.augs.size(), 0);
+			in->summaries.resize(aug_ctx.augs.size() * ORDER);
+			in->results.resize(aug_ctx.results_size * ORDER);
+			in->schema_version = aug_ctx.schema_version;
+		}
+		AugmentationResult* cached_result = &in->summaries[aug->schema_index * ORDER + i];
+		uint64_t bit = 1ull << i;
+		if (not (in->clean[aug->schema_index] & bit)) {
+			AugmentationResult fresh;
+			_UNCANNY_RESULT_BUFFER(aug->result_size, fresh);
+			size_t elements = compute_augmentation(aug, in->children[i], NULL, false, NULL, false, &fresh);
+			*cached_result = fresh;
+			if (aug->result_size != 0) {
+				cached_result->data.vp = &in->results[aug->result_offset * ORDER + i * aug->result_size];
+				memcpy(cached_result->data.vp, fresh.data.vp, aug->result_size);
+			}
+			cached_result->clean = true;
+			cached_result->aug_id = aug->aug_id;
+			cached_result->data_length = elements;
+			in->clean[aug->schema_index] |= bit;
+		}
+		copy_result(aug->result_size, output, cached_result);
+		return cached_result->data_length;
+	}
+
+	// Computes the augmentation of everything under node within the bounds.
+	// A NULL bound means everything under node is known to be on the good side of it.
+	size_t compute_augmentation(Augmentation* aug, Node* node, const Key* low_key, bool low_inclusive, const Key* high_key, bool high_inclusive, AugmentationResult* output) {
+		size_t elements = 0;
+		if (node->leaf) {
+			// Entries are contiguous, so this is a straight scan.
+			Leaf* leaf = (Leaf*)node;
+			int start = 0, end = leaf->count;
+			if (low_key != NULL)
+				start = low_inclusive ? Search::count_less(cmp_f, leaf->keys, leaf->count, *low_key) : Search::count_less_equal(cmp_f, leaf->keys, leaf->count, *low_key);
+			if (high_key != NULL)
+				end = high_inclusive ? Search::count_less_equal(cmp_f, leaf->keys, leaf->count, *high_key) : Search::count_less(cmp_f, leaf->keys, leaf->count, *high_key);
+			AugmentationResult temp;
+			_UNCANNY_RESULT_BUFFER(aug->result_size, temp);
+			for (int i=start; i<end; i++) {
+				aug->run_base_case(leaf->keys[i], leaf->values[i], &temp);
+				append_augmentation(aug, &temp, 1, output, &elements);
+			}
+			return elements;
+		}
+		Internal* in = (Internal*)node;
+		int first = low_key == NULL ? 0 : route(in, *low_key);
+		int last = high_key == NULL ? in->count - 1 : route(in, *high_key);
+		AugmentationResult temp;
+		_UNCANNY_RESULT_BUFFER(aug->result_size, temp);
+		for (int i=first; i<=last; i++) {
+			size_t new_elements;
+			// Only the children holding the bounds are partial; the rest come from the cache.
+			bool partial_low = low_key != NULL and i == first;
+			bool partial_high = high_key != NULL and i == last;
+			if (partial_low or partial_high)
+				new_elements = compute_augmentation(aug, in->children[i], partial_low ? low_key : NULL, low_inclusive, partial_high ? high_key : NULL, high_inclusive, &temp);
+			else
+				new_elements = child_augmentation(aug, in, i, &temp);
+			append_augmentation(aug, &temp, new_elements, output, &elements);
+		}
+		return elements;
+	}
+
+	size_t augment_range(int aug_id, const Key& low_key, bool low_inclusive, const Key& high_key, bool high_inclusive, AugmentationResult* output) {
+		assert(aug_ctx.augs.count(aug_id) == 1);
+		Augmentation* aug = &aug_ctx.augs[aug_id];
+		int comparison = cmp_f(low_key, high_key);
+		// As with BasicTree, the interval [x, x) is ambiguous, so we won't handle it.
+		assert(comparison != 0 or low_inclusive == high_inclusive);
+		if (root == NULL or comparison > 0)
+			return 0;
+		return compute_augmentation(aug, root, &low_key, low_inclusive, &high_key, high_inclusive, output);
+	}
+
+	size_t augment_cut(int aug_id, const Key& key, int comparison_type, AugmentationResult* output) {
+		// Same comparison_type convention as BasicTree::augment_cut.
+		assert(comparison_type >= -2 and comparison_type <= 2 and comparison_type != 0);
+		assert(aug_ctx.augs.count(aug_id) == 1);
+		Augmentation* aug = &aug_ctx.augs[aug_id];
+		if (root == NULL)
+			return 0;
+		if (comparison_type < 0)
+			return compute_augmentation(aug, root, NULL, false, &key, comparison_type == -1, output);
+		return compute_augmentation(aug, root, &key, comparison_type == 1, NULL, false, output);
+	}
+
+#define _UNCANNY_BTREE_AUG_CONV(name, val) \
+	size_t name(int aug_id, const Key& key, AugmentationResult* output) { \
+		return augment_cut(aug_id, key, val, output); \
+	}
+
+_UNCANNY_BTREE_AUG_CONV(augment_lt, -2)
+_UNCANNY_BTREE_AUG_CONV(augment_lte, -1)
+_UNCANNY_BTREE_AUG_CONV(augment_gte, 1)
+_UNCANNY_BTREE_AUG_CONV(augment_gt, 2)
+
+#undef _UNCANNY_BTREE_AUG_CONV
+
+};
+
+}
+
+#endif
+
@@ -0,0 +1,159 @@
+// Uncanny trees, static augmentations.
+
+#ifndef _UNCANNY_BUNDLE_HEADER
+#define _UNCANNY_BUNDLE_HEADER
+
+#include <stddef.h>
+
+#include <limits>
+#include <tuple>
+#include <utility>
+
+namespace Uncanny {
+
+// A static augmentation is a monoid over key value pairs, given as a type with:
+//   typedef ... type;
+//   static type identity();
+//   template <typename Key, typename Value>
+//   static type base_case(const Key& key, const Value& value);
+//   static type combine(const type& a, const type& b);
+// combine must be associative, and a always covers smaller keys than b.
+// Unlike runtime Augmentations these are fixed at compile time, kept up to date
+// eagerly in every node, and all of a tree's static augmentations are computed
+// together, so there is no per-augmentation traversal or indirect call.
+
+struct Count {
+	typedef size_t type;
+	static type identity() { return 0; }
+	template <typename Key, typename Value>
+	static type base_case(const Key& key, const Value& value) { return 1; }
+	static type combine(const type& a, const type& b) { return a + b; }
+};
+
+template <typename T>
+struct Sum {
+	typedef T type;
+	static type identity() { return 0; }
+	template <typename Key, typename Value>
+	static type base_case(const Key& key, const Value& value) { return (T)value; }
+	static type combine(const type& a, const type& b) { return a + b; }
+};
+
+template <typename T>
+struct Min {
+	typedef T type;
+	static type identity() {
+		return std::numeric_limits<T>::has_infinity ? std::numeric_limits<T>::infinity() : std::numeric_limits<T>::max();
+	}
+	template <typename Key, typename Value>
+	static type base_case(const Key& key, const Value& value) { return (T)value; }
+	static type combine(const type& a, const type& b) { return b < a ? b : a; }
+};
+
+template <typename T>
+struct Max {
+	typedef T type;
+	static type identity() {
+		return std::numeric_limits<T>::has_infinity ? -std::numeric_limits<T>::infinity() : std::numeric_limits<T>::lowest();
+	}
+	template <typename Key, typename Value>
+	static type base_case(const Key& key, const Value& value) { return (T)value; }
+	static type combine(const type& a, const type& b) { return a < b ? b : a; }
+};
+
+// With Sum and Count, gives the mean and variance.
+template <typename T>
+struct SumSquares {
+	typedef T type;
+	static type identity() { return 0; }
+	template <typename Key, typename Value>
+	static type base_case(const Key& key, const Value& value) { return (T)value * (T)value; }
+	static type combine(const type& a, const type& b) { return a + b; }
+};
+
+// The smallest value, and the first key holding it.
+template <typename T, typename K>
+struct ArgMin {
+	typedef std::pair<T, K> type;
+	static type identity() { return type(Min<T>::identity(), K()); }
+	template <typename Key, typename Value>
+	static type base_case(const Key& key, const Value& value) { return type((T)value, key); }
+	static type combine(const type& a, const type& b) { return b.first < a.first ? b : a; }
+};
+
+// The largest value, and the first key holding it.
+template <typename T, typename K>
+struct ArgMax {
+	typedef std::pair<T, K> type;
+	static type identity() { return type(Max<T>::identity(), K()); }
+	template <typename Key, typename Value>
+	static type base_case(const Key& key, const Value& value) { return type((T)value, key); }
+	static type combine(const type& a, const type& b) { return a.first < b.first ? b : a; }
+};
+
+// Applies each operation to element I-1 of the bundle, then recurses down to element 0.
+template <size_t I, typename... Augs>
+struct _BundleStep {
+	typedef typename std::tuple_element<I-1, std::tuple<Augs...> >::type Aug;
+	typedef std::tuple<typename Augs::type...> type;
+	typedef _BundleStep<I-1, Augs...> Next;
+
+	static void identity(type& out) {
+		std::get<I-1>(out) = Aug::identity();
+		Next::identity(out);
+	}
+
+	template <typename Key, typename Value>
+	static void base_case(const Key& key, const Value& value, type& out) {
+		std::get<I-1>(out) = Aug::base_case(key, value);
+		Next::base_case(key, value, out);
+	}
+
+	static void combine(const type& a, const type& b, type& out) {
+		std::get<I-1>(out) = Aug::combine(std::get<I-1>(a), std::get<I-1>(b));
+		Next::combine(a, b, out);
+	}
+};
+
+template <typename... Augs>
+struct _BundleStep<0, Augs...> {
+	typedef std::tuple<typename Augs::type...> type;
+	static void identity(type& out) {}
+	template <typename Key, typename Value>
+	static void base_case(const Key& key, const Value& value, type& out) {}
+	static void combine(const type& a, const type& b, type& out) {}
+};
+
+// A fixed set of static augmentations for a tree, e.g.:
+//   BasicTree<long long, long long, DefaultCompare<long long>, Augmentations<Count, Sum<long long>, Max<long long> > >
+// Each node stores one packed Augmentations::type (a std::tuple, read with std::get<i>)
+// summarizing its subtree. Summaries of disjoint key ranges are combined element-wise.
+template <typename... Augs>
+struct Augmentations {
+	typedef std::tuple<typename Augs::type...> type;
+	typedef _BundleStep<sizeof...(Augs), Augs...> Steps;
+	static const bool empty = sizeof...(Augs) == 0;
+
+	static type identity() {
+		type out;
+		Steps::identity(out);
+		return out;
+	}
+
+	template <typename Key, typename Value>
+	static type base_case(const Key& key, const Value& value) {
+		type out;
+		Steps::base_case(key, value, out);
+		return out;
+	}
+
+	// out may alias a or b.
+	static void combine(const type& a, const type& b, type& out) {
+		Steps::combine(a, b, out);
+	}
+};
+
+}
+
+#endif
+
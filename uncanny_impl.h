@@ -0,0 +1,2359 @@
+// Uncanny trees, template implementation.
+// Included from uncanny.h; do not include directly.
+
+#ifndef _UNCANNY_TREE_IMPL_HEADER
+#define _UNCANNY_TREE_IMPL_HEADER
+
+#include <alloca.h>
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <iostream>
+#include <thread>
+#include <type_traits>
+
+namespace Uncanny {
+
+inline QueryTrace*& QueryTrace::current() {
+	static thread_local QueryTrace* trace = NULL;
+	return trace;
+}
+
+inline QueryTrace::QueryTrace() {
+	outer = current();
+	current() = this;
+}
+
+inline QueryTrace::~QueryTrace() {
+	current() = outer;
+}
+
+inline std::ostream& operator<<(std::ostream& os, const TreeStats& stats) {
+	return os << "comparisons=" << stats.comparisons << " nodes_visited=" << stats.nodes_visited
+		<< " cache_hits=" << stats.cache_hits << " cache_misses=" << stats.cache_misses
+		<< " base_cases=" << stats.base_cases << " computes=" << stats.computes
+		<< " rotations=" << stats.rotations << " column_allocations=" << stats.column_allocations
+		<< " schema_migrations=" << stats.schema_migrations;
+}
+
+// Concurrent queries may count at once.
+inline void count_stat(size_t* counter, size_t TreeStats::*field) {
+	__atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+	QueryTrace* trace = QueryTrace::current();
+	if (trace != NULL)
+		trace->stats.*field += 1;
+}
+
+#ifdef UNCANNY_STATS
+#define _UNCANNY_COUNT_IN(stats, field) count_stat(&(stats).field, &TreeStats::field)
+#else
+#define _UNCANNY_COUNT_IN(stats, field) ((void)0)
+#endif
+#define _UNCANNY_COUNT(field) _UNCANNY_COUNT_IN(stats, field)
+
+// Points result at a buffer for a large result, on the calling function's stack.
+// Unlike the other macros here, it stays defined, for the headers built on trees.
+#define _UNCANNY_RESULT_BUFFER(result_size, result) \
+	if ((result_size) != 0) \
+		(result).data.vp = alloca(result_size)
+
+// Copies result into output, and for large results into output's own buffer.
+inline void copy_result(size_t result_size, AugmentationResult* output, const AugmentationResult* result) {
+	if (result_size == 0) {
+		*output = *result;
+		return;
+	}
+	void* buffer = output->data.vp;
+	*output = *result;
+	output->data.vp = buffer;
+	if (buffer != result->data.vp)
+		memcpy(buffer, result->data.vp, result_size);
+}
+
+// Caches result in the column's slot for index, with any large result in the column's arena.
+inline void store_slot(AugmentationColumn* column, NodeIndex index, AugmentationSlot* slot, const AugmentationResult* result) {
+	slot->result = *result;
+	if (column->arena.record_size != 0) {
+		slot->result.data.vp = column->arena[index];
+		memcpy(slot->result.data.vp, result->data.vp, column->arena.record_size);
+	}
+}
+
+#define _UNCANNY_TREE_TEMPLATE template <typename Key, typename Value, typename Compare, typename Bundle>
+#define _UNCANNY_TREE BasicTree<Key, Value, Compare, Bundle>
+
+// Used by pprint. Opaque pointers are printed as integers, like the original tree did.
+template <typename T>
+inline void pprint_item(std::ostream& os, const T& x) {
+	os << x;
+}
+
+inline void pprint_item(std::ostream& os, void* x) {
+	os << (long long)x;
+}
+
+// Builtins read values as int64s or doubles, by conversion, or for pointers by bit pattern.
+// Other types, like strings, can only be counted.
+template <typename T>
+struct BuiltinReadable : std::integral_constant<int, std::is_pointer<T>::value ? 2 : (std::is_arithmetic<T>::value or std::is_enum<T>::value)> {};
+
+template <typename T>
+inline long long builtin_integer(const T& x, std::integral_constant<int, 0>) {
+	assert(false);
+	return 0;
+}
+
+template <typename T, int readable>
+inline long long builtin_integer(const T& x, std::integral_constant<int, readable>) {
+	return (long long)x;
+}
+
+template <typename T>
+inline long long builtin_integer(const T& x) {
+	return builtin_integer(x, BuiltinReadable<T>());
+}
+
+template <typename T>
+inline double builtin_double(const T& x, std::integral_constant<int, 0>) {
+	assert(false);
+	return 0;
+}
+
+template <typename T>
+inline double builtin_double(const T& x, std::integral_constant<int, 1>) {
+	return (double)x;
+}
+
+template <typename T>
+inline double builtin_double(const T& x, std::integral_constant<int, 2>) {
+	double d;
+	memcpy(&d, &x, sizeof(double));
+	return d;
+}
+
+template <typename T>
+inline double builtin_double(const T& x) {
+	return builtin_double(x, BuiltinReadable<T>());
+}
+
+template <typename Key>
+inline void builtin_key(const Key& key, AugmentationWord* output, std::true_type) {
+	output->ul = 0;
+	memcpy(output, &key, sizeof(Key));
+}
+
+template <typename Key>
+inline void builtin_key(const Key& key, AugmentationWord* output, std::false_type) {
+	assert(false); // Argmins and argmaxes need keys that fit in a word.
+}
+
+template <typename Key, typename Value>
+inline void builtin_base_case(Builtin kind, const Key& key, const Value& value, AugmentationResult* output) {
+	output->data_length = 1;
+	output->extra.ul = 0;
+	switch (kind) {
+	case BUILTIN_COUNT:
+		output->data.l = 1;
+		break;
+	case BUILTIN_SUM_I64: case BUILTIN_MIN_I64: case BUILTIN_MAX_I64:
+		output->data.l = builtin_integer(value);
+		break;
+	case BUILTIN_SUM_F64: case BUILTIN_MIN_F64: case BUILTIN_MAX_F64:
+		output->data.d = builtin_double(value);
+		break;
+	case BUILTIN_MOMENTS_I64: case BUILTIN_MOMENTS_F64: {
+		double x = kind == BUILTIN_MOMENTS_I64 ? (double)builtin_integer(value) : builtin_double(value);
+		output->data.d = x;
+		output->extra.d = x * x;
+		break;
+	}
+	case BUILTIN_ARGMIN_I64: case BUILTIN_ARGMAX_I64:
+		output->data.l = builtin_integer(value);
+		builtin_key(key, &output->extra, std::integral_constant<bool, std::is_trivially_copyable<Key>::value and sizeof(Key) <= sizeof(AugmentationWord)>());
+		break;
+	case BUILTIN_ARGMIN_F64: case BUILTIN_ARGMAX_F64:
+		output->data.d = builtin_double(value);
+		builtin_key(key, &output->extra, std::integral_constant<bool, std::is_trivially_copyable<Key>::value and sizeof(Key) <= sizeof(AugmentationWord)>());
+		break;
+	case BUILTIN_NONE:
+		assert(false);
+	}
+}
+
+// output may alias a or b. Ties go to a, so argmins find the first key.
+inline void builtin_compute(Builtin kind, const AugmentationResult* a, const AugmentationResult* b, AugmentationResult* output) {
+	size_t data_length = a->data_length + b->data_length;
+	AugmentationWord data, extra;
+	data.ul = extra.ul = 0;
+	switch (kind) {
+	case BUILTIN_COUNT: case BUILTIN_SUM_I64:
+		// Integer sums wrap, as UncannyQuery's do, rather than overflowing.
+		data.ul = a->data.ul + b->data.ul;
+		break;
+	case BUILTIN_SUM_F64:
+		data.d = a->data.d + b->data.d;
+		break;
+	case BUILTIN_MIN_I64:
+		data.l = b->data.l < a->data.l ? b->data.l : a->data.l;
+		break;
+	case BUILTIN_MIN_F64:
+		data.d = b->data.d < a->data.d ? b->data.d : a->data.d;
+		break;
+	case BUILTIN_MAX_I64:
+		data.l = a->data.l < b->data.l ? b->data.l : a->data.l;
+		break;
+	case BUILTIN_MAX_F64:
+		data.d = a->data.d < b->data.d ? b->data.d : a->data.d;
+		break;
+	case BUILTIN_MOMENTS_I64: case BUILTIN_MOMENTS_F64:
+		data.d = a->data.d + b->data.d;
+		extra.d = a->extra.d + b->extra.d;
+		break;
+	case BUILTIN_ARGMIN_I64: case BUILTIN_ARGMIN_F64: case BUILTIN_ARGMAX_I64: case BUILTIN_ARGMAX_F64: {
+		bool take_b;
+		if (kind == BUILTIN_ARGMIN_I64) take_b = b->data.l < a->data.l;
+		else if (kind == BUILTIN_ARGMIN_F64) take_b = b->data.d < a->data.d;
+		else if (kind == BUILTIN_ARGMAX_I64) take_b = a->data.l < b->data.l;
+		else take_b = a->data.d < b->data.d;
+		const AugmentationResult* winner = take_b ? b : a;
+		data = winner->data;
+		extra = winner->extra;
+		break;
+	}
+	case BUILTIN_NONE:
+		assert(false);
+	}
+	output->data = data;
+	output->extra = extra;
+	output->data_length = data_length;
+}
+
+inline bool builtin_compare(const AugmentationResult* a, const AugmentationResult* b) {
+	return a->data.ul == b->data.ul and a->extra.ul == b->extra.ul;
+}
+
+// Function pointer versions of the builtins, for anything calling base_case and compute directly.
+template <typename Key, typename Value, Builtin kind>
+void builtin_base_case_function(Key key, Value value, AugmentationResult* output) {
+	builtin_base_case(kind, key, value, output);
+}
+
+template <Builtin kind>
+void builtin_compute_function(const AugmentationResult* a, const AugmentationResult* b, AugmentationResult* output) {
+	builtin_compute(kind, a, b, output);
+}
+
+inline double moments_mean(const AugmentationResult* result) {
+	return result->data.d / result->data_length;
+}
+
+// The population variance.
+inline double moments_variance(const AugmentationResult* result) {
+	double mean = moments_mean(result);
+	return result->extra.d / result->data_length - mean * mean;
+}
+
+template <typename Key, typename Value>
+BasicAugmentation<Key, Value>::BasicAugmentation() {
+	aug_id = -1;
+	schema_index = -1;
+	builtin = BUILTIN_NONE;
+	result_size = 0;
+	result_offset = 0;
+}
+
+template <typename Key, typename Value>
+BasicAugmentation<Key, Value>::BasicAugmentation(void (*_base_case)(Key, Value, AugmentationResult*),
+	void (*_compute)(const AugmentationResult*, const AugmentationResult*, AugmentationResult*),
+	bool (*_compare)(const AugmentationResult*, const AugmentationResult*)) {
+	builtin = BUILTIN_NONE;
+	result_size = 0;
+	result_offset = 0;
+	base_case = _base_case;
+	compute = _compute;
+	compare = _compare;
+}
+
+template <typename Key, typename Value>
+BasicAugmentation<Key, Value>::BasicAugmentation(Builtin kind) {
+	aug_id = -1;
+	schema_index = -1;
+	builtin = kind;
+	result_size = 0;
+	result_offset = 0;
+	compare = builtin_compare;
+	switch (kind) {
+#define BUILTIN_CASE(kind) \
+	case kind: \
+		base_case = builtin_base_case_function<Key, Value, kind>; \
+		compute = builtin_compute_function<kind>; \
+		break;
+	BUILTIN_CASE(BUILTIN_COUNT)
+	BUILTIN_CASE(BUILTIN_SUM_I64)
+	BUILTIN_CASE(BUILTIN_SUM_F64)
+	BUILTIN_CASE(BUILTIN_MIN_I64)
+	BUILTIN_CASE(BUILTIN_MIN_F64)
+	BUILTIN_CASE(BUILTIN_MAX_I64)
+	BUILTIN_CASE(BUILTIN_MAX_F64)
+	BUILTIN_CASE(BUILTIN_MOMENTS_I64)
+	BUILTIN_CASE(BUILTIN_MOMENTS_F64)
+	BUILTIN_CASE(BUILTIN_ARGMIN_I64)
+	BUILTIN_CASE(BUILTIN_ARGMIN_F64)
+	BUILTIN_CASE(BUILTIN_ARGMAX_I64)
+	BUILTIN_CASE(BUILTIN_ARGMAX_F64)
+#undef BUILTIN_CASE
+	case BUILTIN_NONE:
+		assert(false);
+	}
+}
+
+template <typename Key, typename Value>
+inline void BasicAugmentation<Key, Value>::run_base_case(const Key& key, const Value& value, AugmentationResult* output) const {
+	if (builtin != BUILTIN_NONE)
+		builtin_base_case(builtin, key, value, output);
+	else
+		base_case(key, value, output);
+}
+
+template <typename Key, typename Value>
+inline void BasicAugmentation<Key, Value>::run_compute(const AugmentationResult* a, const AugmentationResult* b, AugmentationResult* output) const {
+	if (builtin != BUILTIN_NONE)
+		builtin_compute(builtin, a, b, output);
+	else
+		compute(a, b, output);
+}
+
+template <typename Key, typename Value>
+inline bool BasicAugmentation<Key, Value>::run_compare(const AugmentationResult* a, const AugmentationResult* b) const {
+	if (builtin != BUILTIN_NONE)
+		return builtin_compare(a, b);
+	return compare(a, b);
+}
+
+template <typename Key, typename Value>
+BasicAugmentationCtx<Key, Value>::BasicAugmentationCtx() {
+	next_aug_id = 1;
+	schema_version = 0;
+	results_size = 0;
+}
+
+template <typename Key, typename Value>
+int BasicAugmentationCtx<Key, Value>::new_augmentation(BasicAugmentation<Key, Value>* aug) {
+	augs[next_aug_id] = *aug;
+	augs[next_aug_id].aug_id = next_aug_id;
+	recompute_schema();
+	return next_aug_id++;
+}
+
+template <typename Key, typename Value>
+bool BasicAugmentationCtx<Key, Value>::delete_augmentation(int aug_id) {
+	// Can't delete what we don't have.
+	if (not augs.count(aug_id)) return false;
+	augs.erase(aug_id);
+	recompute_schema();
+	return true;
+}
+
+// Recomputes which augmentation goes in which AugmentationData slot.
+template <typename Key, typename Value>
+void BasicAugmentationCtx<Key, Value>::recompute_schema() {
+	// Renumber all of the augmentations, and pack their large results in the same order.
+	int schema_index = 0;
+	results_size = 0;
+	for (typename std::map<int, BasicAugmentation<Key, Value> >::iterator iter = augs.begin(); iter != augs.end(); iter++) {
+		iter->second.schema_index = schema_index++;
+		iter->second.result_offset = results_size;
+		results_size += iter->second.result_size;
+	}
+	schema_version++;
+}
+
+_UNCANNY_TREE_TEMPLATE
+_UNCANNY_TREE::BasicTree() : cmp_f() {
+	root = 0;
+	key_deallocator = NULL;
+	value_deallocator = NULL;
+	columns_version = -1;
+	nodes[0].summary = Bundle::identity();
+}
+
+_UNCANNY_TREE_TEMPLATE
+_UNCANNY_TREE::~BasicTree() {
+	pause_augmentations();
+	for (unsigned int i=0; i<pending.size(); i++) {
+		delete pending[i]->column;
+		delete pending[i];
+	}
+	for (unsigned int i=0; i<columns.size(); i++)
+		delete columns[i];
+}
+
+// Drops every node at once, without walking the tree.
+// Like the destructor, this does not call the deallocators.
+_UNCANNY_TREE_TEMPLATE
+void _UNCANNY_TREE::clear() {
+	pause_augmentations();
+	nodes.clear();
+	nodes[0].summary = Bundle::identity();
+	root = 0;
+	for (unsigned int i=0; i<columns.size(); i++)
+		columns[i]->clear();
+	for (unsigned int i=0; i<pending.size(); i++)
+		pending[i]->column->clear();
+}
+
+_UNCANNY_TREE_TEMPLATE
+void _UNCANNY_TREE::pprint() {
+	if (root == 0) std::cout << "---" << std::endl;
+	else pprint(root, 0);
+}
+
+_UNCANNY_TREE_TEMPLATE
+void _UNCANNY_TREE::pprint(NodeIndex index, int depth) {
+	using std::cout;
+	using std::endl;
+	Node* node = &nodes[index];
+	if (node->right != 0)
+		pprint(node->right, depth+1);
+	else if (node->left != 0) {
+		for (int i=0; i<depth; i++) cout << "  ";
+		cout << "   ---" << endl;
+	}
+	for (int i=0; i<depth; i++) cout << "  ";
+	pprint_item(cout, node->key);
+	cout << ": ";
+	pprint_item(cout, node->value);
+	cout << endl;
+	if (node->left != 0)
+		pprint(node->left, depth+1);
+	else if (node->right != 0) {
+		for (int i=0; i<depth; i++) cout << "  ";
+		cout << "   ---" << endl;
+	}
+}
+
+_UNCANNY_TREE_TEMPLATE
+inline int _UNCANNY_TREE::compare_keys(const Key& a, const Key& b) {
+	_UNCANNY_COUNT(comparisons);
+	return cmp_f(a, b);
+}
+
+_UNCANNY_TREE_TEMPLATE
+typename _UNCANNY_TREE::Node* _UNCANNY_TREE::get_node(const Key& key) {
+	NodeIndex here = root;
+	int last_result;
+	while (here != 0 and (_UNCANNY_COUNT(nodes_visited), last_result = compare_keys(key, nodes[here].key)) != 0) {
+		if (last_result > 0) here = nodes[here].right;
+		else here = nodes[here].left;
+	}
+	// Key not found. :(
+	if (here == 0) return NULL;
+	return &nodes[here];
+}
+
+_UNCANNY_TREE_TEMPLATE
+NodeIndex _UNCANNY_TREE::leftmost(NodeIndex node) {
+	if (node != 0)
+		while (nodes[node].left != 0)
+			node = nodes[node].left;
+	return node;
+}
+
+_UNCANNY_TREE_TEMPLATE
+NodeIndex _UNCANNY_TREE::rightmost(NodeIndex node) {
+	if (node != 0)
+		while (nodes[node].right != 0)
+			node = nodes[node].right;
+	return node;
+}
+
+// Returns 0 past the last node.
+_UNCANNY_TREE_TEMPLATE
+NodeIndex _UNCANNY_TREE::successor(NodeIndex node) {
+	if (nodes[node].right != 0)
+		return leftmost(nodes[node].right);
+	// Climb until we come up out of a left subtree.
+	NodeIndex parent = nodes[node].parent;
+	while (parent != 0 and nodes[parent].right == node) {
+		node = parent;
+		parent = nodes[node].parent;
+	}
+	return parent;
+}
+
+// Returns 0 before the first node.
+_UNCANNY_TREE_TEMPLATE
+NodeIndex _UNCANNY_TREE::predecessor(NodeIndex node) {
+	if (nodes[node].left != 0)
+		return rightmost(nodes[node].left);
+	NodeIndex parent = nodes[node].parent;
+	while (parent != 0 and nodes[parent].left == node) {
+		node = parent;
+		parent = nodes[node].parent;
+	}
+	return parent;
+}
+
+_UNCANNY_TREE_TEMPLATE
+typename _UNCANNY_TREE::iterator _UNCANNY_TREE::begin() {
+	return iterator(this, leftmost(root));
+}
+
+_UNCANNY_TREE_TEMPLATE
+typename _UNCANNY_TREE::iterator _UNCANNY_TREE::end() {
+	return iterator(this, 0);
+}
+
+// The first node whose key is not less than key.
+_UNCANNY_TREE_TEMPLATE
+typename _UNCANNY_TREE::iterator _UNCANNY_TREE::lower_bound(const Key& key) {
+	NodeIndex here = root, best = 0;
+	while (here != 0) {
+		if (compare_keys(nodes[here].key, key) >= 0) {
+			best = here;
+			here = nodes[here].left;
+		} else
+			here = nodes[here].right;
+	}
+	return iterator(this, best);
+}
+
+// The first node whose key is greater than key.
+_UNCANNY_TREE_TEMPLATE
+typename _UNCANNY_TREE::iterator _UNCANNY_TREE::upper_bound(const Key& key) {
+	NodeIndex here = root, best = 0;
+	while (here != 0) {
+		if (compare_keys(nodes[here].key, key) > 0) {
+			best = here;
+			here = nodes[here].left;
+		} else
+			here = nodes[here].right;
+	}
+	return iterator(this, best);
+}
+
+_UNCANNY_TREE_TEMPLATE
+size_t _UNCANNY_TREE::size() {
+	return nodes[root].size;
+}
+
+// The k-th smallest entry, counting from 0, or end() if there are no more than k.
+_UNCANNY_TREE_TEMPLATE
+typename _UNCANNY_TREE::iterator _UNCANNY_TREE::select(size_t k) {
+	NodeIndex here = root;
+	while (here != 0) {
+		size_t left_size = nodes[nodes[here].left].size;
+		if (k == left_size)
+			break;
+		if (k < left_size)
+			here = nodes[here].left;
+		else {
+			k -= left_size + 1;
+			here = nodes[here].right;
+		}
+	}
+	return iterator(this, here);
+}
+
+// How many keys are less than key.
+_UNCANNY_TREE_TEMPLATE
+size_t _UNCANNY_TREE::rank(const Key& key) {
+	NodeIndex here = root;
+	size_t below = 0;
+	while (here != 0) {
+		if (compare_keys(nodes[here].key, key) < 0) {
+			below += nodes[nodes[here].left].size + 1;
+			here = nodes[here].right;
+		} else
+			here = nodes[here].left;
+	}
+	return below;
+}
+
+// The nearest-rank percentile, for fraction between 0 and 1: the smallest entry
+// with at least that fraction of all entries at or below it. end() if empty.
+_UNCANNY_TREE_TEMPLATE
+typename _UNCANNY_TREE::iterator _UNCANNY_TREE::percentile(double fraction) {
+	size_t n = size();
+	if (n == 0)
+		return end();
+	double position = ceil(fraction * n);
+	if (position < 1)
+		position = 1;
+	if (position > n)
+		position = n;
+	return select((size_t)position - 1);
+}
+
+// Calls callback(key, value) for every entry in the range, in order, until it returns false.
+// Returns how many entries were passed to callback. The walk keeps its own stack rather than
+// following parent links, and prefetches each node's children as soon as the node
+// is reached, so they have usually arrived by the time the walk gets to them.
+_UNCANNY_TREE_TEMPLATE
+template <typename Callback>
+size_t _UNCANNY_TREE::scan(const Key& low_key, bool low_inclusive, const Key& high_key, bool high_inclusive, Callback callback) {
+	// AVL trees of 32-bit indexed nodes are under 64 deep.
+	NodeIndex stack[64];
+	int depth = 0;
+#define PUSH(index) { \
+		stack[depth++] = index; \
+		__builtin_prefetch(&nodes[nodes[index].left]); \
+		__builtin_prefetch(&nodes[nodes[index].right]); \
+	}
+	// Find the first node in range, stacking everything in range we pass on the way.
+	NodeIndex here = root;
+	while (here != 0) {
+		int comparison = compare_keys(nodes[here].key, low_key);
+		if (comparison > 0 or (comparison == 0 and low_inclusive)) {
+			PUSH(here)
+			here = nodes[here].left;
+		} else
+			here = nodes[here].right;
+	}
+	size_t visited = 0;
+	while (depth > 0) {
+		Node* node = &nodes[stack[--depth]];
+		int comparison = compare_keys(node->key, high_key);
+		if (comparison > 0 or (comparison == 0 and not high_inclusive))
+			break;
+		visited++;
+		if (not callback(node->key, node->value))
+			break;
+		for (here = node->right; here != 0; here = nodes[here].left)
+			PUSH(here)
+	}
+#undef PUSH
+	return visited;
+}
+
+_UNCANNY_TREE_TEMPLATE
+Value* _UNCANNY_TREE::get(const Key& key) {
+	Node* here = get_node(key);
+	if (here == NULL) return NULL;
+	return &here->value;
+}
+
+_UNCANNY_TREE_TEMPLATE
+Value _UNCANNY_TREE::get_default(const Key& key, Value otherwise) {
+	Value* ptr = get(key);
+	if (ptr == NULL) return otherwise;
+	return *ptr;
+}
+
+_UNCANNY_TREE_TEMPLATE
+NodeIndex _UNCANNY_TREE::new_node(NodeIndex parent, const Key& key, const Value& value) {
+	NodeIndex index = nodes.alloc();
+	Node* node = &nodes[index];
+	node->parent = parent;
+	node->left = node->right = 0;
+	node->key = key;
+	node->value = value;
+	node->height = 0; // Initially wrong!
+	// Moving past the epoch of whatever used this index before invalidates any results it left behind.
+	node->aug_epoch++;
+	node->aug_dirty = true;
+	return index;
+}
+
+_UNCANNY_TREE_TEMPLATE
+void _UNCANNY_TREE::free_node(NodeIndex index) {
+	// Let go of anything the key and value own, but leave aug_epoch alone for the next user.
+	nodes[index].key = Key();
+	nodes[index].value = Value();
+	nodes.release(index);
+}
+
+_UNCANNY_TREE_TEMPLATE
+bool _UNCANNY_TREE::recompute_height(NodeIndex index) {
+	// The sentinel has height 0, so missing children need no special case.
+	Node* node = &nodes[index];
+	int new_height = nodes[node->left].height;
+	if (nodes[node->right].height > new_height)
+		new_height = nodes[node->right].height;
+	new_height++;
+	bool differs = new_height != node->height;
+	node->height = new_height;
+	return differs;
+}
+
+_UNCANNY_TREE_TEMPLATE
+bool _UNCANNY_TREE::recompute_size(NodeIndex index) {
+	Node* node = &nodes[index];
+	uint32_t new_size = nodes[node->left].size + nodes[node->right].size + 1;
+	bool differs = new_size != node->size;
+	node->size = new_size;
+	return differs;
+}
+
+_UNCANNY_TREE_TEMPLATE
+bool _UNCANNY_TREE::recompute_augmentations(NodeIndex index) {
+	Node* node = &nodes[index];
+	// Refresh the static augmentations, all in one go.
+	if (not Bundle::empty) {
+		node->summary = Bundle::base_case(node->key, node->value);
+		if (node->left != 0)
+			Bundle::combine(nodes[node->left].summary, node->summary, node->summary);
+		if (node->right != 0)
+			Bundle::combine(node->summary, nodes[node->right].summary, node->summary);
+	}
+	// Invalidate our cache, by moving on to a new epoch.
+	if (node->aug_dirty)
+		return false;
+	node->aug_dirty = true;
+	node->aug_epoch++;
+	return true;
+}
+
+_UNCANNY_TREE_TEMPLATE
+bool _UNCANNY_TREE::recompute(NodeIndex index) {
+	recompute_augmentations(index);
+	recompute_size(index);
+	return recompute_height(index);
+}
+
+_UNCANNY_TREE_TEMPLATE
+int _UNCANNY_TREE::balance_factor(NodeIndex index) {
+	Node* node = &nodes[index];
+	return nodes[node->left].height - nodes[node->right].height;
+}
+
+_UNCANNY_TREE_TEMPLATE
+void _UNCANNY_TREE::change_child(NodeIndex parent, NodeIndex from, NodeIndex to) {
+	Node* node = &nodes[parent];
+	if (node->left == from) node->left = to;
+	if (node->right == from) node->right = to;
+}
+
+_UNCANNY_TREE_TEMPLATE
+void _UNCANNY_TREE::rotate_left(NodeIndex index) {
+	_UNCANNY_COUNT(rotations);
+	Node* node = &nodes[index];
+	NodeIndex pivot = node->right;
+	if (node->parent != 0)
+		change_child(node->parent, index, pivot);
+	nodes[pivot].parent = node->parent;
+	node->parent = pivot;
+	node->right = nodes[pivot].left;
+	if (node->right != 0)
+		nodes[node->right].parent = index;
+	nodes[pivot].left = index;
+}
+
+_UNCANNY_TREE_TEMPLATE
+void _UNCANNY_TREE::rotate_right(NodeIndex index) {
+	_UNCANNY_COUNT(rotations);
+	Node* node = &nodes[index];
+	NodeIndex pivot = node->left;
+	if (node->parent != 0)
+		change_child(node->parent, index, pivot);
+	nodes[pivot].parent = node->parent;
+	node->parent = pivot;
+	node->left = nodes[pivot].right;
+	if (node->left != 0)
+		nodes[node->left].parent = index;
+	nodes[pivot].right = index;
+}
+
+_UNCANNY_TREE_TEMPLATE
+void _UNCANNY_TREE::insert(const Key& key, const Value& value) {
+	pause_augmentations();
+	NodeIndex here = root, prev_here = 0, leaf;
+	int last_result = 0;
+	while (here != 0 and (last_result = compare_keys(key, nodes[here].key)) != 0) {
+		prev_here = here;
+		if (last_result > 0) here = nodes[here].right;
+		else here = nodes[here].left;
+	}
+	// Easy case, simply update a value.
+	if (here != 0) {
+		nodes[here].value = value;
+		// Make sure to propagate cache invalidity.
+		invalidate_path(here);
+		return;
+	}
+	// Hard case, have to make a new leaf node under prev_here.
+	here = prev_here;
+	leaf = new_node(here, key, value);
+	recompute(leaf);
+	// Edge case for first insert.
+	if (here == 0) {
+		root = leaf;
+		return;
+	}
+	if (last_result > 0) nodes[here].right = leaf;
+	else nodes[here].left = leaf;
+	rebalance_path(here);
+}
+
+// Replaces the contents of the tree with n pairs, which must be sorted and have distinct keys.
+// This takes O(n), rather than the O(n log n) of n inserts, and gives a perfectly balanced tree.
+// If warm_threads is nonzero, all runtime augmentations are then computed up front.
+_UNCANNY_TREE_TEMPLATE
+void _UNCANNY_TREE::build_from_sorted(const Key* keys, const Value* values, size_t n, int warm_threads) {
+	for (size_t i=1; i<n; i++)
+		assert(compare_keys(keys[i-1], keys[i]) < 0);
+	clear();
+	root = build_subtree(keys, values, 0, n, 0);
+	if (warm_threads > 0)
+		warm_augmentations(warm_threads);
+}
+
+// Builds the pairs in [low, high), with the middle one at the top.
+// Nodes are allocated in pre-order, so each subtree is roughly contiguous in the pool.
+_UNCANNY_TREE_TEMPLATE
+NodeIndex _UNCANNY_TREE::build_subtree(const Key* keys, const Value* values, size_t low, size_t high, NodeIndex parent) {
+	if (low >= high)
+		return 0;
+	size_t mid = low + (high - low) / 2;
+	NodeIndex index = new_node(parent, keys[mid], values[mid]);
+	NodeIndex left = build_subtree(keys, values, low, mid, index);
+	NodeIndex right = build_subtree(keys, values, mid + 1, high, index);
+	nodes[index].left = left;
+	nodes[index].right = right;
+	recompute(index);
+	return index;
+}
+
+// Fills in every node's cache for every runtime augmentation, so the first
+// queries don't pay for it. The top levels of the tree are forked across
+// threads, each of which computes its whole subtree, and then joined.
+_UNCANNY_TREE_TEMPLATE
+void _UNCANNY_TREE::warm_augmentations(int threads) {
+	sync_columns();
+	if (root == 0 or columns.empty())
+		return;
+	// Threads only ever touch the nodes and slots of their own subtree,
+	// but must not race to allocate column chunks.
+	for (unsigned int i=0; i<columns.size(); i++)
+		columns[i]->materialize(nodes.storage.capacity);
+	int fork_depth = 0;
+	while ((1 << fork_depth) < threads)
+		fork_depth++;
+	warm_subtree(root, fork_depth);
+}
+
+_UNCANNY_TREE_TEMPLATE
+void _UNCANNY_TREE::warm_subtree(NodeIndex index, int fork_depth) {
+	if (index == 0)
+		return;
+	if (fork_depth > 0) {
+		std::thread worker(&BasicTree::warm_subtree, this, nodes[index].left, fork_depth - 1);
+		warm_subtree(nodes[index].right, fork_depth - 1);
+		worker.join();
+	}
+	size_t largest = 0;
+	for (typename std::map<int, Augmentation>::iterator iter = aug_ctx.augs.begin(); iter != aug_ctx.augs.end(); iter++)
+		if (iter->second.result_size > largest)
+			largest = iter->second.result_size;
+	void* buffer = largest == 0 ? NULL : alloca(largest);
+	AugmentationResult scratch;
+	for (typename std::map<int, Augmentation>::iterator iter = aug_ctx.augs.begin(); iter != aug_ctx.augs.end(); iter++) {
+		scratch.data.vp = buffer;
+		compute_augmentation(&iter->second, index, &scratch);
+	}
+}
+
+// Registers an augmentation without stalling queries: its cache is filled in
+// by threads in the background, while queries of every other augmentation go on
+// as usual. The returned aug_id is only queryable once poll_augmentations has
+// returned true or finish_augmentations has returned, both of which, like any
+// write, need exclusive access to the tree.
+// Writes may go ahead meanwhile. The first one pauses the build, and what it has
+// built so far is invalidated by writes like any other cache; poll_augmentations
+// resumes it, recomputing only what is missing or out of date.
+_UNCANNY_TREE_TEMPLATE
+int _UNCANNY_TREE::new_augmentation_async(Augmentation* aug, int threads) {
+	assert(threads > 0);
+	PendingAugmentation* job = new PendingAugmentation();
+	job->aug = *aug;
+	job->aug.aug_id = aug_ctx.next_aug_id++;
+	assert(aug->result_size <= MAX_RESULT_SIZE);
+	job->column = new AugmentationColumn(aug->result_size);
+	job->threads = threads;
+	job->done = false;
+	job->paused = true;
+	pending.push_back(job);
+	poll_augmentations();
+	return job->aug.aug_id;
+}
+
+// Splits the tree into many more subtrees than threads, deals them out, and lets
+// idle workers steal from busy ones, so lopsided subtrees don't hold everyone up.
+// The few nodes above the subtrees are then computed once every worker is done.
+// The subtrees are also kept small enough that a pause never waits long.
+_UNCANNY_TREE_TEMPLATE
+void _UNCANNY_TREE::build_pending(PendingAugmentation* job, int threads) {
+	if (root != 0) {
+		const uint32_t largest_subtree = 1 << 16;
+		std::vector<NodeIndex> frontier(1, root);
+		while (frontier.size() < (size_t)threads * 16 or nodes[root].size / frontier.size() > largest_subtree) {
+			std::vector<NodeIndex> next;
+			for (unsigned int i=0; i<frontier.size(); i++) {
+				if (nodes[frontier[i]].left != 0)
+					next.push_back(nodes[frontier[i]].left);
+				if (nodes[frontier[i]].right != 0)
+					next.push_back(nodes[frontier[i]].right);
+			}
+			if (next.empty())
+				break;
+			frontier.swap(next);
+		}
+		std::vector<BuildQueue> queues(threads);
+		for (unsigned int i=0; i<frontier.size(); i++)
+			queues[i % threads].subtrees.push_back(frontier[i]);
+		std::vector<std::thread> workers;
+		for (int w=1; w<threads; w++)
+			workers.push_back(std::thread(&BasicTree::build_worker, this, job, &queues, w));
+		build_worker(job, &queues, 0);
+		for (unsigned int w=0; w<workers.size(); w++)
+			workers[w].join();
+		if (job->paused.load(std::memory_order_relaxed))
+			return;
+		AugmentationResult scratch;
+		_UNCANNY_RESULT_BUFFER(job->aug.result_size, scratch);
+		build_column(&job->aug, job->column, root, &scratch);
+	}
+	job->done.store(true, std::memory_order_release);
+}
+
+_UNCANNY_TREE_TEMPLATE
+void _UNCANNY_TREE::build_worker(PendingAugmentation* job, std::vector<BuildQueue>* queues, int worker) {
+	AugmentationResult scratch;
+	_UNCANNY_RESULT_BUFFER(job->aug.result_size, scratch);
+	while (not job->paused.load(std::memory_order_relaxed)) {
+		NodeIndex subtree = 0;
+		// Take from the back of our own queue, or else the front of someone else's.
+		for (unsigned int i=0; i<queues->size() and subtree == 0; i++) {
+			BuildQueue& queue = (*queues)[(worker + i) % queues->size()];
+			std::lock_guard<std::mutex> guard(queue.lock);
+			if (queue.subtrees.empty())
+				continue;
+			if (i == 0) {
+				subtree = queue.subtrees.back();
+				queue.subtrees.pop_back();
+			} else {
+				subtree = queue.subtrees.front();
+				queue.subtrees.pop_front();
+			}
+		}
+		// Nothing is ever added, so once every queue is empty we're done.
+		if (subtree == 0)
+			return;
+		build_column(&job->aug, job->column, subtree, &scratch);
+	}
+}
+
+// Registers every background augmentation that has finished, and resumes any
+// that writes paused. Returns true if none are left pending.
+_UNCANNY_TREE_TEMPLATE
+bool _UNCANNY_TREE::poll_augmentations() {
+	for (unsigned int i=0; i<pending.size(); i++) {
+		PendingAugmentation* job = pending[i];
+		if (job->paused.load(std::memory_order_relaxed)) {
+			// Workers fill in disjoint slots, so must not race to allocate chunks.
+			job->column->materialize(nodes.storage.capacity);
+			job->paused.store(false, std::memory_order_relaxed);
+			job->builder = std::thread(&BasicTree::build_pending, this, job, job->threads);
+			continue;
+		}
+		if (not job->done.load(std::memory_order_acquire))
+			continue;
+		if (job->builder.joinable())
+			job->builder.join();
+		aug_ctx.augs[job->aug.aug_id] = job->aug;
+		aug_ctx.recompute_schema();
+		sync_columns();
+		// Swap the finished column in for the empty one sync_columns just made.
+		int schema_index = aug_ctx.augs[job->aug.aug_id].schema_index;
+		delete columns[schema_index];
+		columns[schema_index] = job->column;
+		delete job;
+		pending.erase(pending.begin() + i);
+		i--;
+	}
+	return pending.empty();
+}
+
+_UNCANNY_TREE_TEMPLATE
+void _UNCANNY_TREE::finish_augmentations() {
+	poll_augmentations();
+	for (unsigned int i=0; i<pending.size(); i++)
+		pending[i]->builder.join();
+	poll_augmentations();
+}
+
+// Stops every background build before a write. Each builder finishes the
+// subtree it is on, and no more.
+_UNCANNY_TREE_TEMPLATE
+void _UNCANNY_TREE::pause_augmentations() {
+	for (unsigned int i=0; i<pending.size(); i++) {
+		PendingAugmentation* job = pending[i];
+		if (job->paused.load(std::memory_order_relaxed))
+			continue;
+		job->paused.store(true, std::memory_order_relaxed);
+		job->builder.join();
+		// It may have finished meanwhile, in which case it needn't resume.
+		if (job->done.load(std::memory_order_acquire))
+			job->paused.store(false, std::memory_order_relaxed);
+	}
+}
+
+_UNCANNY_TREE_TEMPLATE
+bool _UNCANNY_TREE::rebalance_node(NodeIndex node) {
+	// Returns if the height of the subtree rooted where node was has changed.
+	int old_height = nodes[node].height;
+	recompute(node);
+	int bf = balance_factor(node);
+	assert(bf >= -2 and bf <= 2);
+	if (bf == 2) {
+		NodeIndex left = nodes[node].left;
+		if (balance_factor(left) == -1) {
+			rotate_left(left);
+			recompute(left);
+		}
+		rotate_right(node);
+		recompute(node);
+	} else if (bf == -2) {
+		NodeIndex right = nodes[node].right;
+		if (balance_factor(right) == 1) {
+			rotate_right(right);
+			recompute(right);
+		}
+		rotate_left(node);
+		recompute(node);
+	} else
+		return nodes[node].height != old_height;
+	NodeIndex top = nodes[node].parent;
+	recompute(top);
+	// Check if we re-rooted.
+	if (node == root) root = top;
+	return nodes[top].height != old_height;
+}
+
+_UNCANNY_TREE_TEMPLATE
+void _UNCANNY_TREE::rebalance_path(NodeIndex node) {
+	// Rebalance the tree, until some subtree comes out with its height unchanged.
+	while (node != 0) {
+		// Rotations never change which node is above this subtree.
+		NodeIndex parent = nodes[node].parent;
+		bool differs = rebalance_node(node);
+		node = parent;
+		if (not differs)
+			break;
+	}
+	// Heights above here are fine, but augmentations still cover the old subtree.
+	invalidate_path(node);
+}
+
+_UNCANNY_TREE_TEMPLATE
+void _UNCANNY_TREE::invalidate_path(NodeIndex node) {
+	while (node != 0) {
+		// A node whose cache is already dirty has no clean ancestors, as computing
+		// any ancestor would have cleaned it. So we may early-out, unless we have
+		// static augmentations, which must be refreshed all the way up, or sizes
+		// are still changing, as they do all the way up after inserts and removals.
+		bool resized = recompute_size(node);
+		bool invalidated = recompute_augmentations(node);
+		if (not invalidated and not resized and Bundle::empty)
+			break;
+		node = nodes[node].parent;
+	}
+}
+
+_UNCANNY_TREE_TEMPLATE
+void _UNCANNY_TREE::remove(const Key& key) {
+	pause_augmentations();
+	NodeIndex here = root;
+	int last_result;
+	while (here != 0 and (last_result = compare_keys(key, nodes[here].key)) != 0) {
+		if (last_result > 0) here = nodes[here].right;
+		else here = nodes[here].left;
+	}
+	// If there does not exist such an item, we're done!
+	if (here == 0) return;
+	// Deallocate memory, if required.
+	if (key_deallocator != NULL)
+		key_deallocator(nodes[here].key);
+	if (value_deallocator != NULL)
+		value_deallocator(nodes[here].value);
+	if (nodes[here].left != 0 and nodes[here].right != 0) {
+		// Move the predecessor into here's place, rather than copying its entry
+		// over here's, so that iterators to it stay valid.
+		NodeIndex pred = rightmost(nodes[here].left);
+		NodeIndex fix = nodes[pred].parent;
+		if (fix == here)
+			fix = pred;
+		else {
+			change_child(fix, pred, nodes[pred].left);
+			if (nodes[pred].left != 0)
+				nodes[nodes[pred].left].parent = fix;
+			nodes[pred].left = nodes[here].left;
+			nodes[nodes[pred].left].parent = pred;
+		}
+		nodes[pred].right = nodes[here].right;
+		nodes[nodes[pred].right].parent = pred;
+		nodes[pred].parent = nodes[here].parent;
+		if (here == root)
+			root = pred;
+		else
+			change_child(nodes[here].parent, here, pred);
+		// The walk up from fix passes pred, refreshing its size and augmentations.
+		nodes[pred].height = nodes[here].height;
+		rebalance_path(fix);
+		free_node(here);
+		return;
+	}
+	NodeIndex child = nodes[here].left;
+	if (child == 0) child = nodes[here].right;
+	// Reroot if necessary.
+	if (here == root) {
+		root = child;
+		if (child != 0)
+			nodes[child].parent = 0;
+	} else {
+		// Otherwise, fix up the trees.
+		NodeIndex fix = nodes[here].parent;
+		change_child(fix, here, child);
+		if (child != 0)
+			nodes[child].parent = fix;
+		// Recompute the heights, rotating wherever the removal unbalanced us.
+		rebalance_path(fix);
+	}
+	free_node(here);
+}
+
+// Makes left and right the children of node, and node a detached root.
+_UNCANNY_TREE_TEMPLATE
+NodeIndex _UNCANNY_TREE::link(NodeIndex node, NodeIndex left, NodeIndex right) {
+	nodes[node].left = left;
+	nodes[node].right = right;
+	nodes[node].parent = 0;
+	if (left != 0)
+		nodes[left].parent = node;
+	if (right != 0)
+		nodes[right].parent = node;
+	recompute(node);
+	return node;
+}
+
+_UNCANNY_TREE_TEMPLATE
+NodeIndex _UNCANNY_TREE::detached_rotate_left(NodeIndex node) {
+	_UNCANNY_COUNT(rotations);
+	NodeIndex pivot = nodes[node].right;
+	link(node, nodes[node].left, nodes[pivot].left);
+	return link(pivot, node, nodes[pivot].right);
+}
+
+_UNCANNY_TREE_TEMPLATE
+NodeIndex _UNCANNY_TREE::detached_rotate_right(NodeIndex node) {
+	_UNCANNY_COUNT(rotations);
+	NodeIndex pivot = nodes[node].left;
+	link(node, nodes[pivot].right, nodes[node].right);
+	return link(pivot, nodes[pivot].left, node);
+}
+
+// Returns a balanced tree of everything in left, then middle, then right.
+// All keys in left must be less than middle's, which must be less than all in right.
+// This takes time proportional to the difference in heights of left and right.
+_UNCANNY_TREE_TEMPLATE
+NodeIndex _UNCANNY_TREE::join(NodeIndex left, NodeIndex middle, NodeIndex right) {
+	int left_height = nodes[left].height, right_height = nodes[right].height;
+	if (left_height > right_height + 1)
+		return join_right(left, middle, right);
+	if (right_height > left_height + 1)
+		return join_left(left, middle, right);
+	return link(middle, left, right);
+}
+
+// Left is the taller, so walk down its right spine until right fits next to it.
+_UNCANNY_TREE_TEMPLATE
+NodeIndex _UNCANNY_TREE::join_right(NodeIndex left, NodeIndex middle, NodeIndex right) {
+	NodeIndex outer = nodes[left].left, inner = nodes[left].right;
+	if (nodes[inner].height <= nodes[right].height + 1) {
+		NodeIndex joined = link(middle, inner, right);
+		if (nodes[joined].height <= nodes[outer].height + 1)
+			return link(left, outer, joined);
+		return detached_rotate_left(link(left, outer, detached_rotate_right(joined)));
+	}
+	NodeIndex joined = join_right(inner, middle, right);
+	link(left, outer, joined);
+	if (nodes[joined].height <= nodes[outer].height + 1)
+		return left;
+	return detached_rotate_left(left);
+}
+
+_UNCANNY_TREE_TEMPLATE
+NodeIndex _UNCANNY_TREE::join_left(NodeIndex left, NodeIndex middle, NodeIndex right) {
+	NodeIndex outer = nodes[right].right, inner = nodes[right].left;
+	if (nodes[inner].height <= nodes[left].height + 1) {
+		NodeIndex joined = link(middle, left, inner);
+		if (nodes[joined].height <= nodes[outer].height + 1)
+			return link(right, joined, outer);
+		return detached_rotate_right(link(right, detached_rotate_left(joined), outer));
+	}
+	NodeIndex joined = join_left(left, middle, inner);
+	link(right, joined, outer);
+	if (nodes[joined].height <= nodes[outer].height + 1)
+		return right;
+	return detached_rotate_right(right);
+}
+
+// Like join, but without a middle node.
+_UNCANNY_TREE_TEMPLATE
+NodeIndex _UNCANNY_TREE::join_pair(NodeIndex left, NodeIndex right) {
+	if (left == 0) return right;
+	if (right == 0) return left;
+	NodeIndex last;
+	left = split_last(left, &last);
+	return join(left, last, right);
+}
+
+// Detaches the greatest node of the subtree into last, returning the rest.
+_UNCANNY_TREE_TEMPLATE
+NodeIndex _UNCANNY_TREE::split_last(NodeIndex node, NodeIndex* last) {
+	if (nodes[node].right == 0) {
+		*last = node;
+		return nodes[node].left;
+	}
+	NodeIndex rest = split_last(nodes[node].right, last);
+	return join(nodes[node].left, node, rest);
+}
+
+// Splits a detached subtree into the keys less than key, returned, and the rest, written into right.
+// Only nodes on the path to key are relinked; everything hanging off it keeps its cache.
+_UNCANNY_TREE_TEMPLATE
+NodeIndex _UNCANNY_TREE::split_subtree(NodeIndex node, const Key& key, NodeIndex* right) {
+	if (node == 0) {
+		*right = 0;
+		return 0;
+	}
+	NodeIndex left_child = nodes[node].left, right_child = nodes[node].right;
+	if (compare_keys(nodes[node].key, key) < 0) {
+		NodeIndex low = split_subtree(right_child, key, right);
+		return join(left_child, node, low);
+	}
+	NodeIndex high;
+	NodeIndex low = split_subtree(left_child, key, &high);
+	*right = join(high, node, right_child);
+	return low;
+}
+
+// Trades every node, and the caches that go with them, with other.
+// The columns are remapped by aug_id on the next sync_columns, as the two trees' schemas may differ,
+// and those for augmentations the trees don't share are emptied.
+_UNCANNY_TREE_TEMPLATE
+void _UNCANNY_TREE::swap_storage(BasicTree& other) {
+	nodes.swap(other.nodes);
+	columns.swap(other.columns);
+	column_aug_ids.swap(other.column_aug_ids);
+	std::swap(root, other.root);
+	columns_version = other.columns_version = -1;
+	forget_foreign_columns(other);
+	other.forget_foreign_columns(*this);
+}
+
+// After taking columns from previous_owner, empties any whose aug_id
+// doesn't mean the same augmentation here as it did there.
+_UNCANNY_TREE_TEMPLATE
+void _UNCANNY_TREE::forget_foreign_columns(BasicTree& previous_owner) {
+	for (unsigned int i=0; i<columns.size(); i++)
+		if (not same_augmentation(previous_owner, column_aug_ids[i]))
+			columns[i]->clear();
+}
+
+_UNCANNY_TREE_TEMPLATE
+bool _UNCANNY_TREE::same_augmentation(BasicTree& other, int aug_id) {
+	typename std::map<int, Augmentation>::iterator ours = aug_ctx.augs.find(aug_id);
+	typename std::map<int, Augmentation>::iterator theirs = other.aug_ctx.augs.find(aug_id);
+	if (ours == aug_ctx.augs.end() or theirs == other.aug_ctx.augs.end())
+		return false;
+	return ours->second.builtin == theirs->second.builtin and ours->second.base_case == theirs->second.base_case
+		and ours->second.compute == theirs->second.compute;
+}
+
+// Moves the subtree at node out of other's pool and into ours, returning it detached.
+// Any cached results for augmentations both trees have (the same aug_id, with the same
+// functions) come along too.
+// source_columns maps each of our columns to the matching one of other's, or -1.
+_UNCANNY_TREE_TEMPLATE
+NodeIndex _UNCANNY_TREE::transplant(BasicTree& other, NodeIndex node, const std::vector<int>& source_columns) {
+	if (node == 0)
+		return 0;
+	Node* source = &other.nodes[node];
+	NodeIndex left = transplant(other, source->left, source_columns);
+	NodeIndex right = transplant(other, source->right, source_columns);
+	NodeIndex index = new_node(0, source->key, source->value);
+	Node* copy = &nodes[index];
+	copy->left = left;
+	copy->right = right;
+	if (left != 0)
+		nodes[left].parent = index;
+	if (right != 0)
+		nodes[right].parent = index;
+	copy->height = source->height;
+	copy->size = source->size;
+	copy->summary = source->summary;
+	// A dirty node has nothing valid to carry over, and a clean one keeps its ancestors' invariant.
+	copy->aug_dirty = source->aug_dirty;
+	for (unsigned int i=0; i<columns.size(); i++) {
+		if (source_columns[i] < 0)
+			continue;
+		AugmentationSlot* slot = &(*other.columns[source_columns[i]])[node];
+		if (slot->epoch != source->aug_epoch)
+			continue;
+		store_slot(columns[i], index, &(*columns[i])[index], &slot->result);
+		(*columns[i])[index].epoch = copy->aug_epoch;
+	}
+	other.free_node(node);
+	return index;
+}
+
+_UNCANNY_TREE_TEMPLATE
+NodeIndex _UNCANNY_TREE::transplant(BasicTree& other, NodeIndex node) {
+	sync_columns();
+	other.sync_columns();
+	std::vector<int> source_columns(columns.size(), -1);
+	for (unsigned int i=0; i<columns.size(); i++)
+		for (unsigned int j=0; j<other.columns.size(); j++)
+			if (other.column_aug_ids[j] == column_aug_ids[i] and same_augmentation(other, column_aug_ids[i]))
+				source_columns[i] = j;
+	return transplant(other, node, source_columns);
+}
+
+// Moves every entry with a key not less than key into right, which must be empty,
+// and is given this tree's comparison, deallocators and augmentations.
+// Splitting the nodes takes O(log n), relinking only the path to key. Nodes live
+// in their tree's own pool, so the smaller side is then moved over, along with its
+// caches, while the larger side keeps its pool, so the cost is O(log n + smaller side).
+_UNCANNY_TREE_TEMPLATE
+void _UNCANNY_TREE::split(const Key& key, BasicTree& right) {
+	assert(right.root == 0);
+	// Background builds are finished first, so their caches move with the nodes.
+	finish_augmentations();
+	right.finish_augmentations();
+	right.clear();
+	// right may have cached results under a schema of its own, which could even
+	// share our schema_version, so drop its columns rather than remap them.
+	for (unsigned int i=0; i<right.columns.size(); i++)
+		delete right.columns[i];
+	right.columns.clear();
+	right.column_aug_ids.clear();
+	right.columns_version = -1;
+	right.aug_ctx = aug_ctx;
+	right.cmp_f = cmp_f;
+	right.key_deallocator = key_deallocator;
+	right.value_deallocator = value_deallocator;
+	NodeIndex high;
+	NodeIndex low = split_subtree(root, key, &high);
+	nodes[low].parent = nodes[high].parent = 0;
+	if (nodes[low].size < nodes[high].size) {
+		// Keep the pool with the high side, and bring the low side back.
+		root = low;
+		swap_storage(right);
+		right.root = high;
+		root = transplant(right, low);
+	} else {
+		root = low;
+		right.root = right.transplant(*this, high);
+	}
+	nodes[root].parent = 0;
+	right.nodes[right.root].parent = 0;
+}
+
+// Moves every entry of other into this tree, leaving other empty. The two trees'
+// keys must not interleave: all of other's must come before all of ours, or after.
+// The smaller tree's nodes are moved into the larger one's pool, with any cached
+// results for augmentations both have (by aug_id), then the two are joined in O(log n).
+_UNCANNY_TREE_TEMPLATE
+void _UNCANNY_TREE::join(BasicTree& other) {
+	finish_augmentations();
+	other.finish_augmentations();
+	if (other.root == 0)
+		return;
+	if (size() < other.size())
+		swap_storage(other);
+	if (other.root == 0)
+		return;
+	bool other_first = compare_keys(nodes[leftmost(root)].key, other.nodes[other.leftmost(other.root)].key) > 0;
+	// Check that the keys really don't interleave.
+	assert(other_first ?
+		compare_keys(other.nodes[other.rightmost(other.root)].key, nodes[leftmost(root)].key) < 0 :
+		compare_keys(nodes[rightmost(root)].key, other.nodes[other.leftmost(other.root)].key) < 0);
+	NodeIndex moved = transplant(other, other.root);
+	other.root = 0;
+	other.clear();
+	root = other_first ? join_pair(moved, root) : join_pair(root, moved);
+	nodes[root].parent = 0;
+}
+
+// Applies a batch of upserts and removals, which must be sorted by key with no key repeated.
+// The batch is split around each node it passes, so each descent is shared by every
+// op below it, and subtrees are then put back together with join. Every node on the
+// affected paths is relinked, rebalanced, and invalidated exactly once, while
+// subtrees no op reaches are left alone with their caches intact.
+_UNCANNY_TREE_TEMPLATE
+void _UNCANNY_TREE::apply_batch(const BatchOp* ops, size_t n) {
+	for (size_t i=1; i<n; i++)
+		assert(compare_keys(ops[i-1].key, ops[i].key) < 0);
+	pause_augmentations();
+	root = apply_batch_subtree(root, ops, 0, n);
+	if (root != 0)
+		nodes[root].parent = 0;
+}
+
+_UNCANNY_TREE_TEMPLATE
+NodeIndex _UNCANNY_TREE::apply_batch_subtree(NodeIndex node, const BatchOp* ops, size_t low, size_t high) {
+	if (low == high)
+		return node;
+	if (node == 0) {
+		// Everything left here lands in an empty spot, so build it up from the middle.
+		size_t mid = low + (high - low) / 2;
+		NodeIndex left = apply_batch_subtree(0, ops, low, mid);
+		NodeIndex right = apply_batch_subtree(0, ops, mid + 1, high);
+		if (ops[mid].remove)
+			return join_pair(left, right);
+		NodeIndex middle = new_node(0, ops[mid].key, ops[mid].value);
+		return join(left, middle, right);
+	}
+	// Find the first op not less than this node's key.
+	size_t split = low, end = high;
+	while (split < end) {
+		size_t probe = split + (end - split) / 2;
+		if (compare_keys(ops[probe].key, nodes[node].key) < 0)
+			split = probe + 1;
+		else
+			end = probe;
+	}
+	bool hit = split < high and compare_keys(ops[split].key, nodes[node].key) == 0;
+	NodeIndex left = apply_batch_subtree(nodes[node].left, ops, low, split);
+	NodeIndex right = apply_batch_subtree(nodes[node].right, ops, split + hit, high);
+	if (hit and ops[split].remove) {
+		// Deallocate memory, if required.
+		if (key_deallocator != NULL)
+			key_deallocator(nodes[node].key);
+		if (value_deallocator != NULL)
+			value_deallocator(nodes[node].value);
+		free_node(node);
+		return join_pair(left, right);
+	}
+	if (hit)
+		nodes[node].value = ops[split].value;
+	return join(left, node, right);
+}
+
+// Brings the columns in line with the current schema, keeping the caches
+// of augmentations that survived, and dropping those of deleted ones.
+_UNCANNY_TREE_TEMPLATE
+void _UNCANNY_TREE::sync_columns() {
+	if (__atomic_load_n(&columns_version, __ATOMIC_ACQUIRE) == aug_ctx.schema_version)
+		return;
+	// The first queries after a schema change may arrive together.
+	std::lock_guard<std::mutex> guard(columns_lock);
+	if (columns_version == aug_ctx.schema_version)
+		return;
+	std::vector<AugmentationColumn*> new_columns(aug_ctx.augs.size(), (AugmentationColumn*)NULL);
+	std::vector<int> new_aug_ids(aug_ctx.augs.size(), -1);
+	for (unsigned int i=0; i<columns.size(); i++) {
+		typename std::map<int, Augmentation>::iterator iter = aug_ctx.augs.find(column_aug_ids[i]);
+		if (iter == aug_ctx.augs.end())
+			delete columns[i];
+		else {
+			new_columns[iter->second.schema_index] = columns[i];
+			new_aug_ids[iter->second.schema_index] = column_aug_ids[i];
+		}
+	}
+	for (typename std::map<int, Augmentation>::iterator iter = aug_ctx.augs.begin(); iter != aug_ctx.augs.end(); iter++) {
+		if (new_columns[iter->second.schema_index] != NULL)
+			continue;
+		assert(iter->second.result_size <= MAX_RESULT_SIZE);
+		new_columns[iter->second.schema_index] = new AugmentationColumn(iter->second.result_size);
+		new_aug_ids[iter->second.schema_index] = iter->first;
+	}
+	columns.swap(new_columns);
+	column_aug_ids.swap(new_aug_ids);
+	_UNCANNY_COUNT(schema_migrations);
+	__atomic_store_n(&columns_version, aug_ctx.schema_version, __ATOMIC_RELEASE);
+}
+
+#define AUG_COMPUTE_BOTH_SUBTREES(left_comp, right_comp) \
+	size_t elements = 1, new_elements; \
+	AugmentationResult temp; \
+	AugmentationResult double_buf[2]; \
+	_UNCANNY_RESULT_BUFFER(aug->result_size, temp); \
+	_UNCANNY_RESULT_BUFFER(aug->result_size, double_buf[0]); \
+	_UNCANNY_RESULT_BUFFER(aug->result_size, double_buf[1]); \
+	int i = 0; \
+	_UNCANNY_COUNT(base_cases), aug->run_base_case(node->key, node->value, &double_buf[i]); \
+	if (node->left != 0) { \
+		elements += new_elements = left_comp; \
+		if (new_elements != 0) { \
+			_UNCANNY_COUNT(computes), aug->run_compute(&temp, &double_buf[i], &double_buf[1-i]); \
+			i = 1-i; /* Flip the buffer. */ \
+		} \
+	} \
+	if (node->right != 0) { \
+		elements += new_elements = right_comp; \
+		if (new_elements != 0) { \
+			_UNCANNY_COUNT(computes), aug->run_compute(&double_buf[i], &temp, &double_buf[1-i]); \
+			i = 1-i; \
+		} \
+	}
+
+#define EDGE_CASE(comp, better, better_is_right, call) \
+	if (comp == 0) { \
+		/* We're JUST ont he border of the tree-cut, better child only. */ \
+		if (better == 0) { \
+			/* We have no better child, so it's just us. */ \
+			_UNCANNY_COUNT(base_cases), aug->run_base_case(node->key, node->value, output); \
+			return 1; \
+		} \
+		AugmentationResult temp; \
+		_UNCANNY_RESULT_BUFFER(aug->result_size, temp); \
+		_UNCANNY_COUNT(base_cases), aug->run_base_case(node->key, node->value, &temp); \
+		AugmentationResult better_result; \
+		_UNCANNY_RESULT_BUFFER(aug->result_size, better_result); \
+		size_t elements = call; \
+		/* Early out for correctness! */ \
+		if (elements == 0) { \
+			copy_result(aug->result_size, output, &temp); \
+			return 1; \
+		} \
+		/* Keep the node and its better child in key order. */ \
+		if (better_is_right) \
+			_UNCANNY_COUNT(computes), aug->run_compute(&temp, &better_result, output); \
+		else \
+			_UNCANNY_COUNT(computes), aug->run_compute(&better_result, &temp, output); \
+		return elements + 1; \
+	}
+
+_UNCANNY_TREE_TEMPLATE
+size_t _UNCANNY_TREE::compute_augmentation(Augmentation* aug, NodeIndex index, AugmentationResult* output) {
+	Node* node = &nodes[index];
+	_UNCANNY_COUNT(nodes_visited);
+#ifdef UNCANNY_STATS
+	if (not columns[aug->schema_index]->present(index))
+		_UNCANNY_COUNT(column_allocations);
+#endif
+	AugmentationSlot* cached = &(*columns[aug->schema_index])[index];
+	uint32_t seen = __atomic_load_n(&cached->epoch, __ATOMIC_ACQUIRE);
+	if (seen == node->aug_epoch) {
+		_UNCANNY_COUNT(cache_hits);
+		copy_result(aug->result_size, output, &cached->result);
+		return cached->result.data_length;
+	}
+	_UNCANNY_COUNT(cache_misses);
+	// Crap, it's a dirty value. Better update it.
+	AUG_COMPUTE_BOTH_SUBTREES(compute_augmentation(aug, node->left, &temp), \
+		compute_augmentation(aug, node->right, &temp))
+	copy_result(aug->result_size, output, &double_buf[i]);
+	output->clean = true;
+	output->aug_id = aug->aug_id;
+	// Claim the slot and publish. If another reader claimed it first, ours just goes uncached.
+	if (seen != SLOT_BUSY and __atomic_compare_exchange_n(&cached->epoch, &seen, SLOT_BUSY, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		store_slot(columns[aug->schema_index], index, cached, output);
+		__atomic_store_n(&cached->epoch, node->aug_epoch, __ATOMIC_RELEASE);
+	}
+	if (__atomic_load_n(&node->aug_dirty, __ATOMIC_RELAXED))
+		__atomic_store_n(&node->aug_dirty, false, __ATOMIC_RELAXED);
+	return output->data_length;
+}
+
+// Like compute_augmentation, but into a column that isn't registered yet,
+// reusing whatever results it already holds.
+_UNCANNY_TREE_TEMPLATE
+size_t _UNCANNY_TREE::build_column(const Augmentation* aug, AugmentationColumn* column, NodeIndex index, AugmentationResult* output) {
+	Node* node = &nodes[index];
+	AugmentationSlot* cached = &(*column)[index];
+	if (cached->epoch != node->aug_epoch) {
+		AUG_COMPUTE_BOTH_SUBTREES(build_column(aug, column, node->left, &temp), \
+			build_column(aug, column, node->right, &temp))
+		store_slot(column, index, cached, &double_buf[i]);
+		cached->result.clean = true;
+		cached->result.aug_id = aug->aug_id;
+		cached->epoch = node->aug_epoch;
+		// A clean slot's node must not be marked dirty, or invalidate_path would stop short of it.
+		// Concurrent readers may be clearing the same flag.
+		if (__atomic_load_n(&node->aug_dirty, __ATOMIC_RELAXED))
+			__atomic_store_n(&node->aug_dirty, false, __ATOMIC_RELAXED);
+	}
+	copy_result(aug->result_size, output, &cached->result);
+	return cached->result.data_length;
+}
+
+_UNCANNY_TREE_TEMPLATE
+size_t _UNCANNY_TREE::compute_augmentation_cut(Augmentation* aug, NodeIndex index, const Key& key, int comparison_type, bool good_to_go, AugmentationResult* output) {
+	Node* node = &nodes[index];
+	_UNCANNY_COUNT(nodes_visited);
+	// Firstly, figure out of we care about this node's value at all.
+	int comparison = compare_keys(node->key, key);
+	// Now we do a little re-mapping.
+	// Valid comparison_types are:
+	//   -2 less than
+	//   -1 less than or equal
+	//    1 greater than or equal
+	//    2 greater than.
+	// First thing first, we multiply by comparison_type, to make
+	// sure that less than searches have the opposite sense.
+	comparison *= comparison_type;
+	// Next, we remap equals if this is a strong comparison.
+	// Define macros that move us further and closer to the cut.
+#define GET_BETTER(node) (comparison_type < 0 ? node->left : node->right)
+#define GET_WORSE(node) (comparison_type < 0 ? node->right : node->left)
+	if (comparison < 0 or (comparison == 0 and (comparison_type == -2 or comparison_type == 2))) {
+		// We're on the wrong side of the tree-cut, go left.
+		if (GET_BETTER(node) == 0)
+			return 0; // No good value at all!
+		return compute_augmentation_cut(aug, GET_BETTER(node), key, comparison_type, comparison == 0, output);
+	} else
+		EDGE_CASE(comparison, GET_BETTER(node), comparison_type > 0, compute_augmentation_cut(aug, GET_BETTER(node), key, comparison_type, true, &better_result))
+	else if (good_to_go) {
+		// We're on entirely good side of the tree-cut, we can use a cached value!
+		return compute_augmentation(aug, index, output);
+	}
+	// Finally, we're on the good side of the tree-cut, but our right subtree might not be.
+	// Four cases: No children, just left, just right, both -- this handles all of them.
+	AUG_COMPUTE_BOTH_SUBTREES(compute_augmentation_cut(aug, node->left, key, comparison_type, (comparison_type < 0), &temp), \
+		compute_augmentation_cut(aug, node->right, key, comparison_type, (comparison_type > 0), &temp))
+	copy_result(aug->result_size, output, &double_buf[i]);
+	return elements;
+#undef GET_BETTER
+#undef GET_WORSE
+}
+
+_UNCANNY_TREE_TEMPLATE
+size_t _UNCANNY_TREE::compute_augmentation_range(Augmentation* aug, NodeIndex index, const Key& low_key, bool low_inclusive, const Key& high_key, bool high_inclusive, bool good_low, bool good_high, AugmentationResult* output) {
+	Node* node = &nodes[index];
+	_UNCANNY_COUNT(nodes_visited);
+	int low_comp = compare_keys(node->key, low_key);
+	if (low_comp < 0 or (low_comp == 0 and not low_inclusive)) {
+		// We're too low.
+		if (node->right == 0)
+			return 0;
+		return compute_augmentation_range(aug, node->right, low_key, low_inclusive, high_key, high_inclusive, low_comp == 0, good_high, output);
+	}
+	int high_comp = compare_keys(node->key, high_key);
+	if (high_comp > 0 or (high_comp == 0 and not high_inclusive)) {
+		// We're too high.
+		if (node->left == 0)
+			return 0;
+		return compute_augmentation_range(aug, node->left, low_key, low_inclusive, high_key, high_inclusive, good_low, high_comp == 0, output);
+	}
+	// Catch the two edge cases, where the key is one of our inclusive bounds.
+	EDGE_CASE(low_comp, node->right, true, \
+		compute_augmentation_range(aug, node->right, low_key, low_inclusive, high_key, high_inclusive, true, good_high, &better_result))
+	EDGE_CASE(high_comp, node->left, false, \
+		compute_augmentation_range(aug, node->left, low_key, low_inclusive, high_key, high_inclusive, good_low, true, &better_result))
+	// Once the code reaches here we know that node is between the two keys.
+	if (good_low and good_high) {
+		// We're good on both sides, do the super-efficient thing.
+		return compute_augmentation(aug, index, output);
+	}
+	AUG_COMPUTE_BOTH_SUBTREES( \
+		compute_augmentation_range(aug, node->left, low_key, low_inclusive, high_key, high_inclusive, good_low, true, &temp), \
+		compute_augmentation_range(aug, node->right, low_key, low_inclusive, high_key, high_inclusive, true, good_high, &temp))
+	copy_result(aug->result_size, output, &double_buf[i]);
+	return elements;
+}
+
+#undef AUG_COMPUTE_BOTH_SUBTREES
+#undef EDGE_CASE
+
+_UNCANNY_TREE_TEMPLATE
+size_t _UNCANNY_TREE::augment_range(int aug_id, const Key& low_key, bool low_inclusive, const Key& high_key, bool high_inclusive, AugmentationResult* output) {
+	assert(aug_ctx.augs.count(aug_id) == 1);
+	Augmentation* aug = &aug_ctx.augs.find(aug_id)->second;
+	sync_columns();
+	// Do some quick edge-case checking.
+	int comparison = compare_keys(low_key, high_key);
+	// The following case is ambiguous, so our library simply won't handle it.
+	// Should low_inclusive or high_inclusive win, when examining the interval [x, x)?
+	assert(comparison != 0 or low_inclusive == high_inclusive);
+	// We can immediately answer queries where low > high, or low == high and neither end is inclusive.
+	if (comparison > 0 or (comparison == 0 and (not low_inclusive) and not high_inclusive))
+		return 0;
+	if (comparison == 0 and low_inclusive and high_inclusive) {
+		// If low == high, and both ends are inclusive, then we're looking for
+		// a single item, and can just search for it and call base_case.
+		Node* here = get_node(low_key);
+		if (here == NULL) return 0;
+		_UNCANNY_COUNT(base_cases), aug->run_base_case(here->key, here->value, output);
+		return 1;
+	}
+	// Note that the above cases exhaustively establish that low_key < high_key.
+	assert(comparison < 0); // If you see this assert fire: BUG BUG BUG!
+	// No easy case was found, we'll have to do the full algorithm.
+	if (root == 0) return 0;
+	return compute_augmentation_range(aug, root, low_key, low_inclusive, high_key, high_inclusive, false, false, output);
+}
+
+_UNCANNY_TREE_TEMPLATE
+size_t _UNCANNY_TREE::augment_cut(int aug_id, const Key& key, int comparison_type, AugmentationResult* output) {
+	// Make sure the requested comparison_type is -2, -1, 1, or 2.
+	assert(comparison_type >= -2 and comparison_type <= 2 and comparison_type != 0);
+	assert(aug_ctx.augs.count(aug_id) == 1);
+	Augmentation* aug = &aug_ctx.augs.find(aug_id)->second;
+	sync_columns();
+	if (root == 0) return 0;
+	return compute_augmentation_cut(aug, root, key, comparison_type, false, output);
+}
+
+// Extends output, covering the keys so far, with result, covering the next keys along.
+// Any compute is counted in stats, if given.
+template <typename Aug>
+void append_augmentation(const Aug* aug, const AugmentationResult* result, size_t length, AugmentationResult* output, size_t* output_length, TreeStats* stats = NULL) {
+	if (length == 0)
+		return;
+	if (*output_length == 0)
+		copy_result(aug->result_size, output, result);
+	else {
+		AugmentationResult temp;
+		_UNCANNY_RESULT_BUFFER(aug->result_size, temp);
+		if (stats != NULL)
+			_UNCANNY_COUNT_IN(*stats, computes);
+		aug->run_compute(output, result, &temp);
+		copy_result(aug->result_size, output, &temp);
+	}
+	*output_length += length;
+}
+
+// Extends output, covering the keys so far, with result, covering the keys just before them.
+template <typename Aug>
+void prepend_augmentation(const Aug* aug, const AugmentationResult* result, size_t length, AugmentationResult* output, size_t* output_length, TreeStats* stats = NULL) {
+	if (length == 0)
+		return;
+	if (*output_length == 0)
+		copy_result(aug->result_size, output, result);
+	else {
+		AugmentationResult temp;
+		_UNCANNY_RESULT_BUFFER(aug->result_size, temp);
+		if (stats != NULL)
+			_UNCANNY_COUNT_IN(*stats, computes);
+		aug->run_compute(result, output, &temp);
+		copy_result(aug->result_size, output, &temp);
+	}
+	*output_length += length;
+}
+
+// Answers n range queries at once, writing each result and its element count
+// into outputs and lengths (whose output is untouched when its count is 0).
+// The tree is walked once, in order, for the whole batch: every node on any range's
+// boundary is visited once, its base case computed at most once, and each range
+// appends the cached results of subtrees it fully covers as the walk passes them.
+// Ranges may come in any order, and may overlap or nest; sorted, clustered ranges
+// share the most of their boundary paths.
+_UNCANNY_TREE_TEMPLATE
+void _UNCANNY_TREE::augment_ranges(int aug_id, const RangeQuery* ranges, size_t n, AugmentationResult* outputs, size_t* lengths) {
+	assert(aug_ctx.augs.count(aug_id) == 1);
+	Augmentation* aug = &aug_ctx.augs.find(aug_id)->second;
+	sync_columns();
+	for (size_t i=0; i<n; i++)
+		lengths[i] = 0;
+	if (root == 0 or n == 0)
+		return;
+	// One list of cursors per depth, reused across the whole walk.
+	std::vector<std::vector<RangeCursor> > levels(nodes[root].height + 1);
+	levels[0].resize(n);
+	for (size_t i=0; i<n; i++) {
+		levels[0][i].range = i;
+		levels[0][i].good_low = levels[0][i].good_high = false;
+	}
+	compute_augmentation_ranges(aug, root, ranges, levels, 0, outputs, lengths);
+}
+
+_UNCANNY_TREE_TEMPLATE
+void _UNCANNY_TREE::compute_augmentation_ranges(Augmentation* aug, NodeIndex index, const RangeQuery* ranges, std::vector<std::vector<RangeCursor> >& levels, size_t level, AugmentationResult* outputs, size_t* lengths) {
+	Node* node = &nodes[index];
+	_UNCANNY_COUNT(nodes_visited);
+	std::vector<RangeCursor>& cursors = levels[level];
+	bool any_left = false, any_here = false, any_right = false;
+	AugmentationResult whole;
+	_UNCANNY_RESULT_BUFFER(aug->result_size, whole);
+	size_t whole_length = 0;
+	for (unsigned int i=0; i<cursors.size(); i++) {
+		RangeCursor& c = cursors[i];
+		const RangeQuery& r = ranges[c.range];
+		c.go_left = c.here = c.go_right = false;
+		if (c.good_low and c.good_high) {
+			// This range covers the whole subtree, so use the cached value.
+			if (whole_length == 0)
+				whole_length = compute_augmentation(aug, index, &whole);
+			append_augmentation(aug, &whole, whole_length, &outputs[c.range], &lengths[c.range], &stats);
+			continue;
+		}
+		int low_comp = c.good_low ? 1 : compare_keys(node->key, r.low_key);
+		if (low_comp < 0 or (low_comp == 0 and not r.low_inclusive)) {
+			// We're too low.
+			c.go_right = node->right != 0;
+			c.good_low = low_comp == 0;
+			any_right |= c.go_right;
+			continue;
+		}
+		int high_comp = c.good_high ? -1 : compare_keys(node->key, r.high_key);
+		if (high_comp > 0 or (high_comp == 0 and not r.high_inclusive)) {
+			// We're too high.
+			c.go_left = node->left != 0;
+			c.good_high = high_comp == 0;
+			any_left |= c.go_left;
+			continue;
+		}
+		// This node is in range, as is everything on the inner side of any matched bound.
+		c.go_left = node->left != 0 and low_comp != 0;
+		c.here = true;
+		c.go_right = node->right != 0 and high_comp != 0;
+		any_left |= c.go_left;
+		any_here = true;
+		any_right |= c.go_right;
+	}
+	// Visit in key order, so every range can simply append as we go.
+	if (any_left) {
+		std::vector<RangeCursor>& next = levels[level + 1];
+		next.clear();
+		for (unsigned int i=0; i<cursors.size(); i++) {
+			if (not cursors[i].go_left) continue;
+			next.push_back(cursors[i]);
+			// Everything in the left subtree is below this node, so within the high bound.
+			if (cursors[i].here)
+				next.back().good_high = true;
+		}
+		compute_augmentation_ranges(aug, node->left, ranges, levels, level + 1, outputs, lengths);
+	}
+	if (any_here) {
+		AugmentationResult base;
+		_UNCANNY_RESULT_BUFFER(aug->result_size, base);
+		_UNCANNY_COUNT(base_cases), aug->run_base_case(node->key, node->value, &base);
+		for (unsigned int i=0; i<cursors.size(); i++)
+			if (cursors[i].here)
+				append_augmentation(aug, &base, 1, &outputs[cursors[i].range], &lengths[cursors[i].range], &stats);
+	}
+	if (any_right) {
+		std::vector<RangeCursor>& next = levels[level + 1];
+		next.clear();
+		for (unsigned int i=0; i<cursors.size(); i++) {
+			if (not cursors[i].go_right) continue;
+			next.push_back(cursors[i]);
+			if (cursors[i].here)
+				next.back().good_low = true;
+		}
+		compute_augmentation_ranges(aug, node->right, ranges, levels, level + 1, outputs, lengths);
+	}
+}
+
+_UNCANNY_TREE_TEMPLATE
+void _UNCANNY_TREE::lookup_augmentations(const int* aug_ids, size_t n, Augmentation** augs) {
+	for (size_t i=0; i<n; i++) {
+		assert(aug_ctx.augs.count(aug_ids[i]) == 1);
+		augs[i] = &aug_ctx.augs.find(aug_ids[i])->second;
+	}
+}
+
+// Adds node, or its whole subtree, to every output of a multi query,
+// before or after the keys they cover so far.
+_UNCANNY_TREE_TEMPLATE
+void _UNCANNY_TREE::multi_add(Augmentation** augs, size_t n, NodeIndex node, bool whole_subtree, bool before, size_t* elements, AugmentationResult* outputs) {
+	if (node == 0)
+		return;
+	for (size_t i=0; i<n; i++) {
+		AugmentationResult piece, temp;
+		_UNCANNY_RESULT_BUFFER(augs[i]->result_size, piece);
+		_UNCANNY_RESULT_BUFFER(augs[i]->result_size, temp);
+		if (whole_subtree)
+			compute_augmentation(augs[i], node, &piece);
+		else {
+			_UNCANNY_COUNT(base_cases);
+			augs[i]->run_base_case(nodes[node].key, nodes[node].value, &piece);
+		}
+		if (*elements == 0) {
+			copy_result(augs[i]->result_size, &outputs[i], &piece);
+			continue;
+		}
+		_UNCANNY_COUNT(computes);
+		if (before)
+			augs[i]->run_compute(&piece, &outputs[i], &temp);
+		else
+			augs[i]->run_compute(&outputs[i], &piece, &temp);
+		copy_result(augs[i]->result_size, &outputs[i], &temp);
+	}
+	*elements += whole_subtree ? nodes[node].size : 1;
+}
+
+// Walks down from node, prepending every key at or above the low bound.
+// Each piece found lies below everything found before it.
+_UNCANNY_TREE_TEMPLATE
+void _UNCANNY_TREE::multi_walk_low(Augmentation** augs, size_t n, NodeIndex node, const Key& low_key, bool low_inclusive, size_t* elements, AugmentationResult* outputs) {
+	while (node != 0) {
+		_UNCANNY_COUNT(nodes_visited);
+		int comparison = compare_keys(nodes[node].key, low_key);
+		if (comparison < 0) {
+			node = nodes[node].right;
+			continue;
+		}
+		multi_add(augs, n, nodes[node].right, true, true, elements, outputs);
+		if (comparison == 0) {
+			if (low_inclusive)
+				multi_add(augs, n, node, false, true, elements, outputs);
+			return;
+		}
+		multi_add(augs, n, node, false, true, elements, outputs);
+		node = nodes[node].left;
+	}
+}
+
+// The mirror image of multi_walk_low, appending every key at or below the high bound.
+_UNCANNY_TREE_TEMPLATE
+void _UNCANNY_TREE::multi_walk_high(Augmentation** augs, size_t n, NodeIndex node, const Key& high_key, bool high_inclusive, size_t* elements, AugmentationResult* outputs) {
+	while (node != 0) {
+		_UNCANNY_COUNT(nodes_visited);
+		int comparison = compare_keys(nodes[node].key, high_key);
+		if (comparison > 0) {
+			node = nodes[node].left;
+			continue;
+		}
+		multi_add(augs, n, nodes[node].left, true, false, elements, outputs);
+		if (comparison == 0) {
+			if (high_inclusive)
+				multi_add(augs, n, node, false, false, elements, outputs);
+			return;
+		}
+		multi_add(augs, n, node, false, false, elements, outputs);
+		node = nodes[node].right;
+	}
+}
+
+_UNCANNY_TREE_TEMPLATE
+size_t _UNCANNY_TREE::augment_range_multi(const int* aug_ids, size_t n, const Key& low_key, bool low_inclusive, const Key& high_key, bool high_inclusive, AugmentationResult* outputs) {
+	Augmentation* few[8];
+	std::vector<Augmentation*> many(n > 8 ? n : 0);
+	Augmentation** augs = n > 8 ? many.data() : few;
+	lookup_augmentations(aug_ids, n, augs);
+	sync_columns();
+	// The same edge cases as augment_range.
+	int comparison = compare_keys(low_key, high_key);
+	assert(comparison != 0 or low_inclusive == high_inclusive);
+	if (comparison > 0 or (comparison == 0 and not low_inclusive))
+		return 0;
+	// Descend to the highest node in the range. Everything in range is in its subtree.
+	NodeIndex split = root;
+	while (split != 0) {
+		_UNCANNY_COUNT(nodes_visited);
+		int low_comp = compare_keys(nodes[split].key, low_key);
+		if (low_comp < 0 or (low_comp == 0 and not low_inclusive)) {
+			split = nodes[split].right;
+			continue;
+		}
+		int high_comp = compare_keys(nodes[split].key, high_key);
+		if (high_comp > 0 or (high_comp == 0 and not high_inclusive)) {
+			split = nodes[split].left;
+			continue;
+		}
+		break;
+	}
+	if (split == 0)
+		return 0;
+	size_t elements = 0;
+	multi_add(augs, n, split, false, false, &elements, outputs);
+	multi_walk_low(augs, n, nodes[split].left, low_key, low_inclusive, &elements, outputs);
+	multi_walk_high(augs, n, nodes[split].right, high_key, high_inclusive, &elements, outputs);
+	return elements;
+}
+
+_UNCANNY_TREE_TEMPLATE
+size_t _UNCANNY_TREE::augment_cut_multi(const int* aug_ids, size_t n, const Key& key, int comparison_type, AugmentationResult* outputs) {
+	// Same comparison_type convention as augment_cut.
+	assert(comparison_type >= -2 and comparison_type <= 2 and comparison_type != 0);
+	Augmentation* few[8];
+	std::vector<Augmentation*> many(n > 8 ? n : 0);
+	Augmentation** augs = n > 8 ? many.data() : few;
+	lookup_augmentations(aug_ids, n, augs);
+	sync_columns();
+	size_t elements = 0;
+	if (comparison_type < 0)
+		multi_walk_high(augs, n, root, key, comparison_type == -1, &elements, outputs);
+	else
+		multi_walk_low(augs, n, root, key, comparison_type == 1, &elements, outputs);
+	return elements;
+}
+
+// Make some convenience functions.
+#define AUG_CONV(name, val) \
+_UNCANNY_TREE_TEMPLATE \
+size_t _UNCANNY_TREE::name(int aug_id, const Key& key, AugmentationResult* output) { \
+	return augment_cut(aug_id, key, val, output); \
+} \
+_UNCANNY_TREE_TEMPLATE \
+size_t _UNCANNY_TREE::name##_multi(const int* aug_ids, size_t n, const Key& key, AugmentationResult* outputs) { \
+	return augment_cut_multi(aug_ids, n, key, val, outputs); \
+}
+
+AUG_CONV(augment_lt, -2)
+AUG_CONV(augment_lte, -1)
+AUG_CONV(augment_gte, 1)
+AUG_CONV(augment_gt, 2)
+
+#undef AUG_CONV
+
+_UNCANNY_TREE_TEMPLATE
+typename _UNCANNY_TREE::Summary _UNCANNY_TREE::summarize_node(NodeIndex index, const Key* low_key, bool low_inclusive, const Key* high_key, bool high_inclusive) {
+	// A NULL bound means the whole subtree is known to be on the good side of it.
+	if (index == 0)
+		return Bundle::identity();
+	Node* node = &nodes[index];
+	if (low_key == NULL and high_key == NULL)
+		return node->summary;
+	if (low_key != NULL) {
+		int low_comp = compare_keys(node->key, *low_key);
+		if (low_comp < 0 or (low_comp == 0 and not low_inclusive))
+			return summarize_node(node->right, low_key, low_inclusive, high_key, high_inclusive);
+	}
+	if (high_key != NULL) {
+		int high_comp = compare_keys(node->key, *high_key);
+		if (high_comp > 0 or (high_comp == 0 and not high_inclusive))
+			return summarize_node(node->left, low_key, low_inclusive, high_key, high_inclusive);
+	}
+	// This node is in range, so its left subtree is entirely below high_key,
+	// and its right subtree is entirely above low_key.
+	Summary result = summarize_node(node->left, low_key, low_inclusive, NULL, false);
+	Bundle::combine(result, Bundle::base_case(node->key, node->value), result);
+	Bundle::combine(result, summarize_node(node->right, NULL, false, high_key, high_inclusive), result);
+	return result;
+}
+
+_UNCANNY_TREE_TEMPLATE
+typename _UNCANNY_TREE::Summary _UNCANNY_TREE::summarize_all() {
+	return summarize_node(root, NULL, false, NULL, false);
+}
+
+_UNCANNY_TREE_TEMPLATE
+typename _UNCANNY_TREE::Summary _UNCANNY_TREE::summarize_range(const Key& low_key, bool low_inclusive, const Key& high_key, bool high_inclusive) {
+	return summarize_node(root, &low_key, low_inclusive, &high_key, high_inclusive);
+}
+
+_UNCANNY_TREE_TEMPLATE
+typename _UNCANNY_TREE::Summary _UNCANNY_TREE::summarize_cut(const Key& key, int comparison_type) {
+	// Same comparison_type convention as augment_cut.
+	assert(comparison_type >= -2 and comparison_type <= 2 and comparison_type != 0);
+	if (comparison_type < 0)
+		return summarize_node(root, NULL, false, &key, comparison_type == -1);
+	return summarize_node(root, &key, comparison_type == 1, NULL, false);
+}
+
+#define SUMMARIZE_CONV(name, val) \
+_UNCANNY_TREE_TEMPLATE \
+typename _UNCANNY_TREE::Summary _UNCANNY_TREE::name(const Key& key) { \
+	return summarize_cut(key, val); \
+}
+
+SUMMARIZE_CONV(summarize_lt, -2)
+SUMMARIZE_CONV(summarize_lte, -1)
+SUMMARIZE_CONV(summarize_gte, 1)
+SUMMARIZE_CONV(summarize_gt, 2)
+
+#undef SUMMARIZE_CONV
+
+// Takes an immutable snapshot of every entry, with every augmentation registered
+// right now precomputed. Later changes to this tree do not affect the snapshot.
+_UNCANNY_TREE_TEMPLATE
+typename _UNCANNY_TREE::Frozen _UNCANNY_TREE::freeze() {
+	Frozen frozen;
+	frozen.cmp_f = cmp_f;
+	frozen.aug_ctx = aug_ctx;
+	std::vector<Key> keys;
+	std::vector<Value> values;
+	keys.reserve(nodes.size());
+	values.reserve(nodes.size());
+	collect_sorted(root, keys, values);
+	frozen.build(keys.data(), values.data(), keys.size());
+	return frozen;
+}
+
+_UNCANNY_TREE_TEMPLATE
+void _UNCANNY_TREE::collect_sorted(NodeIndex node, std::vector<Key>& keys, std::vector<Value>& values) {
+	if (node == 0)
+		return;
+	collect_sorted(nodes[node].left, keys, values);
+	keys.push_back(nodes[node].key);
+	values.push_back(nodes[node].value);
+	collect_sorted(nodes[node].right, keys, values);
+}
+
+#undef _UNCANNY_TREE_TEMPLATE
+#undef _UNCANNY_TREE
+
+#define _UNCANNY_FROZEN_TEMPLATE template <typename Key, typename Value, typename Compare>
+#define _UNCANNY_FROZEN BasicFrozenTree<Key, Value, Compare>
+
+// Positions sixteen times further along are four levels down, a whole cache line of
+// keys on the path of the descent. Fetching them early hides most of the misses.
+#define PREFETCH_DESCENDANTS(array, position) \
+	if (16 * position <= length) \
+		__builtin_prefetch(&array[16 * position]);
+
+_UNCANNY_FROZEN_TEMPLATE
+_UNCANNY_FROZEN::BasicFrozenTree() : cmp_f() {
+	length = 0;
+	attach_vectors();
+}
+
+_UNCANNY_FROZEN_TEMPLATE
+_UNCANNY_FROZEN::BasicFrozenTree(const BasicFrozenTree& other) {
+	*this = other;
+}
+
+// Copies share a mapped file, but not vectors, so the data pointers are redone either way.
+_UNCANNY_FROZEN_TEMPLATE
+_UNCANNY_FROZEN& _UNCANNY_FROZEN::operator=(const BasicFrozenTree& other) {
+	aug_ctx = other.aug_ctx;
+	cmp_f = other.cmp_f;
+	length = other.length;
+	keys = other.keys;
+	values = other.values;
+	summaries = other.summaries;
+	results = other.results;
+	mapping = other.mapping;
+	if (mapping) {
+		key_data = other.key_data;
+		value_data = other.value_data;
+		summary_data = other.summary_data;
+		result_data = other.result_data;
+	} else
+		attach_vectors();
+	return *this;
+}
+
+_UNCANNY_FROZEN_TEMPLATE
+void _UNCANNY_FROZEN::attach_vectors() {
+	mapping.reset();
+	key_data = keys.data();
+	value_data = values.data();
+	summary_data = summaries.data();
+	result_data = results.data();
+}
+
+// Lays out n sorted entries, and precomputes every augmentation in aug_ctx.
+_UNCANNY_FROZEN_TEMPLATE
+void _UNCANNY_FROZEN::build(const Key* sorted_keys, const Value* sorted_values, size_t n) {
+	length = n;
+	keys.resize(n + 1);
+	values.resize(n + 1);
+	fill(sorted_keys, sorted_values, 1, 0);
+	size_t aug_count = aug_ctx.augs.size();
+	summaries.assign((n + 1) * aug_count, AugmentationResult());
+	results.assign((n + 1) * aug_ctx.results_size, 0);
+	attach_vectors();
+	for (typename std::map<int, Augmentation>::iterator iter = aug_ctx.augs.begin(); iter != aug_ctx.augs.end(); iter++) {
+		const Augmentation* aug = &iter->second;
+		AugmentationResult result, temp;
+		_UNCANNY_RESULT_BUFFER(aug->result_size, result);
+		_UNCANNY_RESULT_BUFFER(aug->result_size, temp);
+		// Children come after their parents, so go backwards.
+		for (size_t position=n; position>=1; position--) {
+			size_t elements = 0, new_elements;
+			new_elements = subtree_augmentation(aug, 2 * position, &temp);
+			append_augmentation(aug, &temp, new_elements, &result, &elements);
+			aug->run_base_case(keys[position], values[position], &temp);
+			append_augmentation(aug, &temp, 1, &result, &elements);
+			new_elements = subtree_augmentation(aug, 2 * position + 1, &temp);
+			append_augmentation(aug, &temp, new_elements, &result, &elements);
+			result.clean = true;
+			result.aug_id = aug->aug_id;
+			result.data_length = elements;
+			summaries[position * aug_count + aug->schema_index] = result;
+			if (aug->result_size != 0) {
+				summaries[position * aug_count + aug->schema_index].data.vp = NULL;
+				memcpy(&results[position * aug_ctx.results_size + aug->result_offset], result.data.vp, aug->result_size);
+			}
+		}
+	}
+}
+
+// Places sorted entries from next onwards into position's subtree, in order.
+// Returns the first entry not placed.
+_UNCANNY_FROZEN_TEMPLATE
+size_t _UNCANNY_FROZEN::fill(const Key* sorted_keys, const Value* sorted_values, size_t position, size_t next) {
+	if (position > length)
+		return next;
+	next = fill(sorted_keys, sorted_values, 2 * position, next);
+	keys[position] = sorted_keys[next];
+	values[position] = sorted_values[next];
+	return fill(sorted_keys, sorted_values, 2 * position + 1, next + 1);
+}
+
+_UNCANNY_FROZEN_TEMPLATE
+const typename _UNCANNY_FROZEN::Augmentation* _UNCANNY_FROZEN::find_augmentation(int aug_id) const {
+	typename std::map<int, Augmentation>::const_iterator iter = aug_ctx.augs.find(aug_id);
+	assert(iter != aug_ctx.augs.end());
+	return &iter->second;
+}
+
+// Returns 0 if the key is not found.
+_UNCANNY_FROZEN_TEMPLATE
+size_t _UNCANNY_FROZEN::find_position(const Key& key) const {
+	size_t position = 1;
+	while (position <= length) {
+		PREFETCH_DESCENDANTS(key_data, position)
+		int comparison = cmp_f(key_data[position], key);
+		if (comparison == 0)
+			return position;
+		position = 2 * position + (comparison < 0);
+	}
+	return 0;
+}
+
+_UNCANNY_FROZEN_TEMPLATE
+const Value* _UNCANNY_FROZEN::get(const Key& key) const {
+	size_t position = find_position(key);
+	if (position == 0) return NULL;
+	return &value_data[position];
+}
+
+_UNCANNY_FROZEN_TEMPLATE
+Value _UNCANNY_FROZEN::get_default(const Key& key, Value otherwise) const {
+	const Value* ptr = get(key);
+	if (ptr == NULL) return otherwise;
+	return *ptr;
+}
+
+_UNCANNY_FROZEN_TEMPLATE
+size_t _UNCANNY_FROZEN::subtree_augmentation(const Augmentation* aug, size_t position, AugmentationResult* output) const {
+	if (position > length)
+		return 0;
+	const AugmentationResult* summary = &summary_data[position * aug_ctx.augs.size() + aug->schema_index];
+	if (aug->result_size == 0) {
+		*output = *summary;
+		return output->data_length;
+	}
+	void* buffer = output->data.vp;
+	*output = *summary;
+	output->data.vp = buffer;
+	memcpy(buffer, &result_data[position * aug_ctx.results_size + aug->result_offset], aug->result_size);
+	return output->data_length;
+}
+
+// Walks down towards key, appending each precomputed left subtree that falls wholly below it.
+_UNCANNY_FROZEN_TEMPLATE
+size_t _UNCANNY_FROZEN::collect_below(const Augmentation* aug, size_t position, const Key& key, bool inclusive, AugmentationResult* output) const {
+	size_t elements = 0, new_elements;
+	AugmentationResult temp;
+	_UNCANNY_RESULT_BUFFER(aug->result_size, temp);
+	while (position <= length) {
+		PREFETCH_DESCENDANTS(key_data, position)
+		int comparison = cmp_f(key_data[position], key);
+		if (comparison > 0) {
+			position = 2 * position;
+			continue;
+		}
+		new_elements = subtree_augmentation(aug, 2 * position, &temp);
+		append_augmentation(aug, &temp, new_elements, output, &elements);
+		if (comparison == 0 and not inclusive)
+			break;
+		aug->run_base_case(key_data[position], value_data[position], &temp);
+		append_augmentation(aug, &temp, 1, output, &elements);
+		// Nothing to our right can be below an exact match.
+		if (comparison == 0)
+			break;
+		position = 2 * position + 1;
+	}
+	return elements;
+}
+
+// The mirror image of collect_below, which finds pieces from the right, so prepends them.
+_UNCANNY_FROZEN_TEMPLATE
+size_t _UNCANNY_FROZEN::collect_above(const Augmentation* aug, size_t position, const Key& key, bool inclusive, AugmentationResult* output) const {
+	size_t elements = 0, new_elements;
+	AugmentationResult temp;
+	_UNCANNY_RESULT_BUFFER(aug->result_size, temp);
+	while (position <= length) {
+		PREFETCH_DESCENDANTS(key_data, position)
+		int comparison = cmp_f(key_data[position], key);
+		if (comparison < 0) {
+			position = 2 * position + 1;
+			continue;
+		}
+		new_elements = subtree_augmentation(aug, 2 * position + 1, &temp);
+		prepend_augmentation(aug, &temp, new_elements, output, &elements);
+		if (comparison == 0 and not inclusive)
+			break;
+		aug->run_base_case(key_data[position], value_data[position], &temp);
+		prepend_augmentation(aug, &temp, 1, output, &elements);
+		if (comparison == 0)
+			break;
+		position = 2 * position;
+	}
+	return elements;
+}
+
+_UNCANNY_FROZEN_TEMPLATE
+size_t _UNCANNY_FROZEN::augment_range(int aug_id, const Key& low_key, bool low_inclusive, const Key& high_key, bool high_inclusive, AugmentationResult* output) const {
+	const Augmentation* aug = find_augmentation(aug_id);
+	// The same edge cases as BasicTree::augment_range.
+	int comparison = cmp_f(low_key, high_key);
+	assert(comparison != 0 or low_inclusive == high_inclusive);
+	if (comparison > 0 or (comparison == 0 and (not low_inclusive) and not high_inclusive))
+		return 0;
+	if (comparison == 0) {
+		size_t position = find_position(low_key);
+		if (position == 0) return 0;
+		aug->run_base_case(key_data[position], value_data[position], output);
+		return 1;
+	}
+	// Descend to the first position within the range, where it splits in two.
+	size_t position = 1;
+	while (position <= length) {
+		PREFETCH_DESCENDANTS(key_data, position)
+		int low_comp = cmp_f(key_data[position], low_key);
+		if (low_comp < 0 or (low_comp == 0 and not low_inclusive)) {
+			position = 2 * position + 1;
+			continue;
+		}
+		int high_comp = cmp_f(key_data[position], high_key);
+		if (high_comp > 0 or (high_comp == 0 and not high_inclusive)) {
+			position = 2 * position;
+			continue;
+		}
+		break;
+	}
+	if (position > length)
+		return 0;
+	AugmentationResult temp;
+	_UNCANNY_RESULT_BUFFER(aug->result_size, temp);
+	size_t elements = collect_above(aug, 2 * position, low_key, low_inclusive, output);
+	aug->run_base_case(key_data[position], value_data[position], &temp);
+	append_augmentation(aug, &temp, 1, output, &elements);
+	size_t new_elements = collect_below(aug, 2 * position + 1, high_key, high_inclusive, &temp);
+	append_augmentation(aug, &temp, new_elements, output, &elements);
+	return elements;
+}
+
+_UNCANNY_FROZEN_TEMPLATE
+size_t _UNCANNY_FROZEN::augment_cut(int aug_id, const Key& key, int comparison_type, AugmentationResult* output) const {
+	// Same comparison_type convention as BasicTree::augment_cut.
+	assert(comparison_type >= -2 and comparison_type <= 2 and comparison_type != 0);
+	const Augmentation* aug = find_augmentation(aug_id);
+	if (comparison_type < 0)
+		return collect_below(aug, 1, key, comparison_type == -1, output);
+	return collect_above(aug, 1, key, comparison_type == 1, output);
+}
+
+#define AUG_CONV(name, val) \
+_UNCANNY_FROZEN_TEMPLATE \
+size_t _UNCANNY_FROZEN::name(int aug_id, const Key& key, AugmentationResult* output) const { \
+	return augment_cut(aug_id, key, val, output); \
+}
+
+AUG_CONV(augment_lt, -2)
+AUG_CONV(augment_lte, -1)
+AUG_CONV(augment_gte, 1)
+AUG_CONV(augment_gt, 2)
+
+#undef AUG_CONV
+#undef PREFETCH_DESCENDANTS
+#undef _UNCANNY_FROZEN_TEMPLATE
+#undef _UNCANNY_FROZEN
+#undef _UNCANNY_COUNT
+#undef _UNCANNY_COUNT_IN
+
+}
+
+#endif
+
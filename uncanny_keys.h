@@ -0,0 +1,116 @@
+// Uncanny trees, string keys.
+// Trees store keys by value in their nodes, so a key that carries its first few
+// bytes inline can be compared without leaving the node, and a descent only
+// touches the key's bytes proper when two keys share that whole prefix.
+
+#ifndef _UNCANNY_KEYS_HEADER
+#define _UNCANNY_KEYS_HEADER
+
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+
+#include "uncanny.h"
+
+namespace Uncanny {
+
+// Loads eight bytes as a big endian word, so that comparing words orders like memcmp.
+inline uint64_t load_big_endian(const char* bytes) {
+	uint64_t word;
+	memcpy(&word, bytes, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	word = __builtin_bswap64(word);
+#endif
+	return word;
+}
+
+// A byte string key, ordered like memcmp with shorter keys first on a tie, as
+// std::string is. The first PREFIX bytes, zero padded, are kept inline as big
+// endian words, and PREFIX must be a multiple of eight.
+// The bytes at data aren't owned, and must outlive the key, as with Tree's void* keys.
+template <int PREFIX = 16>
+struct PrefixedKey {
+	uint64_t prefix[PREFIX / 8];
+	const char* data;
+	size_t length;
+
+	PrefixedKey() : data(NULL), length(0) {
+		for (int i=0; i<PREFIX / 8; i++)
+			prefix[i] = 0;
+	}
+
+	PrefixedKey(const char* _data, size_t _length) : data(_data), length(_length) {
+		char padded[PREFIX] = {0};
+		memcpy(padded, data, length < PREFIX ? length : PREFIX);
+		for (int i=0; i<PREFIX / 8; i++)
+			prefix[i] = load_big_endian(padded + 8 * i);
+	}
+
+	PrefixedKey(const std::string& s) : PrefixedKey(s.data(), s.size()) {}
+
+	std::string str() const {
+		return std::string(data, length);
+	}
+};
+
+template <int PREFIX>
+inline int compare_prefixed(const PrefixedKey<PREFIX>& a, const PrefixedKey<PREFIX>& b) {
+	for (int i=0; i<PREFIX / 8; i++)
+		if (a.prefix[i] != b.prefix[i])
+			return a.prefix[i] < b.prefix[i] ? -1 : 1;
+	// The prefixes tie, so only bytes past them can differ. Zero padding can't
+	// tell "a" from "a\0", but the lengths can.
+	size_t shorter = a.length < b.length ? a.length : b.length;
+	if (shorter > (size_t)PREFIX) {
+		int comparison = memcmp(a.data + PREFIX, b.data + PREFIX, shorter - PREFIX);
+		if (comparison != 0)
+			return comparison;
+	}
+	return (a.length > b.length) - (a.length < b.length);
+}
+
+// So that BasicTree<PrefixedKey<>, Value> compares prefixes with no further setup.
+template <int PREFIX>
+struct DefaultCompare<PrefixedKey<PREFIX> > {
+	int operator()(const PrefixedKey<PREFIX>& a, const PrefixedKey<PREFIX>& b) const {
+		return compare_prefixed(a, b);
+	}
+};
+
+typedef PrefixedKey<16> StringKey;
+
+// Memcmp ordered encodings for composite keys: appending each field of a tuple
+// in turn gives keys that order like the tuples do.
+inline void encode_u64(std::string& out, uint64_t x) {
+	for (int shift=56; shift>=0; shift -= 8)
+		out += (char)(x >> shift);
+}
+
+inline void encode_i64(std::string& out, int64_t x) {
+	encode_u64(out, (uint64_t)x ^ (1ull << 63));
+}
+
+// Negative doubles have every bit flipped, and the rest just the sign, so -0.0
+// comes before 0.0. NaNs sort to the ends.
+inline void encode_f64(std::string& out, double x) {
+	uint64_t bits;
+	memcpy(&bits, &x, sizeof(bits));
+	encode_u64(out, bits >> 63 ? ~bits : bits | (1ull << 63));
+}
+
+// Zero bytes are escaped as 00 ff, and the field ends with 00 01, so a string
+// sorts before any longer one it starts, whatever fields follow it.
+inline void encode_string(std::string& out, const char* data, size_t length) {
+	for (size_t i=0; i<length; i++) {
+		out += data[i];
+		if (data[i] == 0)
+			out += (char)0xff;
+	}
+	out += (char)0;
+	out += (char)1;
+}
+
+}
+
+#endif
@@ -0,0 +1,482 @@
+// Uncanny persistent trees.
+// A path-copying AVL tree: every write builds a new version that shares all
+// untouched nodes with the previous one, and readers query whichever version
+// they took a snapshot of, without locks, while a single writer carries on.
+// Nodes are immutable once published, so runtime augmentations are computed
+// eagerly when a node is made, and nothing is cached or mutated during reads.
+// Nodes and versions are reference counted, and freed by whichever thread drops
+// the last reference; a small two-slot epoch scheme makes taking a snapshot of
+// the latest version safe against the writer dropping it at the same time.
+
+#ifndef _UNCANNY_PERSISTENT_HEADER
+#define _UNCANNY_PERSISTENT_HEADER
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "uncanny.h"
+
+namespace Uncanny {
+
+template <typename Key, typename Value, typename Compare = DefaultCompare<Key> >
+struct BasicPersistentTree {
+	typedef BasicAugmentation<Key, Value> Augmentation;
+	typedef BasicAugmentationCtx<Key, Value> AugmentationCtx;
+
+	struct Node {
+		std::atomic<uint32_t> refs;
+		Node* left;
+		Node* right;
+		unsigned char height;
+		Key key;
+		Value value;
+		// One result per augmentation of the version's schema, in schema order,
+		// each covering this whole subtree, with its element count in data_length.
+		std::vector<AugmentationResult> summaries;
+		// Their large results, at each augmentation's result_offset. Nodes never
+		// move, so the summaries point straight in here.
+		std::vector<char> results;
+	};
+
+	// One published state of the tree. Versions share nodes, and own a reference
+	// to their root, and to the augmentations their nodes were computed with.
+	struct Version {
+		std::atomic<uint32_t> refs;
+		Node* root;
+		size_t length;
+		std::shared_ptr<const AugmentationCtx> schema;
+	};
+
+	static Node* retain(Node* node) {
+		if (node != NULL)
+			node->refs.fetch_add(1, std::memory_order_relaxed);
+		return node;
+	}
+
+	static void release(Node* node) {
+		if (node == NULL or node->refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+			return;
+		release(node->left);
+		release(node->right);
+		delete node;
+	}
+
+	static void release(Version* version) {
+		if (version->refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+			return;
+		release(version->root);
+		delete version;
+	}
+
+	static int height(const Node* node) {
+		return node == NULL ? 0 : node->height;
+	}
+
+	// A read-only handle on one version, which stays valid however far the writer moves on.
+	// Any number of threads may query the same snapshot at once.
+	struct Snapshot {
+		Version* version;
+		Compare cmp_f;
+
+		Snapshot(Version* _version, const Compare& _cmp_f) : version(_version), cmp_f(_cmp_f) {}
+
+		Snapshot(const Snapshot& other) : version(other.version), cmp_f(other.cmp_f) {
+			version->refs.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		~Snapshot() {
+			release(version);
+		}
+
+		Snapshot& operator=(const Snapshot&) = delete;
+
+		size_t length() const {
+			return version->length;
+		}
+
+		const Value* get(const Key& key) const {
+			const Node* node = version->root;
+			while (node != NULL) {
+				int comparison = cmp_f(key, node->key);
+				if (comparison == 0)
+					return &node->value;
+				node = comparison < 0 ? node->left : node->right;
+			}
+			// Key not found. :(
+			return NULL;
+		}
+
+		Value get_default(const Key& key, Value otherwise) const {
+			const Value* ptr = get(key);
+			if (ptr == NULL) return otherwise;
+			return *ptr;
+		}
+
+		const Augmentation* find_augmentation(int aug_id) const {
+			typename std::map<int, Augmentation>::const_iterator iter = version->schema->augs.find(aug_id);
+			// The augmentation must have been registered before this version was written.
+			assert(iter != version->schema->augs.end());
+			return &iter->second;
+		}
+
+		static size_t subtree_augmentation(const Augmentation* aug, const Node* node, AugmentationResult* output) {
+			if (node == NULL)
+				return 0;
+			copy_result(aug->result_size, output, &node->summaries[aug->schema_index]);
+			return output->data_length;
+		}
+
+		// Everything under node below key (or equal, if inclusive), in order.
+		size_t collect_below(const Augmentation* aug, const Node* node, const Key& key, bool inclusive, AugmentationResult* output) const {
+			size_t elements = 0, new_elements;
+			AugmentationResult temp;
+			_UNCANNY_RESULT_BUFFER(aug->result_size, temp);
+			while (node != NULL) {
+				int comparison = cmp_f(node->key, key);
+				if (comparison > 0) {
+					node = node->left;
+					continue;
+				}
+				new_elements = subtree_augmentation(aug, node->left, &temp);
+				append_augmentation(aug, &temp, new_elements, output, &elements);
+				if (comparison == 0 and not inclusive)
+					break;
+				aug->run_base_case(node->key, node->value, &temp);
+				append_augmentation(aug, &temp, 1, output, &elements);
+				if (comparison == 0)
+					break;
+				node = node->right;
+			}
+			return elements;
+		}
+
+		// Everything under node above key (or equal, if inclusive), found from the right.
+		size_t collect_above(const Augmentation* aug, const Node* node, const Key& key, bool inclusive, AugmentationResult* output) const {
+			size_t elements = 0, new_elements;
+			AugmentationResult temp;
+			_UNCANNY_RESULT_BUFFER(aug->result_size, temp);
+			while (node != NULL) {
+				int comparison = cmp_f(node->key, key);
+				if (comparison < 0) {
+					node = node->right;
+					continue;
+				}
+				new_elements = subtree_augmentation(aug, node->right, &temp);
+				prepend_augmentation(aug, &temp, new_elements, output, &elements);
+				if (comparison == 0 and not inclusive)
+					break;
+				aug->run_base_case(node->key, node->value, &temp);
+				prepend_augmentation(aug, &temp, 1, output, &elements);
+				if (comparison == 0)
+					break;
+				node = node->left;
+			}
+			return elements;
+		}
+
+		size_t augment_range(int aug_id, const Key& low_key, bool low_inclusive, const Key& high_key, bool high_inclusive, AugmentationResult* output) const {
+			// An empty version may predate the augmentation, but has nothing to augment anyway.
+			if (version->root == NULL)
+				return 0;
+			const Augmentation* aug = find_augmentation(aug_id);
+			// The same edge cases as BasicTree::augment_range.
+			int comparison = cmp_f(low_key, high_key);
+			assert(comparison != 0 or low_inclusive == high_inclusive);
+			if (comparison > 0 or (comparison == 0 and (not low_inclusive) and not high_inclusive))
+				return 0;
+			// Descend to the first node within the range, where it splits in two.
+			const Node* node = version->root;
+			while (node != NULL) {
+				int low_comp = cmp_f(node->key, low_key);
+				if (low_comp < 0 or (low_comp == 0 and not low_inclusive)) {
+					node = node->right;
+					continue;
+				}
+				int high_comp = cmp_f(node->key, high_key);
+				if (high_comp > 0 or (high_comp == 0 and not high_inclusive)) {
+					node = node->left;
+					continue;
+				}
+				break;
+			}
+			if (node == NULL)
+				return 0;
+			AugmentationResult temp;
+			_UNCANNY_RESULT_BUFFER(aug->result_size, temp);
+			size_t elements = collect_above(aug, node->left, low_key, low_inclusive, output);
+			aug->run_base_case(node->key, node->value, &temp);
+			append_augmentation(aug, &temp, 1, output, &elements);
+			size_t new_elements = collect_below(aug, node->right, high_key, high_inclusive, &temp);
+			append_augmentation(aug, &temp, new_elements, output, &elements);
+			return elements;
+		}
+
+		size_t augment_cut(int aug_id, const Key& key, int comparison_type, AugmentationResult* output) const {
+			// Same comparison_type convention as BasicTree::augment_cut.
+			assert(comparison_type >= -2 and comparison_type <= 2 and comparison_type != 0);
+			if (version->root == NULL)
+				return 0;
+			const Augmentation* aug = find_augmentation(aug_id);
+			if (comparison_type < 0)
+				return collect_below(aug, version->root, key, comparison_type == -1, output);
+			return collect_above(aug, version->root, key, comparison_type == 1, output);
+		}
+
+#define _UNCANNY_PERSISTENT_AUG_CONV(name, val) \
+		size_t name(int aug_id, const Key& key, AugmentationResult* output) const { \
+			return augment_cut(aug_id, key, val, output); \
+		}
+
+_UNCANNY_PERSISTENT_AUG_CONV(augment_lt, -2)
+_UNCANNY_PERSISTENT_AUG_CONV(augment_lte, -1)
+_UNCANNY_PERSISTENT_AUG_CONV(augment_gte, 1)
+_UNCANNY_PERSISTENT_AUG_CONV(augment_gt, 2)
+
+#undef _UNCANNY_PERSISTENT_AUG_CONV
+
+	};
+
+	// Everything below is for the single writer thread, except snapshot().
+	// Augmentations registered in aug_ctx take effect from the next write, or sync_schema().
+	AugmentationCtx aug_ctx;
+	Compare cmp_f;
+	// The writer's own reference to the latest version, which is also what current points to.
+	Version* latest;
+	std::atomic<Version*> current;
+	// Readers taking a snapshot announce themselves in the slot for the current epoch,
+	// so the writer knows when nobody can still be about to retain a version it replaced.
+	std::atomic<unsigned int> epoch;
+	std::atomic<unsigned int> acquiring[2];
+
+	BasicPersistentTree() : cmp_f() {
+		epoch = 0;
+		acquiring[0] = acquiring[1] = 0;
+		latest = new_version(NULL, 0, std::make_shared<AugmentationCtx>(aug_ctx));
+		current = latest;
+	}
+
+	// Outstanding snapshots keep their versions, and so their nodes, alive.
+	~BasicPersistentTree() {
+		release(latest);
+	}
+
+	BasicPersistentTree(const BasicPersistentTree&) = delete;
+	BasicPersistentTree& operator=(const BasicPersistentTree&) = delete;
+
+	static Version* new_version(Node* root, size_t length, const std::shared_ptr<const AugmentationCtx>& schema) {
+		Version* version = new Version();
+		version->refs = 1;
+		version->root = root;
+		version->length = length;
+		version->schema = schema;
+		return version;
+	}
+
+	// Safe to call from any thread, at any time.
+	Snapshot snapshot() {
+		for (;;) {
+			unsigned int e = epoch.load();
+			acquiring[e].fetch_add(1);
+			// If the writer flipped the epoch in between, it may not wait for us, so retry.
+			if (epoch.load() == e) {
+				Version* version = current.load();
+				version->refs.fetch_add(1, std::memory_order_relaxed);
+				acquiring[e].fetch_sub(1);
+				return Snapshot(version, cmp_f);
+			}
+			acquiring[e].fetch_sub(1);
+		}
+	}
+
+	// Waits until no reader can still be about to retain a version loaded before now.
+	// Readers only sit in acquiring[] for a few instructions, so this is short.
+	void synchronize() {
+		unsigned int e = epoch.load();
+		// Stragglers from before the last flip go first, then everyone in the current epoch.
+		while (acquiring[1 - e].load() != 0)
+			std::this_thread::yield();
+		epoch.store(1 - e);
+		while (acquiring[e].load() != 0)
+			std::this_thread::yield();
+	}
+
+	void publish(Node* root, size_t length, const std::shared_ptr<const AugmentationCtx>& schema) {
+		Version* old = latest;
+		latest = new_version(root, length, schema);
+		current.store(latest);
+		synchronize();
+		release(old);
+	}
+
+	size_t length() {
+		return latest->length;
+	}
+
+	// Writer side lookup, in the latest version.
+	const Value* get(const Key& key) {
+		return Snapshot(retain_latest(), cmp_f).get(key);
+	}
+
+	Value get_default(const Key& key, Value otherwise) {
+		const Value* ptr = get(key);
+		if (ptr == NULL) return otherwise;
+		return *ptr;
+	}
+
+	Version* retain_latest() {
+		latest->refs.fetch_add(1, std::memory_order_relaxed);
+		return latest;
+	}
+
+	// Makes a new node owning the given references to its children.
+	Node* make(const Key& key, const Value& value, Node* left, Node* right, const AugmentationCtx& schema) {
+		Node* node = new Node();
+		node->refs = 1;
+		node->left = left;
+		node->right = right;
+		node->height = 1 + std::max(height(left), height(right));
+		node->key = key;
+		node->value = value;
+		node->summaries.resize(schema.augs.size());
+		node->results.resize(schema.results_size);
+		// Big enough for any one of the results.
+		AugmentationResult result, temp;
+		_UNCANNY_RESULT_BUFFER(schema.results_size, result);
+		_UNCANNY_RESULT_BUFFER(schema.results_size, temp);
+		for (typename std::map<int, Augmentation>::const_iterator iter = schema.augs.begin(); iter != schema.augs.end(); iter++) {
+			const Augmentation* aug = &iter->second;
+			size_t elements = 0, new_elements;
+			new_elements = Snapshot::subtree_augmentation(aug, left, &temp);
+			append_augmentation(aug, &temp, new_elements, &result, &elements);
+			aug->run_base_case(key, value, &temp);
+			append_augmentation(aug, &temp, 1, &result, &elements);
+			new_elements = Snapshot::subtree_augmentation(aug, right, &temp);
+			append_augmentation(aug, &temp, new_elements, &result, &elements);
+			result.clean = true;
+			result.aug_id = aug->aug_id;
+			result.data_length = elements;
+			node->summaries[aug->schema_index] = result;
+			if (aug->result_size != 0) {
+				node->summaries[aug->schema_index].data.vp = &node->results[aug->result_offset];
+				memcpy(node->summaries[aug->schema_index].data.vp, result.data.vp, aug->result_size);
+			}
+		}
+		return node;
+	}
+
+	// Like make, but rotates to restore the AVL invariant, given children whose
+	// heights differ by at most two. Only ever rotates through freshly made nodes'
+	// parents, copying the nodes that move.
+	Node* balance(const Key& key, const Value& value, Node* left, Node* right, const AugmentationCtx& schema) {
+		if (height(left) > height(right) + 1) {
+			Node* result;
+			if (height(left->left) >= height(left->right)) {
+				result = make(left->key, left->value, retain(left->left),
+					make(key, value, retain(left->right), right, schema), schema);
+			} else {
+				Node* inner = left->right;
+				result = make(inner->key, inner->value,
+					make(left->key, left->value, retain(left->left), retain(inner->left), schema),
+					make(key, value, retain(inner->right), right, schema), schema);
+			}
+			release(left);
+			return result;
+		}
+		if (height(right) > height(left) + 1) {
+			Node* result;
+			if (height(right->right) >= height(right->left)) {
+				result = make(right->key, right->value,
+					make(key, value, left, retain(right->left), schema), retain(right->right), schema);
+			} else {
+				Node* inner = right->left;
+				result = make(inner->key, inner->value,
+					make(key, value, left, retain(inner->left), schema),
+					make(right->key, right->value, retain(inner->right), retain(right->right), schema), schema);
+			}
+			release(right);
+			return result;
+		}
+		return make(key, value, left, right, schema);
+	}
+
+	// These take borrowed nodes of the old version, and return new owned subtrees.
+	Node* insert_subtree(Node* node, const Key& key, const Value& value, bool* added, const AugmentationCtx& schema) {
+		if (node == NULL) {
+			*added = true;
+			return make(key, value, NULL, NULL, schema);
+		}
+		int comparison = cmp_f(key, node->key);
+		if (comparison == 0)
+			return make(key, value, retain(node->left), retain(node->right), schema);
+		if (comparison < 0)
+			return balance(node->key, node->value, insert_subtree(node->left, key, value, added, schema), retain(node->right), schema);
+		return balance(node->key, node->value, retain(node->left), insert_subtree(node->right, key, value, added, schema), schema);
+	}
+
+	Node* remove_min(Node* node, Node** min, const AugmentationCtx& schema) {
+		if (node->left == NULL) {
+			*min = node;
+			return retain(node->right);
+		}
+		return balance(node->key, node->value, remove_min(node->left, min, schema), retain(node->right), schema);
+	}
+
+	Node* remove_subtree(Node* node, const Key& key, const AugmentationCtx& schema) {
+		int comparison = cmp_f(key, node->key);
+		if (comparison < 0)
+			return balance(node->key, node->value, remove_subtree(node->left, key, schema), retain(node->right), schema);
+		if (comparison > 0)
+			return balance(node->key, node->value, retain(node->left), remove_subtree(node->right, key, schema), schema);
+		if (node->left == NULL)
+			return retain(node->right);
+		if (node->right == NULL)
+			return retain(node->left);
+		// Replace the node with its successor.
+		Node* min;
+		Node* right = remove_min(node->right, &min, schema);
+		return balance(min->key, min->value, retain(node->left), right, schema);
+	}
+
+	// Copies every node, recomputing summaries with the current aug_ctx.
+	Node* rebuild_subtree(Node* node, const AugmentationCtx& schema) {
+		if (node == NULL)
+			return NULL;
+		return make(node->key, node->value, rebuild_subtree(node->left, schema), rebuild_subtree(node->right, schema), schema);
+	}
+
+	// Returns the schema for the next version, rebuilding the tree first if aug_ctx changed.
+	std::shared_ptr<const AugmentationCtx> sync_schema() {
+		if (latest->schema->schema_version == aug_ctx.schema_version)
+			return latest->schema;
+		std::shared_ptr<const AugmentationCtx> schema = std::make_shared<AugmentationCtx>(aug_ctx);
+		publish(rebuild_subtree(latest->root, *schema), latest->length, schema);
+		return schema;
+	}
+
+	void insert(const Key& key, const Value& value) {
+		std::shared_ptr<const AugmentationCtx> schema = sync_schema();
+		bool added = false;
+		Node* root = insert_subtree(latest->root, key, value, &added, *schema);
+		publish(root, latest->length + added, schema);
+	}
+
+	void remove(const Key& key) {
+		std::shared_ptr<const AugmentationCtx> schema = sync_schema();
+		// Nothing to copy if the key isn't there.
+		if (get(key) == NULL)
+			return;
+		publish(remove_subtree(latest->root, key, *schema), latest->length - 1, schema);
+	}
+};
+
+}
+
+#endif
+
@@ -0,0 +1,226 @@
+// Uncanny trees, node storage.
+
+#ifndef _UNCANNY_POOL_HEADER
+#define _UNCANNY_POOL_HEADER
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <utility>
+#include <vector>
+
+namespace Uncanny {
+
+// Nodes are referred to by 32-bit indices into their tree's pool.
+// Index 0 is never handed out, and plays the role of NULL.
+typedef uint32_t NodeIndex;
+
+// An array that grows in chunks, so that elements never move once created.
+// Chunk k holds FIRST_CHUNK << k elements, so small arrays stay small and
+// locating an element is a bit scan rather than a search.
+// If lazy, chunks are only allocated (zero-initialized) once something in them is touched.
+template <typename T, bool lazy = false>
+struct ChunkedArray {
+	enum {
+		FIRST_CHUNK_BITS = 6,
+		FIRST_CHUNK = 1 << FIRST_CHUNK_BITS,
+		MAX_CHUNKS = 32 - FIRST_CHUNK_BITS,
+	};
+	// Indices are biased by FIRST_CHUNK, so the last few 32-bit values are unusable.
+	static const uint32_t MAX_SIZE = 0xffffffffu - FIRST_CHUNK;
+
+	T* chunks[MAX_CHUNKS];
+	uint32_t capacity;
+
+	ChunkedArray() {
+		for (int k=0; k<MAX_CHUNKS; k++)
+			chunks[k] = NULL;
+		capacity = 0;
+	}
+
+	~ChunkedArray() {
+		clear();
+	}
+
+	ChunkedArray(const ChunkedArray&) = delete;
+	ChunkedArray& operator=(const ChunkedArray&) = delete;
+
+	static void locate(uint32_t i, int& chunk, uint32_t& offset) {
+		uint32_t biased = i + FIRST_CHUNK;
+		int top = 31 - __builtin_clz(biased);
+		chunk = top - FIRST_CHUNK_BITS;
+		offset = biased - (1u << top);
+	}
+
+	T& operator[](uint32_t i) {
+		int chunk;
+		uint32_t offset;
+		locate(i, chunk, offset);
+		if (lazy)
+			return lazy_chunk(chunk)[offset];
+		return chunks[chunk][offset];
+	}
+
+	// Concurrent readers may race to allocate the same chunk, so it is published
+	// with a compare and swap, and whoever loses frees their copy.
+	T* lazy_chunk(int chunk) {
+		T* existing = __atomic_load_n(&chunks[chunk], __ATOMIC_ACQUIRE);
+		if (existing != NULL)
+			return existing;
+		T* fresh = new T[FIRST_CHUNK << chunk]();
+		if (__atomic_compare_exchange_n(&chunks[chunk], &existing, fresh, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			return fresh;
+		delete[] fresh;
+		return existing;
+	}
+
+	// Whether element i's chunk has been allocated yet.
+	bool present(uint32_t i) {
+		int chunk;
+		uint32_t offset;
+		locate(i, chunk, offset);
+		return __atomic_load_n(&chunks[chunk], __ATOMIC_ACQUIRE) != NULL;
+	}
+
+	// Makes sure indices below size exist.
+	void grow(uint32_t size) {
+		assert(size <= MAX_SIZE);
+		while (capacity < size) {
+			int chunk;
+			uint32_t offset;
+			locate(capacity, chunk, offset);
+			if (not lazy)
+				chunks[chunk] = new T[FIRST_CHUNK << chunk]();
+			capacity += FIRST_CHUNK << chunk;
+		}
+	}
+
+	// Allocates any lazy chunks covering indices below size, so that
+	// threads can then fill in disjoint elements without racing to allocate.
+	void materialize(uint32_t size) {
+		grow(size);
+		for (uint32_t i=0; i<capacity; i += FIRST_CHUNK << chunk_of(i))
+			(*this)[i];
+	}
+
+	static int chunk_of(uint32_t i) {
+		int chunk;
+		uint32_t offset;
+		locate(i, chunk, offset);
+		return chunk;
+	}
+
+	void swap(ChunkedArray& other) {
+		for (int k=0; k<MAX_CHUNKS; k++)
+			std::swap(chunks[k], other.chunks[k]);
+		std::swap(capacity, other.capacity);
+	}
+
+	// Frees everything at once, a chunk at a time.
+	void clear() {
+		for (int k=0; k<MAX_CHUNKS; k++) {
+			delete[] chunks[k];
+			chunks[k] = NULL;
+		}
+		capacity = 0;
+	}
+};
+
+// Fixed size records, indexed and chunked like a lazy ChunkedArray, for when the
+// record size is only known at runtime. Records never move once allocated.
+struct RecordArena {
+	typedef ChunkedArray<char, true> Layout;
+
+	size_t record_size;
+	char* chunks[Layout::MAX_CHUNKS];
+
+	RecordArena(size_t _record_size) : record_size(_record_size) {
+		for (int k=0; k<Layout::MAX_CHUNKS; k++)
+			chunks[k] = NULL;
+	}
+
+	~RecordArena() {
+		clear();
+	}
+
+	RecordArena(const RecordArena&) = delete;
+	RecordArena& operator=(const RecordArena&) = delete;
+
+	// Allocated on first use, racing readers resolved as in ChunkedArray::lazy_chunk.
+	void* operator[](uint32_t i) {
+		int chunk;
+		uint32_t offset;
+		Layout::locate(i, chunk, offset);
+		char* existing = __atomic_load_n(&chunks[chunk], __ATOMIC_ACQUIRE);
+		if (existing == NULL) {
+			char* fresh = new char[(size_t)(Layout::FIRST_CHUNK << chunk) * record_size]();
+			if (__atomic_compare_exchange_n(&chunks[chunk], &existing, fresh, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+				existing = fresh;
+			else
+				delete[] fresh;
+		}
+		return existing + offset * record_size;
+	}
+
+	void clear() {
+		for (int k=0; k<Layout::MAX_CHUNKS; k++) {
+			delete[] chunks[k];
+			chunks[k] = NULL;
+		}
+	}
+};
+
+// Hands out indices into a ChunkedArray, recycling released ones.
+// Released elements are left as they are, for the owner to reuse or overwrite.
+template <typename T>
+struct Pool {
+	ChunkedArray<T> storage;
+	uint32_t next_fresh;
+	std::vector<NodeIndex> free_indices;
+
+	Pool() {
+		clear();
+	}
+
+	T& operator[](NodeIndex i) {
+		return storage[i];
+	}
+
+	NodeIndex alloc() {
+		if (not free_indices.empty()) {
+			NodeIndex i = free_indices.back();
+			free_indices.pop_back();
+			return i;
+		}
+		storage.grow(next_fresh + 1);
+		return next_fresh++;
+	}
+
+	void release(NodeIndex i) {
+		free_indices.push_back(i);
+	}
+
+	size_t size() {
+		return next_fresh - 1 - free_indices.size();
+	}
+
+	void swap(Pool& other) {
+		storage.swap(other.storage);
+		std::swap(next_fresh, other.next_fresh);
+		free_indices.swap(other.free_indices);
+	}
+
+	// Drops every element, keeping index 0 reserved.
+	void clear() {
+		storage.clear();
+		storage.grow(1);
+		next_fresh = 1;
+		std::vector<NodeIndex>().swap(free_indices);
+	}
+};
+
+}
+
+#endif
+
@@ -3,8 +3,11 @@
 #include <string.h>
 #include <assert.h>
 #include <stdint.h>
+#include <stdlib.h>
 
-#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
 using namespace std;
 
 #include "uncanny_query.h"
@@ -12,18 +15,404 @@ using namespace Uncanny;
 using namespace UncannyQuery;
 
 #define HEADER_LENGTH 16
+#define STACK_DEPTH 16
 
-static function<int(void*,void*)>* build_cmp_function(size_t& length, const char*& desc) {
-	// Figure out how large the payload is.
-	uint32_t chunk_size = *(uint32_t*)desc;
-	// Copy out just the payload.
-	const char* data = new const char[chunk_size];
-	memcpy(data, desc+4, chunk_size);
+// ===== Native kernels =====
+// Programs recognized at unpack time run as these instead of being interpreted.
+
+static long long& word(AugmentationResult* r, long long*) { return r->data.l; }
+static double& word(AugmentationResult* r, double*) { return r->data.d; }
+static long long word(const AugmentationResult* r, long long*) { return r->data.l; }
+static double word(const AugmentationResult* r, double*) { return r->data.d; }
+
+static void native_value_base_case(void* key, void* value, AugmentationResult* output) {
+	output->data.vp = value;
+	output->data_length = 1;
+}
+
+static void native_key_base_case(void* key, void* value, AugmentationResult* output) {
+	output->data.vp = key;
+	output->data_length = 1;
+}
+
+static void native_count_base_case(void* key, void* value, AugmentationResult* output) {
+	output->data.l = 1;
+	output->data_length = 1;
+}
+
+template <typename T, int op>
+static void native_compute(const AugmentationResult* a, const AugmentationResult* b, AugmentationResult* output) {
+	T x = word(a, (T*)NULL), y = word(b, (T*)NULL);
+	T& out = word(output, (T*)NULL);
+	if (op == OP_ADD_I or op == OP_ADD_D)
+		out = x + y;
+	else if (op == OP_MIN_I or op == OP_MIN_D)
+		out = y < x ? y : x;
+	else
+		out = x < y ? y : x;
+	output->data_length = a->data_length + b->data_length;
+}
+
+// Integer sums wrap, like the interpreter's.
+template <>
+void native_compute<long long, OP_ADD_I>(const AugmentationResult* a, const AugmentationResult* b, AugmentationResult* output) {
+	output->data.ul = a->data.ul + b->data.ul;
+	output->data_length = a->data_length + b->data_length;
+}
+
+static bool native_equal(const AugmentationResult* a, const AugmentationResult* b) {
+	return a->data.ul == b->data.ul;
+}
+
+static int native_integer_cmp(void* _a, void* _b) {
+	long long a = (long long)_a, b = (long long)_b;
+	return (a > b) - (a < b);
+}
+
+static int native_double_cmp(void* _a, void* _b) {
+	double a, b;
+	memcpy(&a, &_a, sizeof(double));
+	memcpy(&b, &_b, sizeof(double));
+	return (a > b) - (a < b);
+}
+
+// ===== Interpreter =====
+
+static double as_double(uint64_t x) {
+	double d;
+	memcpy(&d, &x, sizeof(double));
+	return d;
+}
+
+static uint64_t from_double(double d) {
+	uint64_t x;
+	memcpy(&x, &d, sizeof(double));
+	return x;
+}
+
+static uint64_t from_pointer(void* p) {
+	return (uint64_t)(uintptr_t)p;
+}
+
+// inputs is indexed by the opcode that pushes each input.
+// The program must have passed validate, so nothing is checked here.
+static uint64_t run(const unsigned char* code, const uint64_t* inputs) {
+	uint64_t stack[STACK_DEPTH];
+	int top = -1;
+	while (true) {
+		unsigned char op = *code++;
+		uint64_t x, y;
+		switch (op) {
+		case OP_RETURN:
+			return stack[top];
+		case OP_KEY: case OP_VALUE: case OP_A: case OP_B: case OP_A_LENGTH: case OP_B_LENGTH:
+			stack[++top] = inputs[op];
+			continue;
+		case OP_CONSTANT:
+			memcpy(&stack[++top], code, 8);
+			code += 8;
+			continue;
+		case OP_I_TO_D:
+			stack[top] = from_double((double)(int64_t)stack[top]);
+			continue;
+		case OP_D_TO_I:
+			stack[top] = (uint64_t)(int64_t)as_double(stack[top]);
+			continue;
+		case OP_NOT:
+			stack[top] = stack[top] == 0;
+			continue;
+		case OP_DUP:
+			stack[top + 1] = stack[top];
+			top++;
+			continue;
+		case OP_SWAP:
+			x = stack[top];
+			stack[top] = stack[top - 1];
+			stack[top - 1] = x;
+			continue;
+		case OP_SELECT:
+			top -= 2;
+			if (stack[top + 2] == 0)
+				stack[top] = stack[top + 1];
+			continue;
+		}
+		// Everything else is binary.
+		y = stack[top--];
+		x = stack[top];
+		int64_t xi = x, yi = y;
+		double xd = as_double(x), yd = as_double(y);
+		uint64_t& out = stack[top];
+		switch (op) {
+		case OP_ADD_I: out = x + y; break;
+		case OP_SUB_I: out = x - y; break;
+		case OP_MUL_I: out = x * y; break;
+		case OP_MIN_I: out = yi < xi ? y : x; break;
+		case OP_MAX_I: out = xi < yi ? y : x; break;
+		case OP_CMP_I: out = (int64_t)((xi > yi) - (xi < yi)); break;
+		case OP_LT_I: out = xi < yi; break;
+		case OP_ADD_D: out = from_double(xd + yd); break;
+		case OP_SUB_D: out = from_double(xd - yd); break;
+		case OP_MUL_D: out = from_double(xd * yd); break;
+		case OP_MIN_D: out = yd < xd ? y : x; break;
+		case OP_MAX_D: out = xd < yd ? y : x; break;
+		case OP_CMP_D: out = (int64_t)((xd > yd) - (xd < yd)); break;
+		case OP_LT_D: out = xd < yd; break;
+		case OP_EQ: out = x == y; break;
+		}
+	}
+}
+
+// Checks that code only reads inputs it will be given, never over or underflows
+// the stack, and returns exactly one word.
+static bool validate(const string& code, bool base_case) {
+	int depth = 0;
+	for (size_t i=0; i<code.size(); i++) {
+		unsigned char op = code[i];
+		int pops, pushes = 1;
+		switch (op) {
+		case OP_RETURN:
+			return depth == 1 and i + 1 == code.size();
+		case OP_KEY: case OP_VALUE:
+			if (not base_case) return false;
+			pops = 0;
+			break;
+		case OP_A: case OP_B: case OP_A_LENGTH: case OP_B_LENGTH:
+			if (base_case) return false;
+			pops = 0;
+			break;
+		case OP_CONSTANT:
+			if (code.size() - i - 1 < 8) return false;
+			i += 8;
+			pops = 0;
+			break;
+		case OP_I_TO_D: case OP_D_TO_I: case OP_NOT:
+			pops = 1;
+			break;
+		case OP_DUP:
+			pops = 1;
+			pushes = 2;
+			break;
+		case OP_SWAP:
+			pops = 2;
+			pushes = 2;
+			break;
+		case OP_SELECT:
+			pops = 3;
+			break;
+		default:
+			if (op >= OPCODE_COUNT) return false;
+			pops = 2;
+		}
+		if (depth < pops) return false;
+		depth += pushes - pops;
+		if (depth > STACK_DEPTH) return false;
+	}
+	return false;
+}
+
+// Interpreted programs need a context, but the tree only takes plain function
+// pointers, so each gets a slot of its own, and a trampoline compiled for that slot.
+// Slots are never released, as trees may hold their trampolines indefinitely,
+// but identical programs share one.
+static string programs[MAX_INTERPRETED];
+static int programs_used = 0;
+static map<string, int> program_slots;
+static mutex programs_lock;
+
+static int claim_program(const string& code) {
+	lock_guard<mutex> guard(programs_lock);
+	map<string, int>::iterator iter = program_slots.find(code);
+	if (iter != program_slots.end())
+		return iter->second;
+	if (programs_used == MAX_INTERPRETED)
+		return -1;
+	int slot = programs_used++;
+	programs[slot] = code;
+	program_slots[code] = slot;
+	return slot;
+}
+
+template <int slot>
+static void interpreted_base_case(void* key, void* value, AugmentationResult* output) {
+	uint64_t inputs[OP_VALUE + 1];
+	inputs[OP_KEY] = from_pointer(key);
+	inputs[OP_VALUE] = from_pointer(value);
+	output->data.ul = run((const unsigned char*)programs[slot].data(), inputs);
+	output->data_length = 1;
+}
+
+template <int slot>
+static void interpreted_compute(const AugmentationResult* a, const AugmentationResult* b, AugmentationResult* output) {
+	uint64_t inputs[OP_B_LENGTH + 1];
+	inputs[OP_A] = a->data.ul;
+	inputs[OP_B] = b->data.ul;
+	inputs[OP_A_LENGTH] = a->data_length;
+	inputs[OP_B_LENGTH] = b->data_length;
+	// Write output last, as it may be a or b.
+	size_t data_length = a->data_length + b->data_length;
+	output->data.ul = run((const unsigned char*)programs[slot].data(), inputs);
+	output->data_length = data_length;
+}
+
+template <int slot>
+static bool interpreted_compare(const AugmentationResult* a, const AugmentationResult* b) {
+	uint64_t inputs[OP_B_LENGTH + 1];
+	inputs[OP_A] = a->data.ul;
+	inputs[OP_B] = b->data.ul;
+	inputs[OP_A_LENGTH] = a->data_length;
+	inputs[OP_B_LENGTH] = b->data_length;
+	return run((const unsigned char*)programs[slot].data(), inputs) != 0;
+}
+
+template <int slot>
+static int interpreted_cmp(void* a, void* b) {
+	uint64_t inputs[OP_B_LENGTH + 1];
+	inputs[OP_A] = from_pointer(a);
+	inputs[OP_B] = from_pointer(b);
+	inputs[OP_A_LENGTH] = inputs[OP_B_LENGTH] = 1;
+	int64_t result = run((const unsigned char*)programs[slot].data(), inputs);
+	return (result > 0) - (result < 0);
+}
+
+struct Trampolines {
+	void (*base_case[MAX_INTERPRETED])(void*, void*, AugmentationResult*);
+	void (*compute[MAX_INTERPRETED])(const AugmentationResult*, const AugmentationResult*, AugmentationResult*);
+	bool (*compare[MAX_INTERPRETED])(const AugmentationResult*, const AugmentationResult*);
+	int (*cmp[MAX_INTERPRETED])(void*, void*);
+};
+
+template <int count>
+struct FillTrampolines {
+	static void fill(Trampolines* t) {
+		t->base_case[count - 1] = interpreted_base_case<count - 1>;
+		t->compute[count - 1] = interpreted_compute<count - 1>;
+		t->compare[count - 1] = interpreted_compare<count - 1>;
+		t->cmp[count - 1] = interpreted_cmp<count - 1>;
+		FillTrampolines<count - 1>::fill(t);
+	}
+};
+
+template <>
+struct FillTrampolines<0> {
+	static void fill(Trampolines* t) {}
+};
+
+static Trampolines make_trampolines() {
+	Trampolines t;
+	FillTrampolines<MAX_INTERPRETED>::fill(&t);
+	return t;
+}
+
+static const Trampolines trampolines = make_trampolines();
+
+// ===== Unpacking =====
+
+// Returns if code is exactly first, second, op, OP_RETURN, in either order if commutative.
+static bool is_binary(const string& code, unsigned char first, unsigned char second, unsigned char op, bool commutative) {
+	if (code.size() != 4 or (unsigned char)code[2] != op or code[3] != OP_RETURN)
+		return false;
+	if ((unsigned char)code[0] == first and (unsigned char)code[1] == second)
+		return true;
+	return commutative and (unsigned char)code[0] == second and (unsigned char)code[1] == first;
+}
+
+static bool is_constant(const string& code, long long constant) {
+	string expected;
+	emit_constant(expected, constant);
+	expected += (char)OP_RETURN;
+	return code == expected;
+}
+
+static int (*build_cmp_function(const string& code))(void*, void*) {
+	if (not validate(code, false))
+		return NULL;
+	if (is_binary(code, OP_A, OP_B, OP_CMP_I, false))
+		return native_integer_cmp;
+	if (is_binary(code, OP_A, OP_B, OP_CMP_D, false))
+		return native_double_cmp;
+	int slot = claim_program(code);
+	return slot < 0 ? NULL : trampolines.cmp[slot];
+}
+
+static bool build_mem_function(const string& code, void (**output)(void*)) {
+	if (code.empty() or code == string(1, (char)MEM_NONE))
+		*output = NULL;
+	else if (code == string(1, (char)MEM_FREE))
+		*output = free;
+	else
+		return false;
+	return true;
+}
+
+static void (*build_base_case_function(const string& code))(void*, void*, AugmentationResult*) {
+	if (not validate(code, true))
+		return NULL;
+	if (code == string(1, (char)OP_VALUE) + (char)OP_RETURN)
+		return native_value_base_case;
+	if (code == string(1, (char)OP_KEY) + (char)OP_RETURN)
+		return native_key_base_case;
+	if (is_constant(code, 1))
+		return native_count_base_case;
+	int slot = claim_program(code);
+	return slot < 0 ? NULL : trampolines.base_case[slot];
+}
+
+static void (*build_compute_function(const string& code))(const AugmentationResult*, const AugmentationResult*, AugmentationResult*) {
+	if (not validate(code, false))
+		return NULL;
+#define NATIVE_COMPUTE(type, op) \
+	if (is_binary(code, OP_A, OP_B, op, true)) \
+		return native_compute<type, op>;
+	NATIVE_COMPUTE(long long, OP_ADD_I)
+	NATIVE_COMPUTE(long long, OP_MIN_I)
+	NATIVE_COMPUTE(long long, OP_MAX_I)
+	NATIVE_COMPUTE(double, OP_ADD_D)
+	NATIVE_COMPUTE(double, OP_MIN_D)
+	NATIVE_COMPUTE(double, OP_MAX_D)
+#undef NATIVE_COMPUTE
+	int slot = claim_program(code);
+	return slot < 0 ? NULL : trampolines.compute[slot];
+}
+
+static bool (*build_compare_function(const string& code))(const AugmentationResult*, const AugmentationResult*) {
+	if (not validate(code, false))
+		return NULL;
+	if (is_binary(code, OP_A, OP_B, OP_EQ, true))
+		return native_equal;
+	int slot = claim_program(code);
+	return slot < 0 ? NULL : trampolines.compare[slot];
+}
+
+static Builtin recognize_builtin(const Augmentation& aug) {
+	if (aug.compare != native_equal)
+		return BUILTIN_NONE;
+	if (aug.base_case == native_count_base_case)
+		return aug.compute == native_compute<long long, OP_ADD_I> ? BUILTIN_COUNT : BUILTIN_NONE;
+	if (aug.base_case != native_value_base_case)
+		return BUILTIN_NONE;
+#define RECOGNIZE(type, op, builtin) \
+	if (aug.compute == native_compute<type, op>) \
+		return builtin;
+	RECOGNIZE(long long, OP_ADD_I, BUILTIN_SUM_I64)
+	RECOGNIZE(long long, OP_MIN_I, BUILTIN_MIN_I64)
+	RECOGNIZE(long long, OP_MAX_I, BUILTIN_MAX_I64)
+	RECOGNIZE(double, OP_ADD_D, BUILTIN_SUM_F64)
+	RECOGNIZE(double, OP_MIN_D, BUILTIN_MIN_F64)
+	RECOGNIZE(double, OP_MAX_D, BUILTIN_MAX_F64)
+#undef RECOGNIZE
+	return BUILTIN_NONE;
+}
+
+// Reads the next length prefixed chunk, returning false if there isn't one.
+static bool read_chunk(size_t& length, const char*& desc, string* chunk) {
+	if (length < 4) return false;
+	uint32_t chunk_size;
+	memcpy(&chunk_size, desc, 4);
+	if (length - 4 < chunk_size) return false;
+	chunk->assign(desc + 4, chunk_size);
 	desc += 4 + chunk_size;
 	length -= 4 + chunk_size;
-	return new function<int(void*,void*)>([=data](void* a, void* b) -> void {
-		return (long long)a > (long long)b;
-	});
+	return true;
 }
 
 // Guarantees the input is for this version of UncannyQuery.
@@ -37,30 +426,89 @@ static bool verify_string(size_t length, const char* s, uint32_t distinguisher)
 
 // Takes in a compiled description of a tree, and outputs it.
 Tree* UncannyQuery::unpack_tree(size_t length, const char* desc) {
-	assert(verify_string(length, desc, TREE_DISTINGUISHER));
+	if (not verify_string(length, desc, TREE_DISTINGUISHER))
+		return NULL;
 	desc += HEADER_LENGTH;
+	length -= HEADER_LENGTH;
+	string cmp, key_mem, value_mem;
+	if (not (read_chunk(length, desc, &cmp) and read_chunk(length, desc, &key_mem) and read_chunk(length, desc, &value_mem)) or length != 0)
+		return NULL;
+	void (*key_deallocator)(void*);
+	void (*value_deallocator)(void*);
+	if (not build_mem_function(key_mem, &key_deallocator) or not build_mem_function(value_mem, &value_deallocator))
+		return NULL;
+	int (*cmp_f)(void*, void*) = build_cmp_function(cmp);
+	if (cmp_f == NULL)
+		return NULL;
 	Tree* tree = new Tree();
-	tree->cmp_f = build_cmp_function(length, desc);
-	tree->key_deallocator = build_mem_function(length, desc);
-	tree->value_deallocator = build_mem_function(length, desc);
+	tree->cmp_f = cmp_f;
+	tree->key_deallocator = key_deallocator;
+	tree->value_deallocator = value_deallocator;
 	return tree;
 }
 
 // Takes in a compiled description of an augmentation and a tree,
-// and returns the described augmentation.
-void UncannyQuery::unpack_augmentation(Tree* tree, size_t length, const char* desc) {
-	assert(verify_string(desc_length, desc, AUGMENTATION_DISTINGUISHER));
+// and registers the described augmentation with the tree.
+int UncannyQuery::unpack_augmentation(Tree* tree, size_t length, const char* desc) {
+	if (not verify_string(length, desc, AUGMENTATION_DISTINGUISHER))
+		return -1;
 	desc += HEADER_LENGTH;
-	Augmentation aug;
-	aug.base_case = build_base_case_function(length, desc);
-	aug.compute = build_compute_function(length, desc);
-	aug.compare = build_compare_function(length, desc);
-	tree->aug_ctx.new_augmentation(&aug);
-	return NULL;
+	length -= HEADER_LENGTH;
+	string base_case, compute, compare;
+	if (not (read_chunk(length, desc, &base_case) and read_chunk(length, desc, &compute) and read_chunk(length, desc, &compare)) or length != 0)
+		return -1;
+	// Check every program before claiming slots for any.
+	if (not validate(base_case, true) or not validate(compute, false) or not validate(compare, false))
+		return -1;
+	Augmentation aug(build_base_case_function(base_case), build_compute_function(compute), build_compare_function(compare));
+	if (aug.base_case == NULL or aug.compute == NULL or aug.compare == NULL)
+		return -1;
+	// Whole augmentations the tree has builtins for are evaluated inline, without even native calls.
+	Builtin builtin = recognize_builtin(aug);
+	if (builtin != BUILTIN_NONE)
+		aug = Augmentation(builtin);
+	return tree->aug_ctx.new_augmentation(&aug);
+}
+
+// ===== Writing descriptions =====
+
+void UncannyQuery::emit_constant(string& program, long long constant) {
+	program += (char)OP_CONSTANT;
+	program.append((const char*)&constant, 8);
+}
+
+void UncannyQuery::emit_constant(string& program, double constant) {
+	program += (char)OP_CONSTANT;
+	program.append((const char*)&constant, 8);
+}
+
+static string header(uint32_t distinguisher) {
+	uint32_t version = UNCANNY_QUERY_INTERNAL_VERSION_NUMBER;
+	string s("\1Uncanny", 8);
+	s.append((const char*)&version, 4);
+	s.append((const char*)&distinguisher, 4);
+	return s;
+}
+
+static void append_chunk(string& desc, const string& chunk) {
+	uint32_t chunk_size = chunk.size();
+	desc.append((const char*)&chunk_size, 4);
+	desc += chunk;
+}
+
+string UncannyQuery::describe_tree(const string& cmp, int key_mem, int value_mem) {
+	string desc = header(TREE_DISTINGUISHER);
+	append_chunk(desc, cmp);
+	append_chunk(desc, key_mem == MEM_NONE ? string() : string(1, (char)key_mem));
+	append_chunk(desc, value_mem == MEM_NONE ? string() : string(1, (char)value_mem));
+	return desc;
 }
 
-int main() {
-	auto x = build_cmp_function(4, "\0\0\0\0");
-	cout << x((void*)5, (void*)4) << endl;
+string UncannyQuery::describe_augmentation(const string& base_case, const string& compute, const string& compare) {
+	string desc = header(AUGMENTATION_DISTINGUISHER);
+	append_chunk(desc, base_case);
+	append_chunk(desc, compute);
+	append_chunk(desc, compare);
+	return desc;
 }
 
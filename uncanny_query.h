@@ -1,10 +1,29 @@
 // Uncanny query
+// Trees and augmentations described at runtime, by serialized descriptions,
+// so augmentations can be defined without recompiling anything.
+//
+// A description is the 16 byte header ("\1Uncanny", the version number, and a
+// distinguisher), followed by chunks, each a uint32_t byte count then that many
+// bytes. A tree description has three chunks: a comparator program, then the
+// key and value deallocators (empty for none, or a single MEM_FREE byte).
+// An augmentation description has three programs: base case, compute, compare.
+//
+// Programs are bytecode for a small stack machine over 64 bit words, ending
+// in OP_RETURN with one word on the stack. Keys, values and results are taken as
+// their 64 bit patterns, and each arithmetic op says whether it treats words as
+// int64s or doubles. Base cases may push OP_KEY and OP_VALUE, the others
+// OP_A and OP_B.
+// Common programs, like sums, minimums, maximums and counts over int64s or
+// doubles, are recognized when unpacked, and run as native functions rather
+// than through the interpreter at all.
 
 #ifndef _UNCANNY_QUERY_HEADER
 #define _UNCANNY_QUERY_HEADER
 
 #define UNCANNY_QUERY_INTERNAL_VERSION_NUMBER 1
 
+#include <string>
+
 #include "uncanny.h"
 
 namespace UncannyQuery {
@@ -12,10 +31,59 @@ namespace UncannyQuery {
 enum {
 	TREE_DISTINGUISHER,
 	AUGMENTATION_DISTINGUISHER,
+	SNAPSHOT_DISTINGUISHER,
+	LOG_DISTINGUISHER,
+	CHECKPOINT_DISTINGUISHER,
+};
+
+enum {
+	MEM_NONE,
+	MEM_FREE,
 };
 
+enum Opcode {
+	OP_RETURN,
+	// Push an input: the key and value for base cases, the two results otherwise.
+	OP_KEY,
+	OP_VALUE,
+	OP_A,
+	OP_B,
+	// Push the next eight bytes of the program.
+	OP_CONSTANT,
+	// Push the data_length of A or B.
+	OP_A_LENGTH,
+	OP_B_LENGTH,
+	// Binary ops pop y, then x, and push x op y.
+	// CMP pushes 1, 0 or -1, and LT and EQ push 1 or 0.
+	OP_ADD_I, OP_SUB_I, OP_MUL_I, OP_MIN_I, OP_MAX_I, OP_CMP_I, OP_LT_I,
+	OP_ADD_D, OP_SUB_D, OP_MUL_D, OP_MIN_D, OP_MAX_D, OP_CMP_D, OP_LT_D,
+	OP_EQ,
+	// Conversions between int64 and double, and logical not.
+	OP_I_TO_D,
+	OP_D_TO_I,
+	OP_NOT,
+	// Pops c, then y, then x, and pushes c ? x : y.
+	OP_SELECT,
+	OP_DUP,
+	OP_SWAP,
+	OPCODE_COUNT,
+};
+
+// Interpreted programs are run by a fixed number of native trampolines, so
+// no more than this many distinct programs can be interpreted per process.
+// Unpacking the same program again reuses its trampoline.
+static const int MAX_INTERPRETED = 64;
+
+// Returns NULL if the description is malformed, or too many programs need interpreting.
 Uncanny::Tree* unpack_tree(size_t length, const char* desc);
-void unpack_augmentation(Uncanny::Tree* tree, size_t length, const char* desc);
+// Registers the described augmentation with tree, and returns its aug_id, or -1 as above.
+int unpack_augmentation(Uncanny::Tree* tree, size_t length, const char* desc);
+
+// Helpers for writing descriptions.
+void emit_constant(std::string& program, long long constant);
+void emit_constant(std::string& program, double constant);
+std::string describe_tree(const std::string& cmp, int key_mem, int value_mem);
+std::string describe_augmentation(const std::string& base_case, const std::string& compute, const std::string& compare);
 
 }
 
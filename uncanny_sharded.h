@@ -0,0 +1,322 @@
+// Uncanny sharded trees.
+// BasicShardedTree splits the key space into ranges, each held by its own
+// BasicTree under its own lock. Writes to different shards go ahead in parallel,
+// so ingest scales with cores, while every shard is still just a plain tree.
+//
+// Shard i holds the keys from bounds[i-1] inclusive up to bounds[i] exclusive;
+// the first shard has no lower bound and the last no upper one. Augmentation
+// queries lock every shard their range touches, in shard order, then combine
+// each shard's result with the augmentation's own compute, in key order, since
+// compute needn't be commutative. Locking in shard order also means a query
+// sees all its shards at one instant, so it never misses or double counts
+// entries being moved between them.
+//
+// rebalance moves entries between neighbouring shards, using split and join, so
+// it only holds the two shards involved, and costs O(log n) plus the smaller
+// side that moves pools. Writers and queries elsewhere carry on meanwhile.
+//
+// The bounds are copies of keys that were in the shards when they were set, so
+// the shards mustn't have key deallocators, which would free them from under us
+// once those entries were removed. Keys that own memory need a Key type that
+// copies it, such as std::string.
+
+#ifndef _UNCANNY_SHARDED_HEADER
+#define _UNCANNY_SHARDED_HEADER
+
+#include <assert.h>
+#include <math.h>
+
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
+#include "uncanny.h"
+
+namespace Uncanny {
+
+template <typename Key, typename Value, typename Compare = DefaultCompare<Key>, typename Bundle = Augmentations<> >
+struct BasicShardedTree {
+	typedef BasicTree<Key, Value, Compare, Bundle> Tree;
+	typedef BasicAugmentation<Key, Value> Augmentation;
+
+	struct Shard {
+		std::mutex lock;
+		Tree* tree;
+	};
+
+	Compare cmp_f;
+	std::vector<Shard*> shards;
+	// Only changed by rebalance, holding layout_lock and the shards on both sides.
+	// So it may be read holding either of those.
+	std::vector<Key> bounds;
+	std::mutex layout_lock;
+
+	// bounds must be sorted, and gives bounds.size() + 1 shards.
+	BasicShardedTree(const std::vector<Key>& _bounds, Compare _cmp_f = Compare()) : cmp_f(_cmp_f), bounds(_bounds) {
+		for (size_t i=1; i<bounds.size(); i++)
+			assert(cmp_f(bounds[i-1], bounds[i]) < 0);
+		for (size_t i=0; i<=bounds.size(); i++) {
+			shards.push_back(new Shard());
+			shards[i]->tree = new Tree();
+			shards[i]->tree->cmp_f = cmp_f;
+		}
+	}
+
+	~BasicShardedTree() {
+		for (size_t i=0; i<shards.size(); i++) {
+			delete shards[i]->tree;
+			delete shards[i];
+		}
+	}
+
+	BasicShardedTree(const BasicShardedTree&) = delete;
+	BasicShardedTree& operator=(const BasicShardedTree&) = delete;
+
+	// The shard that bounds say key belongs in.
+	size_t route(const Key& key) {
+		size_t low = 0, high = bounds.size();
+		while (low < high) {
+			size_t mid = low + (high - low) / 2;
+			if (cmp_f(key, bounds[mid]) < 0)
+				high = mid;
+			else
+				low = mid + 1;
+		}
+		return low;
+	}
+
+	// Whether shard i holds key. Call holding shard i's lock.
+	bool owns(size_t i, const Key& key) {
+		return (i == 0 or cmp_f(bounds[i-1], key) <= 0) and (i == bounds.size() or cmp_f(key, bounds[i]) < 0);
+	}
+
+	// Locks and returns the shard holding key, retrying if a rebalance moved it meanwhile.
+	size_t lock_shard(const Key& key) {
+		for (;;) {
+			size_t i;
+			{
+				std::lock_guard<std::mutex> layout(layout_lock);
+				i = route(key);
+			}
+			shards[i]->lock.lock();
+			if (owns(i, key))
+				return i;
+			shards[i]->lock.unlock();
+		}
+	}
+
+	// Locks every shard from the one holding low_key to the one holding high_key,
+	// where NULL means unbounded, and returns the first and last of them.
+	void lock_shards(const Key* low_key, const Key* high_key, size_t* first, size_t* last) {
+		for (;;) {
+			{
+				std::lock_guard<std::mutex> layout(layout_lock);
+				*first = low_key == NULL ? 0 : route(*low_key);
+				*last = high_key == NULL ? bounds.size() : route(*high_key);
+			}
+			for (size_t i=*first; i<=*last; i++)
+				shards[i]->lock.lock();
+			if ((low_key == NULL or owns(*first, *low_key)) and (high_key == NULL or owns(*last, *high_key)))
+				return;
+			unlock_shards(*first, *last);
+		}
+	}
+
+	void unlock_shards(size_t first, size_t last) {
+		for (size_t i=first; i<=last; i++)
+			shards[i]->lock.unlock();
+	}
+
+	void lock_all() {
+		for (size_t i=0; i<shards.size(); i++)
+			shards[i]->lock.lock();
+	}
+
+	// Registers aug with every shard, under the same aug_id.
+	int new_augmentation(Augmentation* aug) {
+		lock_all();
+		int aug_id = -1;
+		for (size_t i=0; i<shards.size(); i++) {
+			int shard_id = shards[i]->tree->aug_ctx.new_augmentation(aug);
+			assert(i == 0 or shard_id == aug_id);
+			aug_id = shard_id;
+		}
+		unlock_shards(0, shards.size() - 1);
+		return aug_id;
+	}
+
+	bool delete_augmentation(int aug_id) {
+		lock_all();
+		bool deleted = false;
+		for (size_t i=0; i<shards.size(); i++)
+			deleted = shards[i]->tree->aug_ctx.delete_augmentation(aug_id);
+		unlock_shards(0, shards.size() - 1);
+		return deleted;
+	}
+
+	void insert(const Key& key, const Value& value) {
+		size_t i = lock_shard(key);
+		shards[i]->tree->insert(key, value);
+		shards[i]->lock.unlock();
+	}
+
+	void remove(const Key& key) {
+		size_t i = lock_shard(key);
+		shards[i]->tree->remove(key);
+		shards[i]->lock.unlock();
+	}
+
+	Value get_default(const Key& key, Value otherwise) {
+		size_t i = lock_shard(key);
+		Value value = shards[i]->tree->get_default(key, otherwise);
+		shards[i]->lock.unlock();
+		return value;
+	}
+
+	// ops must be sorted by key, as for BasicTree::apply_batch. Each shard's part
+	// is applied under its lock in turn, so the batch as a whole isn't atomic.
+	void apply_batch(const typename Tree::BatchOp* ops, size_t n) {
+		size_t start = 0;
+		while (start < n) {
+			size_t i = lock_shard(ops[start].key), end = start + 1;
+			while (end < n and owns(i, ops[end].key))
+				end++;
+			shards[i]->tree->apply_batch(ops + start, end - start);
+			shards[i]->lock.unlock();
+			start = end;
+		}
+	}
+
+	// The total size, as at one instant.
+	size_t size() {
+		lock_all();
+		size_t total = 0;
+		for (size_t i=0; i<shards.size(); i++)
+			total += shards[i]->tree->size();
+		unlock_shards(0, shards.size() - 1);
+		return total;
+	}
+
+	// Runs query against each shard that might hold keys in [low_key, high_key],
+	// where NULL means unbounded, and combines the results in key order.
+	template <typename Query>
+	size_t merge_shards(int aug_id, const Key* low_key, const Key* high_key, Query query, AugmentationResult* output) {
+		size_t first, last, elements = 0;
+		lock_shards(low_key, high_key, &first, &last);
+		assert(shards[first]->tree->aug_ctx.augs.count(aug_id) == 1);
+		const Augmentation* aug = &shards[first]->tree->aug_ctx.augs[aug_id];
+		AugmentationResult partial;
+		_UNCANNY_RESULT_BUFFER(aug->result_size, partial);
+		for (size_t i=first; i<=last; i++) {
+			size_t length = query(*shards[i]->tree, &partial);
+			append_augmentation(aug, &partial, length, output, &elements);
+		}
+		unlock_shards(first, last);
+		return elements;
+	}
+
+	size_t augment_range(int aug_id, const Key& low_key, bool low_inclusive, const Key& high_key, bool high_inclusive, AugmentationResult* output) {
+		int comparison = cmp_f(low_key, high_key);
+		// As with BasicTree, the interval [x, x) is ambiguous, so we won't handle it.
+		assert(comparison != 0 or low_inclusive == high_inclusive);
+		if (comparison > 0)
+			return 0;
+		return merge_shards(aug_id, &low_key, &high_key, [&](Tree& tree, AugmentationResult* partial) {
+			return tree.augment_range(aug_id, low_key, low_inclusive, high_key, high_inclusive, partial);
+		}, output);
+	}
+
+	// Same comparison_type convention as BasicTree::augment_cut.
+	size_t augment_cut(int aug_id, const Key& key, int comparison_type, AugmentationResult* output) {
+		assert(comparison_type >= -2 and comparison_type <= 2 and comparison_type != 0);
+		return merge_shards(aug_id, comparison_type < 0 ? NULL : &key, comparison_type < 0 ? &key : NULL,
+			[&](Tree& tree, AugmentationResult* partial) {
+			return tree.augment_cut(aug_id, key, comparison_type, partial);
+		}, output);
+	}
+
+	size_t augment_lt(int aug_id, const Key& key, AugmentationResult* output) { return augment_cut(aug_id, key, -2, output); }
+	size_t augment_lte(int aug_id, const Key& key, AugmentationResult* output) { return augment_cut(aug_id, key, -1, output); }
+	size_t augment_gte(int aug_id, const Key& key, AugmentationResult* output) { return augment_cut(aug_id, key, 1, output); }
+	size_t augment_gt(int aug_id, const Key& key, AugmentationResult* output) { return augment_cut(aug_id, key, 2, output); }
+
+	// Moves the bound between shards i and i + 1 so that shard i holds left_target
+	// entries, or as near as it can while leaving shard i + 1 at least one.
+	// Returns how many entries moved.
+	size_t rebalance(size_t i, size_t left_target) {
+		assert(i + 1 < shards.size());
+		std::lock_guard<std::mutex> left_lock(shards[i]->lock);
+		std::lock_guard<std::mutex> right_lock(shards[i + 1]->lock);
+		Tree* left = shards[i]->tree;
+		Tree* right = shards[i + 1]->tree;
+		// The new bound outlives the entry it's copied from; see above.
+		assert(left->key_deallocator == NULL and right->key_deallocator == NULL);
+		size_t left_size = left->size(), total = left_size + right->size();
+		// The new bound has to be some entry's key.
+		left_target = std::min(left_target, total == 0 ? 0 : total - 1);
+		if (left_target == left_size)
+			return 0;
+		Tree* moving = new Tree();
+		Key bound;
+		if (left_size > left_target) {
+			// The top of the left shard moves to the bottom of the right.
+			bound = left->select(left_target)->key;
+			left->split(bound, *moving);
+			right->join(*moving);
+		} else {
+			// The bottom of the right shard moves to the top of the left.
+			bound = right->select(left_target - left_size)->key;
+			right->split(bound, *moving);
+			left->join(*right);
+			shards[i + 1]->tree = moving;
+			moving = right;
+		}
+		delete moving;
+		std::lock_guard<std::mutex> layout(layout_lock);
+		bounds[i] = bound;
+		return left_size > left_target ? left_size - left_target : left_target - left_size;
+	}
+
+	size_t shard_size(size_t i) {
+		std::lock_guard<std::mutex> lock(shards[i]->lock);
+		return shards[i]->tree->size();
+	}
+
+	// Moves bounds until every shard is within slack of the average size, as a
+	// fraction of it, or nothing more can move. Each pass sweeps left to right,
+	// handing each shard its share, so even a badly skewed layout takes at most
+	// one pass per shard. Returns how many entries moved.
+	size_t rebalance_all(double slack = 0.1) {
+		size_t moved = 0, n = shards.size();
+		for (size_t pass=0; pass<n; pass++) {
+			std::vector<size_t> sizes(n);
+			size_t total = 0;
+			for (size_t i=0; i<n; i++)
+				total += sizes[i] = shard_size(i);
+			double average = (double)total / n;
+			bool balanced = true;
+			for (size_t i=0; i<n; i++)
+				balanced = balanced and fabs(sizes[i] - average) <= slack * average + 1;
+			if (balanced)
+				break;
+			size_t before = 0, moved_now = 0;
+			for (size_t i=0; i+1<n; i++) {
+				// The first i + 1 shards should hold their share between them.
+				size_t share = total * (i + 1) / n;
+				moved_now += rebalance(i, share > before ? share - before : 0);
+				before += shard_size(i);
+			}
+			moved += moved_now;
+			if (moved_now == 0)
+				break;
+		}
+		return moved;
+	}
+};
+
+// Shards of the untyped Tree. Set the comparison in the constructor.
+typedef BasicShardedTree<void*, void*, int (*)(void*, void*)> ShardedTree;
+
+}
+
+#endif
@@ -0,0 +1,183 @@
+// Uncanny snapshots.
+// A frozen tree (see BasicTree::freeze) can be saved to a file, and loaded back
+// by mapping the file into memory, so queries are answered straight out of the
+// page cache: loading costs nothing per entry, and processes mapping the same
+// snapshot share one copy of it.
+//
+// The file starts with the same 16 byte header as UncannyQuery descriptions,
+// followed by the rest of a SnapshotHeader, the aug_ids of the saved augmentations
+// in schema order, and then the frozen tree's keys, values, summaries and large
+// results arrays as they are in memory, each aligned to 64 bytes. The tree's shape is implicit
+// in their Eytzinger order. Keys and values are saved bytewise, so must be
+// trivially copyable, and pointers are only meaningful if they encode values.
+// Files are only readable on machines with the same layout as the writer.
+
+#ifndef _UNCANNY_SNAPSHOT_HEADER
+#define _UNCANNY_SNAPSHOT_HEADER
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <type_traits>
+#include <vector>
+
+#include "uncanny.h"
+#include "uncanny_query.h"
+
+namespace Uncanny {
+
+struct SnapshotHeader {
+	// The UncannyQuery header: "\1Uncanny", then the version number and distinguisher.
+	char magic[8];
+	uint32_t version;
+	uint32_t distinguisher;
+	// Checked on load, to catch files written for different types.
+	uint32_t key_size;
+	uint32_t value_size;
+	uint32_t result_size;
+	uint32_t aug_count;
+	uint64_t length;
+	uint64_t results_size;
+	uint64_t aug_ids_offset;
+	uint64_t keys_offset;
+	uint64_t values_offset;
+	uint64_t summaries_offset;
+	uint64_t results_offset;
+	uint64_t file_size;
+};
+
+inline uint64_t snapshot_align(uint64_t offset) {
+	return (offset + 63) & ~(uint64_t)63;
+}
+
+// Fills in every field of header but the magic, for a tree of length entries,
+// with results_size bytes of large results for each (see BasicAugmentationCtx).
+template <typename Key, typename Value>
+void snapshot_layout(SnapshotHeader* header, size_t length, uint32_t aug_count, uint64_t results_size) {
+	header->version = UNCANNY_QUERY_INTERNAL_VERSION_NUMBER;
+	header->distinguisher = UncannyQuery::SNAPSHOT_DISTINGUISHER;
+	header->key_size = sizeof(Key);
+	header->value_size = sizeof(Value);
+	header->result_size = sizeof(AugmentationResult);
+	header->aug_count = aug_count;
+	header->length = length;
+	header->results_size = results_size;
+	header->aug_ids_offset = snapshot_align(sizeof(SnapshotHeader));
+	header->keys_offset = snapshot_align(header->aug_ids_offset + aug_count * sizeof(int32_t));
+	header->values_offset = snapshot_align(header->keys_offset + (length + 1) * sizeof(Key));
+	header->summaries_offset = snapshot_align(header->values_offset + (length + 1) * sizeof(Value));
+	header->results_offset = snapshot_align(header->summaries_offset + (length + 1) * aug_count * sizeof(AugmentationResult));
+	header->file_size = header->results_offset + (length + 1) * results_size;
+}
+
+// Writes bytes at offset, padding with zeros from wherever the file is up to now.
+inline bool snapshot_write_at(FILE* file, uint64_t* position, uint64_t offset, const void* data, size_t bytes) {
+	static const char zeros[64] = {0};
+	assert(offset >= *position and offset - *position <= sizeof(zeros));
+	if (fwrite(zeros, 1, offset - *position, file) != offset - *position)
+		return false;
+	if (bytes != 0 and fwrite(data, 1, bytes, file) != bytes)
+		return false;
+	*position = offset + bytes;
+	return true;
+}
+
+// Returns false if the file couldn't be written.
+template <typename Key, typename Value, typename Compare>
+bool save_snapshot(const BasicFrozenTree<Key, Value, Compare>& frozen, const char* path) {
+	static_assert(std::is_trivially_copyable<Key>::value and std::is_trivially_copyable<Value>::value,
+		"snapshots store keys and values bytewise");
+	SnapshotHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "\1Uncanny", 8);
+	snapshot_layout<Key, Value>(&header, frozen.length, frozen.aug_ctx.augs.size(), frozen.aug_ctx.results_size);
+	// The map is ordered by aug_id, as is the schema.
+	std::vector<int32_t> aug_ids;
+	for (typename std::map<int, BasicAugmentation<Key, Value> >::const_iterator iter = frozen.aug_ctx.augs.begin(); iter != frozen.aug_ctx.augs.end(); iter++)
+		aug_ids.push_back(iter->first);
+	FILE* file = fopen(path, "wb");
+	if (file == NULL)
+		return false;
+	uint64_t position = 0;
+	size_t slots = frozen.length + 1;
+	bool ok = snapshot_write_at(file, &position, 0, &header, sizeof(header))
+		and snapshot_write_at(file, &position, header.aug_ids_offset, aug_ids.data(), aug_ids.size() * sizeof(int32_t))
+		and snapshot_write_at(file, &position, header.keys_offset, frozen.key_data, slots * sizeof(Key))
+		and snapshot_write_at(file, &position, header.values_offset, frozen.value_data, slots * sizeof(Value))
+		and snapshot_write_at(file, &position, header.summaries_offset, frozen.summary_data, slots * aug_ids.size() * sizeof(AugmentationResult))
+		and snapshot_write_at(file, &position, header.results_offset, frozen.result_data, slots * frozen.aug_ctx.results_size);
+	if (fclose(file) != 0)
+		ok = false;
+	return ok;
+}
+
+// Replaces frozen's contents with a view of the snapshot file at path.
+// frozen.aug_ctx must already hold exactly the augmentations that were saved,
+// under the same aug_ids, and frozen.cmp_f the same ordering.
+// Returns false, leaving frozen alone, if the file is unreadable or doesn't match.
+template <typename Key, typename Value, typename Compare>
+bool load_snapshot(BasicFrozenTree<Key, Value, Compare>& frozen, const char* path) {
+	static_assert(std::is_trivially_copyable<Key>::value and std::is_trivially_copyable<Value>::value,
+		"snapshots store keys and values bytewise");
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat info;
+	void* address = MAP_FAILED;
+	if (fstat(fd, &info) == 0 and (size_t)info.st_size >= sizeof(SnapshotHeader))
+		address = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	// The mapping stays valid without the descriptor.
+	close(fd);
+	if (address == MAP_FAILED)
+		return false;
+	size_t file_size = info.st_size;
+	std::shared_ptr<const void> mapping(address, [file_size](const void* address) {
+		munmap((void*)address, file_size);
+	});
+	const char* base = (const char*)address;
+	const SnapshotHeader* header = (const SnapshotHeader*)base;
+	// The file is untrusted, so its length is bounded by the file's size before
+	// the layout is worked out from it, lest the offsets overflow.
+	uint32_t aug_count = frozen.aug_ctx.augs.size();
+	uint64_t widest = aug_count * sizeof(AugmentationResult);
+	if (widest < sizeof(Key))
+		widest = sizeof(Key);
+	if (widest < sizeof(Value))
+		widest = sizeof(Value);
+	if (widest < frozen.aug_ctx.results_size)
+		widest = frozen.aug_ctx.results_size;
+	if (header->length >= file_size / widest)
+		return false;
+	SnapshotHeader expected;
+	snapshot_layout<Key, Value>(&expected, header->length, aug_count, frozen.aug_ctx.results_size);
+	if (memcmp(header->magic, "\1Uncanny", 8) != 0 or memcmp(&header->version, &expected.version, sizeof(SnapshotHeader) - 8) != 0)
+		return false;
+	if (file_size < header->file_size or file_size < header->aug_ids_offset + (uint64_t)aug_count * sizeof(int32_t))
+		return false;
+	const int32_t* aug_ids = (const int32_t*)(base + header->aug_ids_offset);
+	typename std::map<int, BasicAugmentation<Key, Value> >::const_iterator iter = frozen.aug_ctx.augs.begin();
+	for (uint32_t i=0; i<header->aug_count; i++, iter++)
+		if (iter->first != aug_ids[i])
+			return false;
+	frozen.keys.clear();
+	frozen.values.clear();
+	frozen.summaries.clear();
+	frozen.results.clear();
+	frozen.length = header->length;
+	frozen.key_data = (const Key*)(base + header->keys_offset);
+	frozen.value_data = (const Value*)(base + header->values_offset);
+	frozen.summary_data = (const AugmentationResult*)(base + header->summaries_offset);
+	frozen.result_data = base + header->results_offset;
+	frozen.mapping = mapping;
+	return true;
+}
+
+}
+
+#endif
+
@@ -0,0 +1,555 @@
+// Uncanny write-ahead logging.
+// BasicDurableTree wraps a BasicTree. It appends every insert and remove to a
+// log in a directory, and now and then checkpoints the whole tree, so that after
+// a crash open() rebuilds the tree from the latest checkpoint plus the log after it.
+//
+// Writes are group committed. Records are appended to a buffer in memory, and a
+// background thread writes out and fdatasyncs the whole buffer once it passes
+// flush_bytes, or every flush_interval_ms, so one fsync covers many writes.
+// A write is only durable once wait_durable() returns for its log sequence number
+// (or sync() for every write so far). A crash may lose the latest writes, but
+// always leaves the tree as it was after some prefix of them.
+//
+// The log is a series of segments, files named wal-<lsn of their first record in
+// hex>, each starting with the 16 byte UncannyQuery header, then records of
+//   uint32 body length, uint32 checksum of the body,
+//   body: uint64 lsn, uint8 op, the key, and for inserts the value.
+// A checkpoint starts a new segment, then in the background writes checkpoint.tmp
+// and renames it to checkpoint, and only then deletes the older segments. It holds
+//   the 16 byte header, uint64 lsn of the last record it includes, uint64 entry
+//   count, the keys and values in key order, then a uint32 checksum of those.
+// Files are only readable on machines with the same byte order as the writer.
+//
+// Keys and values become bytes through KeyCodec and ValueCodec, each a type with
+//   static void encode(const T& x, std::string& out);
+//   static bool decode(const char** cursor, const char* end, T* x);
+// encode appends to out. decode reads from *cursor, advancing it, and returns
+// false if the bytes before end are malformed. BytewiseCodec suits trivially
+// copyable types, like Tree's void* when they encode integers; pointers to real
+// data need a codec that copies the data out, and allocates a copy to decode into.
+// On replay, removes and inserts of keys already present free the decoded key
+// with the tree's key_deallocator, if it has one, since the tree keeps its own.
+
+#ifndef _UNCANNY_WAL_HEADER
+#define _UNCANNY_WAL_HEADER
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "uncanny.h"
+#include "uncanny_query.h"
+
+namespace Uncanny {
+
+template <typename T>
+struct BytewiseCodec {
+	static_assert(std::is_trivially_copyable<T>::value, "BytewiseCodec stores values bytewise");
+
+	static void encode(const T& x, std::string& out) {
+		out.append((const char*)&x, sizeof(T));
+	}
+
+	static bool decode(const char** cursor, const char* end, T* x) {
+		if ((size_t)(end - *cursor) < sizeof(T))
+			return false;
+		memcpy(x, *cursor, sizeof(T));
+		*cursor += sizeof(T);
+		return true;
+	}
+};
+
+// std::strings, as a uint32 length and then the bytes.
+struct StringCodec {
+	static void encode(const std::string& x, std::string& out) {
+		uint32_t length = x.size();
+		out.append((const char*)&length, sizeof(length));
+		out += x;
+	}
+
+	static bool decode(const char** cursor, const char* end, std::string* x) {
+		uint32_t length;
+		if ((size_t)(end - *cursor) < sizeof(length))
+			return false;
+		memcpy(&length, *cursor, sizeof(length));
+		if ((size_t)(end - *cursor) - sizeof(length) < length)
+			return false;
+		x->assign(*cursor + sizeof(length), length);
+		*cursor += sizeof(length) + length;
+		return true;
+	}
+};
+
+// FNV-1a, to catch torn and garbled records.
+inline uint32_t log_checksum(const char* data, size_t length) {
+	uint32_t hash = 2166136261u;
+	for (size_t i=0; i<length; i++) {
+		hash ^= (unsigned char)data[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+// The UncannyQuery header: "\1Uncanny", then the version number and distinguisher.
+inline std::string log_header(uint32_t distinguisher) {
+	std::string header("\1Uncanny", 8);
+	uint32_t version = UNCANNY_QUERY_INTERNAL_VERSION_NUMBER;
+	header.append((const char*)&version, sizeof(version));
+	header.append((const char*)&distinguisher, sizeof(distinguisher));
+	return header;
+}
+
+inline bool log_write_all(int fd, const char* data, size_t length) {
+	while (length > 0) {
+		ssize_t written = write(fd, data, length);
+		if (written < 0 and errno == EINTR)
+			continue;
+		if (written <= 0)
+			return false;
+		data += written;
+		length -= written;
+	}
+	return true;
+}
+
+inline bool log_read_file(const std::string& path, std::string* contents) {
+	FILE* file = fopen(path.c_str(), "rb");
+	if (file == NULL)
+		return false;
+	char buffer[1 << 16];
+	size_t got;
+	contents->clear();
+	while ((got = fread(buffer, 1, sizeof(buffer), file)) > 0)
+		contents->append(buffer, got);
+	bool ok = not ferror(file);
+	fclose(file);
+	return ok;
+}
+
+// Makes renames and newly created files in directory durable.
+inline bool log_sync_directory(const std::string& directory) {
+	int fd = open(directory.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	bool ok = fsync(fd) == 0;
+	close(fd);
+	return ok;
+}
+
+template <typename Key, typename Value, typename Compare = DefaultCompare<Key>, typename Bundle = Augmentations<>,
+	typename KeyCodec = BytewiseCodec<Key>, typename ValueCodec = BytewiseCodec<Value> >
+struct BasicDurableTree {
+	typedef BasicTree<Key, Value, Compare, Bundle> Tree;
+
+	enum {
+		LOG_INSERT = 1,
+		LOG_REMOVE = 2,
+	};
+
+	// Query this freely, and register augmentations on it, but write only through
+	// the BasicDurableTree, or the writes won't be logged.
+	Tree tree;
+	// Pending records are written out once there are this many bytes of them,
+	// or at least this often. Writers stall if eight times this much is pending.
+	size_t flush_bytes;
+	int flush_interval_ms;
+	// Checkpoint automatically once this much has been logged since the last one,
+	// or never if zero.
+	size_t checkpoint_bytes;
+
+	std::string directory;
+	int log_fd;
+	// Bytes logged since the last checkpoint, including any replayed by open.
+	size_t log_bytes;
+	// Everything below is guarded by log_lock, but for the background checkpoint.
+	std::mutex log_lock;
+	std::condition_variable flush_wanted;
+	std::condition_variable flushed;
+	std::string pending;
+	uint64_t appended_lsn;
+	uint64_t durable_lsn;
+	bool sync_wanted;
+	bool stopping;
+	bool failed;
+	std::thread flusher;
+	std::thread checkpointer;
+	bool checkpoint_ok;
+
+	BasicDurableTree() : flush_bytes(1 << 20), flush_interval_ms(5), checkpoint_bytes(64 << 20), log_fd(-1), log_bytes(0),
+		appended_lsn(0), durable_lsn(0), sync_wanted(false), stopping(false), failed(false), checkpoint_ok(true) {}
+
+	~BasicDurableTree() {
+		close();
+	}
+
+	BasicDurableTree(const BasicDurableTree&) = delete;
+	BasicDurableTree& operator=(const BasicDurableTree&) = delete;
+
+	// Recovers the tree from path, creating the directory if need be, and starts logging to it.
+	// The tree must be empty, and have its comparison and deallocators set already.
+	// Returns false if anything couldn't be read or written, or the log has a hole in it.
+	bool open(const char* path) {
+		assert(log_fd < 0 and tree.size() == 0);
+		directory = path;
+		if (mkdir(path, 0755) != 0 and errno != EEXIST)
+			return false;
+		uint64_t checkpoint_lsn = 0;
+		if (not load_checkpoint(&checkpoint_lsn))
+			return false;
+		uint64_t last = checkpoint_lsn;
+		log_bytes = 0;
+		std::vector<std::pair<uint64_t, std::string> > segments = list_segments();
+		for (unsigned int i=0; i<segments.size(); i++)
+			if (not replay_segment(segments[i].second, checkpoint_lsn, &last))
+				return false;
+		appended_lsn = durable_lsn = last;
+		failed = stopping = sync_wanted = false;
+		if (not start_segment(last + 1))
+			return false;
+		flusher = std::thread(&BasicDurableTree::flush_loop, this);
+		return true;
+	}
+
+	// Makes everything durable and stops logging. Returns false if anything failed since open.
+	bool close() {
+		if (log_fd < 0)
+			return true;
+		bool ok = sync();
+		ok = finish_checkpoint() and ok;
+		{
+			std::lock_guard<std::mutex> lock(log_lock);
+			stopping = true;
+		}
+		flush_wanted.notify_one();
+		flusher.join();
+		::close(log_fd);
+		log_fd = -1;
+		return ok;
+	}
+
+	// Each of these returns the lsn of its last record, for wait_durable.
+	// Once the log has failed they return 0 instead, and leave the tree alone.
+	uint64_t insert(const Key& key, const Value& value) {
+		uint64_t lsn = append(LOG_INSERT, key, &value);
+		if (lsn == 0)
+			return 0;
+		tree.insert(key, value);
+		maybe_checkpoint();
+		return lsn;
+	}
+
+	uint64_t remove(const Key& key) {
+		uint64_t lsn = append(LOG_REMOVE, key, NULL);
+		if (lsn == 0)
+			return 0;
+		tree.remove(key);
+		maybe_checkpoint();
+		return lsn;
+	}
+
+	uint64_t apply_batch(const typename Tree::BatchOp* ops, size_t n) {
+		uint64_t lsn = 0;
+		for (size_t i=0; i<n; i++)
+			if ((lsn = append(ops[i].remove ? LOG_REMOVE : LOG_INSERT, ops[i].key, ops[i].remove ? NULL : &ops[i].value)) == 0)
+				return 0;
+		tree.apply_batch(ops, n);
+		maybe_checkpoint();
+		return lsn;
+	}
+
+	// Blocks until the record lsn, and all before it, are on disk.
+	// Any number of threads may wait at once, and share the fsyncs.
+	// Returns false if the log couldn't be written.
+	bool wait_durable(uint64_t lsn) {
+		std::unique_lock<std::mutex> lock(log_lock);
+		while (durable_lsn < lsn and not failed) {
+			sync_wanted = true;
+			flush_wanted.notify_one();
+			flushed.wait(lock);
+		}
+		return not failed;
+	}
+
+	bool sync() {
+		uint64_t lsn;
+		{
+			std::lock_guard<std::mutex> lock(log_lock);
+			lsn = appended_lsn;
+		}
+		return wait_durable(lsn);
+	}
+
+	// Encodes the tree as it is now, and writes it out in the background.
+	// Returns false if this or the previous checkpoint failed, or the log has;
+	// the log is only ever trimmed once a checkpoint covering it is safely
+	// renamed into place.
+	bool checkpoint() {
+		bool ok = finish_checkpoint();
+		if (not sync())
+			return false;
+		uint64_t lsn = appended_lsn;
+		if (not start_segment(lsn + 1))
+			return false;
+		std::string body;
+		uint64_t count = tree.size();
+		body.append((const char*)&lsn, sizeof(lsn));
+		body.append((const char*)&count, sizeof(count));
+		for (typename Tree::iterator iter = tree.begin(); iter != tree.end(); iter++) {
+			KeyCodec::encode(iter->key, body);
+			ValueCodec::encode(iter->value, body);
+		}
+		log_bytes = 0;
+		checkpointer = std::thread(&BasicDurableTree::write_checkpoint, this, lsn, std::move(body));
+		return ok;
+	}
+
+	// Waits for any checkpoint in progress, and returns false if it failed.
+	bool finish_checkpoint() {
+		if (checkpointer.joinable())
+			checkpointer.join();
+		bool ok = checkpoint_ok;
+		checkpoint_ok = true;
+		return ok;
+	}
+
+	void maybe_checkpoint() {
+		if (checkpoint_bytes != 0 and log_bytes >= checkpoint_bytes)
+			checkpoint();
+	}
+
+	// Returns the new record's lsn, or 0 if the log has failed.
+	uint64_t append(uint8_t op, const Key& key, const Value* value) {
+		std::unique_lock<std::mutex> lock(log_lock);
+		// Don't let the buffer run away from a slow disk.
+		while (pending.size() >= 8 * flush_bytes and not failed) {
+			flush_wanted.notify_one();
+			flushed.wait(lock);
+		}
+		if (failed)
+			return 0;
+		size_t start = pending.size();
+		uint64_t lsn = appended_lsn + 1;
+		pending.append(2 * sizeof(uint32_t), '\0');
+		pending.append((const char*)&lsn, sizeof(lsn));
+		pending += (char)op;
+		KeyCodec::encode(key, pending);
+		if (value != NULL)
+			ValueCodec::encode(*value, pending);
+		size_t body = start + 2 * sizeof(uint32_t);
+		uint32_t header[2] = {(uint32_t)(pending.size() - body), log_checksum(pending.data() + body, pending.size() - body)};
+		memcpy(&pending[start], header, sizeof(header));
+		appended_lsn = lsn;
+		log_bytes += pending.size() - start;
+		if (pending.size() >= flush_bytes)
+			flush_wanted.notify_one();
+		return lsn;
+	}
+
+	void flush_loop() {
+		std::unique_lock<std::mutex> lock(log_lock);
+		for (;;) {
+			flush_wanted.wait_for(lock, std::chrono::milliseconds(flush_interval_ms), [this]() {
+				return stopping or sync_wanted or pending.size() >= flush_bytes;
+			});
+			sync_wanted = false;
+			// After a failed write the log has a hole, so nothing later may follow it.
+			if (failed)
+				pending.clear();
+			if (pending.empty()) {
+				flushed.notify_all();
+				if (stopping)
+					return;
+				continue;
+			}
+			// Write the batch without holding up writers appending the next one.
+			std::string batch;
+			batch.swap(pending);
+			uint64_t last = appended_lsn;
+			int fd = log_fd;
+			lock.unlock();
+			bool ok = log_write_all(fd, batch.data(), batch.size()) and fdatasync(fd) == 0;
+			lock.lock();
+			if (ok)
+				durable_lsn = last;
+			else
+				failed = true;
+			flushed.notify_all();
+		}
+	}
+
+	std::string segment_path(uint64_t first_lsn) {
+		char name[32];
+		snprintf(name, sizeof(name), "/wal-%016llx", (unsigned long long)first_lsn);
+		return directory + name;
+	}
+
+	// Every segment in the directory, in log order.
+	std::vector<std::pair<uint64_t, std::string> > list_segments() {
+		std::vector<std::pair<uint64_t, std::string> > segments;
+		DIR* dir = opendir(directory.c_str());
+		if (dir == NULL)
+			return segments;
+		while (struct dirent* entry = readdir(dir)) {
+			unsigned long long first_lsn;
+			char extra;
+			if (sscanf(entry->d_name, "wal-%16llx%c", &first_lsn, &extra) == 1)
+				segments.push_back(std::make_pair((uint64_t)first_lsn, directory + "/" + entry->d_name));
+		}
+		closedir(dir);
+		std::sort(segments.begin(), segments.end());
+		return segments;
+	}
+
+	// Switches logging to a new segment. Everything logged so far must be durable.
+	bool start_segment(uint64_t first_lsn) {
+		int fd = ::open(segment_path(first_lsn).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+		if (fd < 0)
+			return false;
+		std::string header = log_header(UncannyQuery::LOG_DISTINGUISHER);
+		if (not log_write_all(fd, header.data(), header.size()) or fdatasync(fd) != 0 or not log_sync_directory(directory)) {
+			::close(fd);
+			return false;
+		}
+		int old_fd;
+		{
+			std::lock_guard<std::mutex> lock(log_lock);
+			old_fd = log_fd;
+			log_fd = fd;
+		}
+		if (old_fd >= 0)
+			::close(old_fd);
+		return true;
+	}
+
+	// Replays the records after checkpoint_lsn, which must follow on from *last.
+	// A torn or garbled tail is cut off, so later segments can follow on cleanly.
+	bool replay_segment(const std::string& path, uint64_t checkpoint_lsn, uint64_t* last) {
+		std::string contents;
+		if (not log_read_file(path, &contents))
+			return false;
+		std::string header = log_header(UncannyQuery::LOG_DISTINGUISHER);
+		size_t position = header.size();
+		if (contents.compare(0, header.size(), header) != 0)
+			return contents.size() < header.size() and truncate(path.c_str(), 0) == 0;
+		while (contents.size() - position >= 2 * sizeof(uint32_t)) {
+			uint32_t record[2];
+			memcpy(record, &contents[position], sizeof(record));
+			const char* cursor = contents.data() + position + sizeof(record);
+			const char* end = cursor + record[0];
+			if (contents.size() - position - sizeof(record) < record[0] or log_checksum(cursor, record[0]) != record[1])
+				break;
+			uint64_t lsn;
+			if (record[0] < sizeof(lsn) + 1)
+				break;
+			memcpy(&lsn, cursor, sizeof(lsn));
+			uint8_t op = cursor[sizeof(lsn)];
+			cursor += sizeof(lsn) + 1;
+			position = end - contents.data();
+			log_bytes += sizeof(record) + record[0];
+			if (lsn <= checkpoint_lsn)
+				continue;
+			if (lsn != *last + 1)
+				return false;
+			*last = lsn;
+			Key key;
+			Value value;
+			if (not KeyCodec::decode(&cursor, end, &key))
+				return false;
+			if (op == LOG_INSERT) {
+				if (not ValueCodec::decode(&cursor, end, &value))
+					return false;
+				bool present = tree.get(key) != NULL;
+				tree.insert(key, value);
+				if (present and tree.key_deallocator != NULL)
+					tree.key_deallocator(key);
+			} else {
+				tree.remove(key);
+				if (tree.key_deallocator != NULL)
+					tree.key_deallocator(key);
+			}
+		}
+		if (position < contents.size() and truncate(path.c_str(), position) != 0)
+			return false;
+		return true;
+	}
+
+	// Loads the checkpoint, if there is one, setting *lsn to the last record it covers.
+	bool load_checkpoint(uint64_t* lsn) {
+		std::string contents;
+		if (not log_read_file(directory + "/checkpoint", &contents))
+			return errno == ENOENT;
+		std::string header = log_header(UncannyQuery::CHECKPOINT_DISTINGUISHER);
+		size_t fixed = header.size() + 2 * sizeof(uint64_t);
+		if (contents.size() < fixed + sizeof(uint32_t) or contents.compare(0, header.size(), header) != 0)
+			return false;
+		uint32_t checksum;
+		memcpy(&checksum, contents.data() + contents.size() - sizeof(checksum), sizeof(checksum));
+		const char* cursor = contents.data() + header.size();
+		const char* end = contents.data() + contents.size() - sizeof(checksum);
+		if (log_checksum(cursor, end - cursor) != checksum)
+			return false;
+		uint64_t count;
+		memcpy(lsn, cursor, sizeof(*lsn));
+		memcpy(&count, cursor + sizeof(*lsn), sizeof(count));
+		cursor += 2 * sizeof(uint64_t);
+		std::vector<Key> keys;
+		std::vector<Value> values;
+		keys.reserve(count);
+		values.reserve(count);
+		for (uint64_t i=0; i<count; i++) {
+			keys.push_back(Key());
+			values.push_back(Value());
+			if (not KeyCodec::decode(&cursor, end, &keys.back()) or not ValueCodec::decode(&cursor, end, &values.back()))
+				return false;
+		}
+		if (count != 0)
+			tree.build_from_sorted(keys.data(), values.data(), count);
+		return true;
+	}
+
+	// Runs in the background: writes the checkpoint, then drops the segments it covers.
+	void write_checkpoint(uint64_t lsn, std::string body) {
+		std::string path = directory + "/checkpoint", temp = path + ".tmp";
+		std::string header = log_header(UncannyQuery::CHECKPOINT_DISTINGUISHER);
+		uint32_t checksum = log_checksum(body.data(), body.size());
+		int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		bool ok = fd >= 0 and log_write_all(fd, header.data(), header.size())
+			and log_write_all(fd, body.data(), body.size())
+			and log_write_all(fd, (const char*)&checksum, sizeof(checksum))
+			and fsync(fd) == 0;
+		if (fd >= 0 and ::close(fd) != 0)
+			ok = false;
+		ok = ok and rename(temp.c_str(), path.c_str()) == 0 and log_sync_directory(directory);
+		if (ok) {
+			std::vector<std::pair<uint64_t, std::string> > segments = list_segments();
+			for (unsigned int i=0; i<segments.size(); i++)
+				if (segments[i].first <= lsn)
+					unlink(segments[i].second.c_str());
+		}
+		checkpoint_ok = ok;
+	}
+};
+
+// Logs Tree's void* keys and values as their bit patterns; see BytewiseCodec.
+typedef BasicDurableTree<void*, void*, int (*)(void*, void*)> DurableTree;
+
+}
+
+#endif